@@ -288,6 +288,17 @@ static int add_files(struct dir_struct *dir, int flags)
 		exit_status = 1;
 	}
 
+	if (!(flags & ADD_CACHE_INTENT)) {
+		const char **paths = xcalloc(dir->nr, sizeof(*paths));
+		int nr = 0;
+
+		for (i = 0; i < dir->nr; i++)
+			if (!strstr(dir->entries[i]->name, ".git/"))
+				paths[nr++] = dir->entries[i]->name;
+		prehash_files(paths, nr);
+		free(paths);
+	}
+
 	for (i = 0; i < dir->nr; i++ ) {
 		find = strstr(dir->entries[i]->name, ".git/");
 		if (find)
@@ -298,6 +309,7 @@ static int add_files(struct dir_struct *dir, int flags)
 			exit_status = 1;
 		}
 	}
+	clear_prehashed_files();
 	return exit_status;
 }
 
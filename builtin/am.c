@@ -1564,7 +1564,7 @@ static int run_apply(const struct am_state *state, const char *index_file)
 		return -1;
 
 	/* Reload index as git-apply will have modified it. */
-	discard_cache();
+	discard_cache_to_reread();
 	read_cache_from(index_file ? index_file : get_index_file());
 
 	return 0;
@@ -1640,7 +1640,7 @@ static int fall_back_threeway(const struct am_state *state, const char *index_pa
 
 	say(state, stdout, _("Falling back to patching base and 3-way merge..."));
 
-	discard_cache();
+	discard_cache_to_reread();
 	read_cache();
 
 	/*
@@ -2370,7 +2370,7 @@ static struct commit *fake_working_tree_commit(struct diff_options *opt,
 	 * bits; we are not going to write this index out -- we just
 	 * want to run "diff-index --cached".
 	 */
-	discard_cache();
+	discard_cache_to_reread();
 	read_cache();
 
 	len = strlen(path);
@@ -450,7 +450,7 @@ static const char *prepare_index(int argc, const char **argv, const char *prefix
 	if (list_paths(&partial, !current_head ? NULL : "HEAD", prefix, &pathspec))
 		exit(1);
 
-	discard_cache();
+	discard_cache_to_reread();
 	if (read_cache() < 0)
 		die(_("cannot read the index"));
 
@@ -931,7 +931,7 @@ static int prepare_to_commit(const char *index_file, const char *prefix,
 	 * and write it out as a tree.  We must do this before we invoke
 	 * the editor and after we invoke run_status above.
 	 */
-	discard_cache();
+	discard_cache_to_reread();
 	read_cache_from(index_file);
 	if (update_main_cache_tree(0)) {
 		error(_("Error building trees"));
@@ -0,0 +1,27 @@
+#include "builtin.h"
+#include "cache.h"
+#include "parse-options.h"
+#include "midx.h"
+
+static char const * const multi_pack_index_usage[] = {
+	N_("git multi-pack-index (write | verify)"),
+	NULL
+};
+
+int cmd_multi_pack_index(int argc, const char **argv, const char *prefix)
+{
+	struct option opts[] = {
+		OPT_END(),
+	};
+
+	argc = parse_options(argc, argv, prefix, opts,
+			     multi_pack_index_usage, 0);
+	if (argc != 1)
+		usage_with_options(multi_pack_index_usage, opts);
+
+	if (!strcmp(argv[0], "write"))
+		return !!write_multi_pack_index(get_object_directory());
+	if (!strcmp(argv[0], "verify"))
+		return !!verify_multi_pack_index(get_object_directory());
+	usage_with_options(multi_pack_index_usage, opts);
+}
@@ -383,7 +383,7 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 	/* End of pack replacement. */
 
 	if (delete_redundant) {
-		int opts = 0;
+		int opts = 0, removed = 0;
 		string_list_sort(&names);
 		for_each_string_list_item(item, &existing_packs) {
 			char *sha1;
@@ -391,8 +391,16 @@ int cmd_repack(int argc, const char **argv, const char *prefix)
 			if (len < 40)
 				continue;
 			sha1 = item->string + len - 40;
-			if (!string_list_has_string(&names, sha1))
+			if (!string_list_has_string(&names, sha1)) {
 				remove_redundant_pack(packdir, item->string);
+				removed = 1;
+			}
+		}
+		/* a multi-pack index listing a removed pack is not used */
+		if (removed) {
+			char *midx = mkpathdup("%s/multi-pack-index", packdir);
+			unlink_or_warn(midx);
+			free(midx);
 		}
 		if (!quiet && isatty(2))
 			opts |= PRUNE_PACKED_VERBOSE;
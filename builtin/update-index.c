@@ -15,6 +15,8 @@
 #include "pathspec.h"
 #include "dir.h"
 #include "split-index.h"
+#include "sparse-index.h"
+#include "fsmonitor.h"
 
 /*
  * Default to not allowing changes to the list of files. The
@@ -219,6 +221,7 @@ static int mark_ce_flags(const char *path, int flag, int mark)
 		else
 			active_cache[pos]->ce_flags &= ~flag;
 		active_cache[pos]->ce_flags |= CE_UPDATE_IN_BASE;
+		mark_fsmonitor_invalid(&the_index, active_cache[pos]);
 		cache_tree_invalidate_path(&the_index, path);
 		active_cache_changed |= CE_ENTRY_CHANGED;
 		return 0;
@@ -433,6 +436,7 @@ static void chmod_path(int flip, const char *path)
 	}
 	cache_tree_invalidate_path(&the_index, path);
 	ce->ce_flags |= CE_UPDATE_IN_BASE;
+	mark_fsmonitor_invalid(&the_index, ce);
 	active_cache_changed |= CE_ENTRY_CHANGED;
 	report("chmod %cx '%s'", flip, path);
 	return;
@@ -714,6 +718,9 @@ static int do_reupdate(int ac, const char **av,
 		       PATHSPEC_PREFER_CWD,
 		       prefix, av + 1);
 
+	/* every entry is compared with HEAD */
+	ensure_full_index(&the_index);
+
 	if (read_ref("HEAD", head_sha1))
 		/* If there is no HEAD, that means it is an initial
 		 * commit.  Update everything in the index.
@@ -1013,6 +1020,7 @@ int cmd_update_index(int argc, const char **argv, const char *prefix)
 	if (newfd < 0)
 		lock_error = errno;
 
+	command_requires_full_index = 0;
 	entries = read_cache();
 	if (entries < 0)
 		die("cache corrupted");
@@ -1092,39 +1100,37 @@ int cmd_update_index(int argc, const char **argv, const char *prefix)
 	}
 
 	if (split_index > 0) {
-		init_split_index(&the_index);
+		if (git_config_get_split_index() == 0)
+			warning(_("core.splitIndex is set to false; "
+				  "remove or change it, if you really want to "
+				  "enable split index"));
+		/* a split index is written with a fresh shared index */
+		add_split_index(&the_index);
 		the_index.cache_changed |= SPLIT_INDEX_ORDERED;
-	} else if (!split_index && the_index.split_index) {
-		/*
-		 * can't discard_split_index(&the_index); because that
-		 * will destroy split_index->base->cache[], which may
-		 * be shared with the_index.cache[]. So yeah we're
-		 * leaking a bit here.
-		 */
-		the_index.split_index = NULL;
-		the_index.cache_changed |= SOMETHING_CHANGED;
+	} else if (!split_index) {
+		if (git_config_get_split_index() == 1)
+			warning(_("core.splitIndex is set to true; "
+				  "remove or change it, if you really want to "
+				  "disable split index"));
+		remove_split_index(&the_index);
 	}
 	if (untracked_cache > 0) {
-		struct untracked_cache *uc;
-
 		if (untracked_cache < 2) {
 			setup_work_tree();
 			if (!test_if_untracked_cache_is_supported())
 				return 1;
 		}
-		if (!the_index.untracked) {
-			uc = xcalloc(1, sizeof(*uc));
-			strbuf_init(&uc->ident, 100);
-			uc->exclude_per_dir = ".ptp-gitignore";
-			/* should be the same flags used by git-status */
-			uc->dir_flags = DIR_SHOW_OTHER_DIRECTORIES | DIR_HIDE_EMPTY_DIRECTORIES;
-			the_index.untracked = uc;
-		}
-		add_untracked_ident(the_index.untracked);
-		the_index.cache_changed |= UNTRACKED_CHANGED;
-	} else if (!untracked_cache && the_index.untracked) {
-		the_index.untracked = NULL;
+		add_untracked_cache(&the_index);
 		the_index.cache_changed |= UNTRACKED_CHANGED;
+	} else if (!untracked_cache) {
+		int val;
+
+		/* only a core.untrackedCache set explicitly is worth a warning */
+		if (!git_config_get_maybe_bool("core.untrackedcache", &val) && val)
+			warning(_("core.untrackedCache is true; set it to false "
+				  "or keep if you really want to disable the "
+				  "untracked cache"));
+		remove_untracked_cache(&the_index);
 	}
 
 	if (active_cache_changed) {
@@ -8,6 +8,7 @@
 #include "tree.h"
 #include "cache-tree.h"
 #include "parse-options.h"
+#include "sparse-index.h"
 
 static const char * const write_tree_usage[] = {
 	N_("git write-tree [--missing-ok] [--prefix=<prefix>/]"),
@@ -37,6 +38,10 @@ int cmd_write_tree(int argc, const char **argv, const char *unused_prefix)
 	argc = parse_options(argc, argv, unused_prefix, write_tree_options,
 			     write_tree_usage, 0);
 
+	/* the cache tree finds no prefix inside a sparse directory */
+	if (!prefix)
+		command_requires_full_index = 0;
+
 	ret = write_cache_as_tree(sha1, flags, prefix);
 	switch (ret) {
 	case 0:
@@ -6,11 +6,12 @@
 #include "csum-file.h"
 #include "pack.h"
 #include "strbuf.h"
+#include "thread-utils.h"
 
 static int pack_compression_level = Z_DEFAULT_COMPRESSION;
 
 static struct bulk_checkin_state {
-	unsigned plugged:1;
+	int plugged;	/* nesting depth of plug_bulk_checkin() */
 
 	char *pack_tmp_name;
 	struct sha1file *f;
@@ -20,8 +21,50 @@ static struct bulk_checkin_state {
 	struct pack_idx_entry **written;
 	uint32_t alloc_written;
 	uint32_t nr_written;
+	struct hashmap written_map;
 } state;
 
+struct written_object {
+	struct hashmap_entry ent;
+	const struct pack_idx_entry *idx;
+};
+
+static int written_object_cmp(const struct written_object *a,
+			      const struct written_object *b,
+			      const unsigned char *sha1)
+{
+	return hashcmp(a->idx->sha1, sha1 ? sha1 : b->idx->sha1);
+}
+
+static int in_written_map(struct bulk_checkin_state *state,
+			  const unsigned char *sha1)
+{
+	struct hashmap_entry key;
+
+	if (!state->written_map.tablesize)
+		return 0;
+	hashmap_entry_init(&key, sha1hash(sha1));
+	return !!hashmap_get(&state->written_map, &key, sha1);
+}
+
+static void record_written(struct bulk_checkin_state *state,
+			   struct pack_idx_entry *idx)
+{
+	struct written_object *obj = xmalloc(sizeof(*obj));
+
+	ALLOC_GROW(state->written,
+		   state->nr_written + 1,
+		   state->alloc_written);
+	state->written[state->nr_written++] = idx;
+
+	if (!state->written_map.tablesize)
+		hashmap_init(&state->written_map,
+			     (hashmap_cmp_fn)written_object_cmp, 0);
+	hashmap_entry_init(obj, sha1hash(idx->sha1));
+	obj->idx = idx;
+	hashmap_add(&state->written_map, obj);
+}
+
 static void finish_bulk_checkin(struct bulk_checkin_state *state)
 {
 	struct object_id oid;
@@ -54,6 +97,7 @@ static void finish_bulk_checkin(struct bulk_checkin_state *state)
 
 clear_exit:
 	free(state->written);
+	hashmap_free(&state->written_map, 1);
 	memset(state, 0, sizeof(*state));
 
 	strbuf_release(&packname);
@@ -63,19 +107,12 @@ clear_exit:
 
 static int already_written(struct bulk_checkin_state *state, unsigned char sha1[])
 {
-	int i;
-
 	/* The object may already exist in the repository */
 	if (has_sha1_file(sha1))
 		return 1;
 
-	/* Might want to keep the list sorted */
-	for (i = 0; i < state->nr_written; i++)
-		if (!hashcmp(state->written[i]->sha1, sha1))
-			return 1;
-
-	/* This is a new object we need to keep */
-	return 0;
+	/* This is a new object we need to keep, unless we just wrote it */
+	return in_written_map(state, sha1);
 }
 
 /*
@@ -245,14 +282,64 @@ static int deflate_to_pack(struct bulk_checkin_state *state,
 		free(idx);
 	} else {
 		hashcpy(idx->sha1, result_sha1);
-		ALLOC_GROW(state->written,
-			   state->nr_written + 1,
-			   state->alloc_written);
-		state->written[state->nr_written++] = idx;
+		record_written(state, idx);
 	}
 	return 0;
 }
 
+/*
+ * Like deflate_to_pack(), for an object that is already in memory
+ * and therefore small enough to be deflated in one go.
+ */
+static int deflate_buffer_to_pack(struct bulk_checkin_state *state,
+				  unsigned char result_sha1[],
+				  const void *buf, size_t size,
+				  enum object_type type)
+{
+	git_zstream s;
+	unsigned char *out;
+	unsigned long maxlen, len;
+	unsigned hdrlen;
+	struct pack_idx_entry *idx;
+	int status;
+
+	hash_sha1_file(buf, size, typename(type), result_sha1);
+	if (already_written(state, result_sha1))
+		return 0;
+
+	git_deflate_init(&s, pack_compression_level);
+	maxlen = git_deflate_bound(&s, size) + 32;
+	out = xmalloc(maxlen);
+	hdrlen = encode_in_pack_object_header(type, size, out);
+	s.next_in = (void *)buf;
+	s.avail_in = size;
+	s.next_out = out + hdrlen;
+	s.avail_out = maxlen - hdrlen;
+	while ((status = git_deflate(&s, Z_FINISH)) == Z_OK)
+		; /* nothing */
+	if (status != Z_STREAM_END)
+		die("unexpected deflate failure: %d", status);
+	len = hdrlen + s.total_out;
+	git_deflate_end(&s);
+
+	/* would we bust the size limit? */
+	if (state->nr_written && pack_size_limit_cfg &&
+	    pack_size_limit_cfg < state->offset + len)
+		finish_bulk_checkin(state);
+
+	prepare_to_stream(state, HASH_WRITE_OBJECT);
+	idx = xcalloc(1, sizeof(*idx));
+	idx->offset = state->offset;
+	crc32_begin(state->f);
+	sha1write(state->f, out, len);
+	state->offset += len;
+	idx->crc32 = crc32_end(state->f);
+	hashcpy(idx->sha1, result_sha1);
+	record_written(state, idx);
+	free(out);
+	return 0;
+}
+
 int index_bulk_checkin(unsigned char *sha1,
 		       int fd, size_t size, enum object_type type,
 		       const char *path, unsigned flags)
@@ -264,14 +351,173 @@ int index_bulk_checkin(unsigned char *sha1,
 	return status;
 }
 
+int index_bulk_checkin_buffer(unsigned char *sha1,
+			      const void *buf, size_t size,
+			      enum object_type type)
+{
+	int status = deflate_buffer_to_pack(&state, sha1, buf, size, type);
+	if (!state.plugged)
+		finish_bulk_checkin(&state);
+	return status;
+}
+
+int has_bulk_checkin_sha1(const unsigned char *sha1)
+{
+	return in_written_map(&state, sha1);
+}
+
+static struct loose_batch {
+	unsigned active:1;
+	struct hashmap map;
+} loose_batch;
+
+struct deferred_object {
+	struct hashmap_entry ent;
+	unsigned char sha1[20];
+	char *tmp_file;
+};
+
+static int deferred_object_cmp(const struct deferred_object *a,
+			       const struct deferred_object *b,
+			       const unsigned char *sha1)
+{
+	return hashcmp(a->sha1, sha1 ? sha1 : b->sha1);
+}
+
+#ifndef NO_PTHREADS
+static pthread_mutex_t loose_batch_mutex;
+#define loose_batch_lock()	pthread_mutex_lock(&loose_batch_mutex)
+#define loose_batch_unlock()	pthread_mutex_unlock(&loose_batch_mutex)
+#else
+#define loose_batch_lock()	(void)0
+#define loose_batch_unlock()	(void)0
+#endif
+
+int loose_objects_deferred(void)
+{
+	return loose_batch.active;
+}
+
+int defer_loose_object(const unsigned char *sha1, const char *tmp_file)
+{
+	struct deferred_object *obj;
+
+	loose_batch_lock();
+	obj = hashmap_get_from_hash(&loose_batch.map, sha1hash(sha1), sha1);
+	if (!obj) {
+		obj = xmalloc(sizeof(*obj));
+		hashmap_entry_init(obj, sha1hash(sha1));
+		hashcpy(obj->sha1, sha1);
+		obj->tmp_file = xstrdup(tmp_file);
+		hashmap_add(&loose_batch.map, obj);
+	}
+	loose_batch_unlock();
+	/* another thread wrote the same object meanwhile */
+	if (strcmp(obj->tmp_file, tmp_file))
+		unlink_or_warn(tmp_file);
+	return 0;
+}
+
+const char *deferred_loose_object_path(const unsigned char *sha1)
+{
+	struct deferred_object *obj;
+
+	if (!loose_batch.active)
+		return NULL;
+	loose_batch_lock();
+	obj = hashmap_get_from_hash(&loose_batch.map, sha1hash(sha1), sha1);
+	loose_batch_unlock();
+	return obj ? obj->tmp_file : NULL;
+}
+
+static void begin_loose_batch(void)
+{
+	if (loose_batch.active || !fsync_object_files)
+		return;
+	hashmap_init(&loose_batch.map, (hashmap_cmp_fn)deferred_object_cmp, 0);
+#ifndef NO_PTHREADS
+	pthread_mutex_init(&loose_batch_mutex, NULL);
+#endif
+	loose_batch.active = 1;
+}
+
+/*
+ * Make the contents of the deferred objects durable, either with one
+ * syncfs() of the filesystem of the object directory, or one fsync()
+ * per object; only then may they appear under their real names.
+ */
+static void sync_loose_batch(void)
+{
+	struct hashmap_iter iter;
+	struct deferred_object *obj;
+
+#ifdef HAVE_SYNCFS
+	int fd = open(get_object_directory(), O_RDONLY);
+
+	if (fd >= 0) {
+		int ret = syncfs(fd);
+
+		close(fd);
+		if (!ret) {
+			trace_printf("loose object batch: %u objects, "
+				     "synced with syncfs()\n",
+				     loose_batch.map.size);
+			return;
+		}
+	}
+#endif
+	hashmap_iter_init(&loose_batch.map, &iter);
+	while ((obj = hashmap_iter_next(&iter))) {
+		int fd = open(obj->tmp_file, O_RDONLY);
+
+		if (fd < 0)
+			die_errno("unable to open %s", obj->tmp_file);
+		fsync_or_die(fd, obj->tmp_file);
+		close(fd);
+	}
+	trace_printf("loose object batch: %u objects, synced with fsync()\n",
+		     loose_batch.map.size);
+}
+
+static void finish_loose_batch(void)
+{
+	struct hashmap_iter iter;
+	struct deferred_object *obj;
+	int errs = 0;
+
+	if (!loose_batch.active)
+		return;
+	loose_batch.active = 0;
+
+	if (loose_batch.map.size)
+		sync_loose_batch();
+	hashmap_iter_init(&loose_batch.map, &iter);
+	while ((obj = hashmap_iter_next(&iter))) {
+		if (finalize_object_file(obj->tmp_file, sha1_file_name(obj->sha1)))
+			errs++;
+		free(obj->tmp_file);
+	}
+	hashmap_free(&loose_batch.map, 1);
+	clear_loose_object_cache();
+#ifndef NO_PTHREADS
+	pthread_mutex_destroy(&loose_batch_mutex);
+#endif
+	if (errs)
+		die("unable to write %d new objects", errs);
+}
+
 void plug_bulk_checkin(void)
 {
-	state.plugged = 1;
+	if (state.plugged++)
+		return;
+	begin_loose_batch();
 }
 
 void unplug_bulk_checkin(void)
 {
-	state.plugged = 0;
+	if (--state.plugged)
+		return;
 	if (state.f)
 		finish_bulk_checkin(&state);
+	finish_loose_batch();
 }
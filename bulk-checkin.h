@@ -8,6 +8,34 @@ extern int index_bulk_checkin(unsigned char sha1[],
 			      int fd, size_t size, enum object_type type,
 			      const char *path, unsigned flags);
 
+/*
+ * Write an object that is already in memory (e.g. a tree) to the
+ * pack; the objects of a plugged pack are not visible to
+ * has_sha1_file() until it is unplugged, has_bulk_checkin_sha1()
+ * tells whether one was written to it.
+ */
+extern int index_bulk_checkin_buffer(unsigned char sha1[],
+				     const void *buf, size_t size,
+				     enum object_type type);
+extern int has_bulk_checkin_sha1(const unsigned char sha1[]);
+
+/*
+ * While plugged with core.fsyncObjectFiles set, new loose objects are
+ * not synced and moved into place one by one: write_loose_object()
+ * hands their temporary files to defer_loose_object(), and unplugging
+ * syncs them all with a single barrier before renaming them.  Until
+ * then deferred_loose_object_path() gives the temporary file of such an
+ * object, or NULL.  Both may be called from several threads.
+ */
+extern int loose_objects_deferred(void);
+extern int defer_loose_object(const unsigned char sha1[], const char *tmp_file);
+extern const char *deferred_loose_object_path(const unsigned char sha1[]);
+
+/*
+ * Plugging nests: the pack and the batch of loose objects are only
+ * finished by the unplug_bulk_checkin() that matches the outermost
+ * plug_bulk_checkin().
+ */
 extern void plug_bulk_checkin(void);
 extern void unplug_bulk_checkin(void);
 
@@ -3,11 +3,100 @@
 #include "tree.h"
 #include "tree-walk.h"
 #include "cache-tree.h"
+#include "bulk-checkin.h"
+#include "thread-utils.h"
 
 #ifndef DEBUG
 #define DEBUG 0
 #endif
 
+/*
+ * An update writes the first trees it rebuilds as loose objects, and
+ * the trees beyond those into a single pack, which "gc --auto" merges
+ * with the others once there are gc.autoPackLimit of them.  Inside an
+ * outer plug_bulk_checkin() that pack is only finished, and its trees
+ * readable, when the outer caller unplugs.
+ */
+#define LOOSE_TREES_MAX 64
+
+/*
+ * Entries per thread below which updating the top-level subtrees in
+ * parallel does not pay for starting the threads.
+ */
+#define THREAD_COST 4000
+#define MAX_THREADS 16
+
+struct update_stats {
+	int reused;	/* trees whose object was kept */
+	int rebuilt;	/* trees hashed again */
+};
+
+/* Trees written by the running cache_tree_update() */
+static int trees_written;
+
+#ifndef NO_PTHREADS
+/*
+ * Serializes the writes of the threads of update_in_parallel(): the
+ * count of trees written and the bulk-checkin pack.  Object reads take
+ * the lock of enable_obj_read_lock() instead.
+ */
+static pthread_mutex_t object_mutex;
+static int use_threads;
+
+static inline void object_lock(void)
+{
+	if (use_threads)
+		pthread_mutex_lock(&object_mutex);
+}
+
+static inline void object_unlock(void)
+{
+	if (use_threads)
+		pthread_mutex_unlock(&object_mutex);
+}
+#else
+#define object_lock()
+#define object_unlock()
+#endif
+
+static int has_object(const unsigned char *sha1)
+{
+	int ret;
+
+	if (has_sha1_file(sha1))
+		return 1;
+	object_lock();
+	ret = has_bulk_checkin_sha1(sha1);
+	object_unlock();
+	return ret;
+}
+
+static int write_tree_object(const void *buf, unsigned long len,
+			     unsigned char *sha1)
+{
+	int ret;
+
+	object_lock();
+	/* writing freshens packs and forgets listed loose objects */
+	obj_read_lock();
+	if (trees_written++ < LOOSE_TREES_MAX)
+		ret = write_sha1_file(buf, len, tree_type, sha1);
+	else
+		ret = index_bulk_checkin_buffer(sha1, buf, len, OBJ_TREE);
+	obj_read_unlock();
+	object_unlock();
+	return ret;
+}
+
+static int count_trees(struct cache_tree *it)
+{
+	int i, nr = 1;
+
+	for (i = 0; i < it->subtree_nr; i++)
+		nr += count_trees(it->down[i]->cache_tree);
+	return nr;
+}
+
 struct cache_tree *cache_tree(void)
 {
 	struct cache_tree *it = xcalloc(1, sizeof(struct cache_tree));
@@ -81,6 +170,8 @@ static struct cache_tree_sub *find_subtree(struct cache_tree *it,
 
 	down = xmalloc(sizeof(*down) + pathlen + 1);
 	down->cache_tree = NULL;
+	down->count = 0;
+	down->used = 0;
 	down->namelen = pathlen;
 	memcpy(down->name, path, pathlen);
 	down->name[pathlen] = 0;
@@ -236,13 +327,21 @@ int cache_tree_fully_valid(struct cache_tree *it)
 	return 1;
 }
 
+static int update_in_parallel(struct cache_tree *it,
+			      struct cache_entry **cache,
+			      int entries,
+			      int *skip_count,
+			      int flags,
+			      struct update_stats *stats);
+
 static int update_one(struct cache_tree *it,
 		      struct cache_entry **cache,
 		      int entries,
 		      const char *base,
 		      int baselen,
 		      int *skip_count,
-		      int flags)
+		      int flags,
+		      struct update_stats *stats)
 {
 	struct strbuf buffer;
 	int missing_ok = flags & WRITE_TREE_MISSING_OK;
@@ -255,8 +354,20 @@ static int update_one(struct cache_tree *it,
 
 	*skip_count = 0;
 
-	if (0 <= it->entry_count && has_sha1_file(it->sha1))
+	/* a directory entry of a sparse index is the whole subtree */
+	if (entries && S_ISSPARSEDIR(cache[0]->ce_mode) &&
+	    ce_namelen(cache[0]) == baselen &&
+	    !memcmp(cache[0]->name, base, baselen)) {
+		hashcpy(it->sha1, cache[0]->sha1);
+		it->entry_count = 1;
+		return 1;
+	}
+
+	if (0 <= it->entry_count && has_object(it->sha1)) {
+		stats->reused += count_trees(it);
 		return it->entry_count;
+	}
+	stats->rebuilt++;
 
 	/*
 	 * We first scan for subtrees and update them; we start by
@@ -266,6 +377,13 @@ static int update_one(struct cache_tree *it,
 	for (i = 0; i < it->subtree_nr; i++)
 		it->down[i]->used = 0;
 
+	if (!baselen) {
+		i = update_in_parallel(it, cache, entries, skip_count,
+				       flags, stats);
+		if (i < 0)
+			return i;
+	}
+
 	/*
 	 * Find the subtrees and update them.
 	 */
@@ -293,6 +411,11 @@ static int update_one(struct cache_tree *it,
 		 */
 		sublen = slash - (path + baselen);
 		sub = find_subtree(it, path + baselen, sublen, 1);
+		if (sub->used) {
+			/* updated by update_in_parallel() */
+			i += sub->count;
+			continue;
+		}
 		if (!sub->cache_tree)
 			sub->cache_tree = cache_tree();
 		subcnt = update_one(sub->cache_tree,
@@ -300,7 +423,8 @@ static int update_one(struct cache_tree *it,
 				    path,
 				    baselen + sublen + 1,
 				    &subskip,
-				    flags);
+				    flags,
+				    stats);
 		if (subcnt < 0)
 			return subcnt;
 		if (!subcnt)
@@ -354,7 +478,7 @@ static int update_one(struct cache_tree *it,
 			entlen = pathlen - baselen;
 			i++;
 		}
-		if (mode != S_IFGITLINK && !missing_ok && !has_sha1_file(sha1)) {
+		if (mode != S_IFGITLINK && !missing_ok && !has_object(sha1)) {
 			strbuf_release(&buffer);
 			if (expected_missing)
 				return -1;
@@ -401,7 +525,7 @@ static int update_one(struct cache_tree *it,
 			to_invalidate = 1;
 	} else if (dryrun)
 		hash_sha1_file(buffer.buf, buffer.len, tree_type, it->sha1);
-	else if (write_sha1_file(buffer.buf, buffer.len, tree_type, it->sha1)) {
+	else if (write_tree_object(buffer.buf, buffer.len, it->sha1)) {
 		strbuf_release(&buffer);
 		return -1;
 	}
@@ -416,16 +540,186 @@ static int update_one(struct cache_tree *it,
 	return i;
 }
 
+#ifndef NO_PTHREADS
+struct update_job {
+	struct cache_tree_sub *sub;
+	struct cache_entry **cache;
+	int entries;
+	int skip_count;
+	int result;
+	struct update_stats stats;
+};
+
+struct update_queue {
+	struct update_job *job;
+	int nr, alloc, next;
+	int flags;
+};
+
+static pthread_mutex_t queue_mutex;
+
+static struct update_job *next_update_job(struct update_queue *queue)
+{
+	struct update_job *job = NULL;
+
+	pthread_mutex_lock(&queue_mutex);
+	if (queue->next < queue->nr)
+		job = &queue->job[queue->next++];
+	pthread_mutex_unlock(&queue_mutex);
+	return job;
+}
+
+static void *update_thread(void *_data)
+{
+	struct update_queue *queue = _data;
+	struct update_job *job;
+
+	while ((job = next_update_job(queue)) != NULL) {
+		struct cache_tree_sub *sub = job->sub;
+
+		job->result = update_one(sub->cache_tree,
+					 job->cache, job->entries,
+					 job->cache[0]->name,
+					 sub->namelen + 1,
+					 &job->skip_count,
+					 queue->flags,
+					 &job->stats);
+	}
+	return NULL;
+}
+
+static int update_threads(int entries)
+{
+	return thread_count("GIT_TEST_CACHE_TREE_THREADS", 0, entries,
+			    THREAD_COST, MAX_THREADS);
+}
+
+/*
+ * Update the invalid top-level subtrees of the root in parallel; each
+ * of them covers its own range of the index and its own part of the
+ * cache tree.  The subtrees updated here are marked used, and the
+ * number of entries they cover is left in their count, for the serial
+ * walk of update_one() to skip over.
+ */
+static int update_in_parallel(struct cache_tree *it,
+			      struct cache_entry **cache,
+			      int entries,
+			      int *skip_count,
+			      int flags,
+			      struct update_stats *stats)
+{
+	struct update_queue queue;
+	pthread_t *pthread;
+	int threads = update_threads(entries);
+	int i, ret = 0;
+
+	if (threads < 2)
+		return 0;
+
+	memset(&queue, 0, sizeof(queue));
+	queue.flags = flags;
+	i = 0;
+	while (i < entries) {
+		const char *path = cache[i]->name;
+		const char *slash = strchr(path, '/');
+		struct cache_tree_sub *sub;
+		struct update_job *job;
+		int j, sublen;
+
+		if (!slash) {
+			i++;
+			continue;
+		}
+		sublen = slash - path;
+		for (j = i + 1; j < entries; j++)
+			if (strncmp(cache[j]->name, path, sublen + 1))
+				break;
+		sub = find_subtree(it, path, sublen, 1);
+		if (!sub->cache_tree)
+			sub->cache_tree = cache_tree();
+		if (sub->cache_tree->entry_count < 0) {
+			ALLOC_GROW(queue.job, queue.nr + 1, queue.alloc);
+			job = &queue.job[queue.nr++];
+			memset(job, 0, sizeof(*job));
+			job->sub = sub;
+			job->cache = cache + i;
+			job->entries = j - i;
+		}
+		i = j;
+	}
+	if (threads > queue.nr)
+		threads = queue.nr;
+	if (threads < 2) {
+		free(queue.job);
+		return 0;
+	}
+
+	pthread_mutex_init(&queue_mutex, NULL);
+	pthread_mutex_init(&object_mutex, NULL);
+	enable_obj_read_lock();
+	use_threads = 1;
+	pthread = xcalloc(threads, sizeof(*pthread));
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&pthread[i], NULL, update_thread, &queue))
+			die("unable to create cache-tree update thread");
+	for (i = 0; i < threads; i++)
+		if (pthread_join(pthread[i], NULL))
+			die("unable to join cache-tree update thread");
+	free(pthread);
+	use_threads = 0;
+	disable_obj_read_lock();
+	pthread_mutex_destroy(&object_mutex);
+	pthread_mutex_destroy(&queue_mutex);
+
+	for (i = 0; i < queue.nr; i++) {
+		struct update_job *job = &queue.job[i];
+
+		stats->reused += job->stats.reused;
+		stats->rebuilt += job->stats.rebuilt;
+		if (ret < 0)
+			continue;
+		if (job->result < 0) {
+			ret = job->result;
+			continue;
+		}
+		if (!job->result)
+			die("index cache-tree records empty sub-tree");
+		job->sub->count = job->result;
+		job->sub->used = 1;
+		*skip_count += job->skip_count;
+	}
+	free(queue.job);
+	return ret;
+}
+#else
+static int update_in_parallel(struct cache_tree *it,
+			      struct cache_entry **cache,
+			      int entries,
+			      int *skip_count,
+			      int flags,
+			      struct update_stats *stats)
+{
+	return 0;
+}
+#endif
+
 int cache_tree_update(struct index_state *istate, int flags)
 {
 	struct cache_tree *it = istate->cache_tree;
 	struct cache_entry **cache = istate->cache;
 	int entries = istate->cache_nr;
+	struct update_stats stats = { 0, 0 };
+	uint64_t start = getnanotime();
 	int skip, i = verify_cache(cache, entries, flags);
 
 	if (i)
 		return i;
-	i = update_one(it, cache, entries, "", 0, &skip, flags);
+	trees_written = 0;
+	plug_bulk_checkin();
+	i = update_one(it, cache, entries, "", 0, &skip, flags, &stats);
+	unplug_bulk_checkin();
+	trace_performance_since(start, "cache_tree_update: %d trees reused, "
+				"%d rebuilt", stats.reused, stats.rebuilt);
 	if (i < 0)
 		return i;
 	istate->cache_changed |= CACHE_TREE_CHANGED;
@@ -567,7 +861,7 @@ struct cache_tree *cache_tree_read(const char *buffer, unsigned long size)
 	return read_one(&buffer, &size);
 }
 
-static struct cache_tree *cache_tree_find(struct cache_tree *it, const char *path)
+struct cache_tree *cache_tree_find(struct cache_tree *it, const char *path)
 {
 	if (!it)
 		return NULL;
@@ -677,6 +971,49 @@ static void prime_cache_tree_rec(struct cache_tree *it, struct tree *tree)
 	it->entry_count = cnt;
 }
 
+/*
+ * The directory "path" (with a trailing slash) of a sparse index has
+ * been replaced by the entries of "tree": give its node their count.
+ * Returns by how much the count grew, for the nodes above.
+ */
+static int expand_dir_rec(struct cache_tree *it, const char *path,
+			  struct tree *tree)
+{
+	const char *slash = strchr(path, '/');
+	struct cache_tree_sub *sub;
+	int delta;
+
+	sub = find_subtree(it, path, slash - path, 1);
+	if (!sub->cache_tree)
+		sub->cache_tree = cache_tree();
+	if (slash[1])
+		delta = expand_dir_rec(sub->cache_tree, slash + 1, tree);
+	else {
+		int count = sub->cache_tree->entry_count;
+
+		/*
+		 * An invalidated directory may be about to change below,
+		 * where it had no nodes to record that: leave it all to
+		 * be recomputed.
+		 */
+		cache_tree_free(&sub->cache_tree);
+		sub->cache_tree = cache_tree();
+		if (count < 0)
+			return 0;
+		prime_cache_tree_rec(sub->cache_tree, tree);
+		delta = sub->cache_tree->entry_count - count;
+	}
+	if (it->entry_count >= 0)
+		it->entry_count += delta;
+	return delta;
+}
+
+void cache_tree_expand_dir(struct cache_tree *root, const char *path,
+			   struct tree *tree)
+{
+	expand_dir_rec(root, path, tree);
+}
+
 void prime_cache_tree(struct index_state *istate, struct tree *tree)
 {
 	cache_tree_free(&istate->cache_tree);
@@ -717,6 +1054,86 @@ int cache_tree_matches_traversal(struct cache_tree *root,
 	return 0;
 }
 
+static void verify_one(struct index_state *istate,
+		       struct cache_tree *it,
+		       struct strbuf *path)
+{
+	int i, pos, len = path->len;
+	struct strbuf tree_buf = STRBUF_INIT;
+	unsigned char sha1[20];
+
+	for (i = 0; i < it->subtree_nr; i++) {
+		strbuf_addf(path, "%s/", it->down[i]->name);
+		verify_one(istate, it->down[i]->cache_tree, path);
+		strbuf_setlen(path, len);
+	}
+
+	if (it->entry_count < 0)
+		return;
+
+	if (path->len) {
+		pos = index_name_pos(istate, path->buf, path->len);
+		if (pos >= 0) {
+			/* a directory entry of a sparse index */
+			if (it->entry_count != 1 ||
+			    hashcmp(istate->cache[pos]->sha1, it->sha1))
+				die("BUG: cache-tree for sparse directory %s "
+				    "does not match", path->buf);
+			return;
+		}
+		pos = -pos - 1;
+	} else
+		pos = 0;
+
+	i = 0;
+	while (i < it->entry_count) {
+		const struct cache_entry *ce = istate->cache[pos + i];
+		const char *name = ce->name + path->len;
+		const char *slash = strchr(name, '/');
+		const unsigned char *entry_sha1;
+		unsigned mode;
+		int entlen;
+
+		if (ce->ce_flags & (CE_STAGEMASK | CE_INTENT_TO_ADD | CE_REMOVE))
+			die("BUG: %s with flags 0x%x should not be in cache-tree",
+			    ce->name, ce->ce_flags);
+		if (slash) {
+			struct cache_tree_sub *sub;
+
+			entlen = slash - name;
+			sub = find_subtree(it, name, entlen, 0);
+			if (!sub || sub->cache_tree->entry_count < 0)
+				die("BUG: bad subtree '%.*s'", entlen, name);
+			entry_sha1 = sub->cache_tree->sha1;
+			mode = S_IFDIR;
+			i += sub->cache_tree->entry_count;
+		} else {
+			entry_sha1 = ce->sha1;
+			mode = ce->ce_mode;
+			entlen = ce_namelen(ce) - path->len;
+			i++;
+		}
+		strbuf_addf(&tree_buf, "%o %.*s%c", mode, entlen, name, '\0');
+		strbuf_add(&tree_buf, entry_sha1, 20);
+	}
+	hash_sha1_file(tree_buf.buf, tree_buf.len, tree_type, sha1);
+	if (hashcmp(sha1, it->sha1))
+		die("BUG: cache-tree for path %.*s does not match. "
+		    "Expected %s got %s", len, path->buf,
+		    sha1_to_hex(sha1), sha1_to_hex(it->sha1));
+	strbuf_release(&tree_buf);
+}
+
+void cache_tree_verify(struct index_state *istate)
+{
+	struct strbuf path = STRBUF_INIT;
+
+	if (!istate->cache_tree)
+		return;
+	verify_one(istate, istate->cache_tree, &path);
+	strbuf_release(&path);
+}
+
 int update_main_cache_tree(int flags)
 {
 	if (!the_index.cache_tree)
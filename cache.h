@@ -149,6 +149,7 @@ struct stat_data {
 
 struct cache_entry {
 	struct hashmap_entry ent;
+	unsigned int mem_pool_allocated; /* from the index's ce_mem_pool */
 	struct stat_data ce_stat_data;
 	unsigned int ce_mode;
 	unsigned int ce_flags;
@@ -178,6 +179,7 @@ struct cache_entry {
 #define CE_ADDED             (1 << 19)
 
 #define CE_HASHED            (1 << 20)
+#define CE_FSMONITOR_VALID   (1 << 21)
 #define CE_WT_REMOVE         (1 << 22) /* remove in work directory */
 #define CE_CONFLICTED        (1 << 23)
 
@@ -221,7 +223,7 @@ static inline void copy_cache_entry(struct cache_entry *dst,
 {
 	unsigned int state = dst->ce_flags & CE_HASHED;
 
-	/* Don't copy hash chain and name */
+	/* Don't copy hash chain, allocation state and name */
 	memcpy(&dst->ce_stat_data, &src->ce_stat_data,
 			offsetof(struct cache_entry, name) -
 			offsetof(struct cache_entry, ce_stat_data));
@@ -240,6 +242,8 @@ static inline unsigned create_ce_flags(unsigned stage)
 #define ce_stage(ce) ((CE_STAGEMASK & (ce)->ce_flags) >> CE_STAGESHIFT)
 #define ce_uptodate(ce) ((ce)->ce_flags & CE_UPTODATE)
 #define ce_skip_worktree(ce) ((ce)->ce_flags & CE_SKIP_WORKTREE)
+/* a directory standing for all of its files in a sparse index */
+#define S_ISSPARSEDIR(mode) ((mode) == S_IFDIR)
 #define ce_mark_uptodate(ce) ((ce)->ce_flags |= CE_UPTODATE)
 
 #define ce_permissions(mode) (((mode) & 0100) ? 0755 : 0644)
@@ -298,9 +302,13 @@ static inline unsigned int canon_mode(unsigned int mode)
 #define CACHE_TREE_CHANGED	(1 << 5)
 #define SPLIT_INDEX_ORDERED	(1 << 6)
 #define UNTRACKED_CHANGED	(1 << 7)
+#define FSMONITOR_CHANGED	(1 << 8)
 
 struct split_index;
 struct untracked_cache;
+struct ewah_bitmap;
+struct mem_pool;
+struct index_journal;
 
 struct index_state {
 	struct cache_entry **cache;
@@ -311,11 +319,18 @@ struct index_state {
 	struct split_index *split_index;
 	struct cache_time timestamp;
 	unsigned name_hash_initialized : 1,
-		 initialized : 1;
+		 initialized : 1,
+		 fsmonitor_has_run_once : 1;
+	/* not a bitfield: set by the thread that loads the extensions */
+	unsigned sparse_index;
 	struct hashmap name_hash;
 	struct hashmap dir_hash;
 	unsigned char sha1[20];
 	struct untracked_cache *untracked;
+	char *fsmonitor_last_update;
+	struct ewah_bitmap *fsmonitor_dirty;
+	struct mem_pool *ce_mem_pool;
+	struct index_journal *journal;
 };
 
 extern struct index_state the_index;
@@ -324,6 +339,13 @@ extern struct index_state the_index;
 extern void add_name_hash(struct index_state *istate, struct cache_entry *ce);
 extern void remove_name_hash(struct index_state *istate, struct cache_entry *ce);
 extern void free_name_hash(struct index_state *istate);
+/*
+ * Keep the hashes of an index that is about to be discarded, for the
+ * next lazy_init_name_hash() to take back if it finds the same index.
+ */
+extern void stash_name_hash(struct index_state *istate);
+/* Build the name hash now, e.g. before threads start looking things up */
+extern void lazy_init_name_hash(struct index_state *istate);
 
 
 #ifndef NO_THE_INDEX_COMPATIBILITY_MACROS
@@ -339,6 +361,7 @@ extern void free_name_hash(struct index_state *istate);
 #define is_cache_unborn() is_index_unborn(&the_index)
 #define read_cache_unmerged() read_index_unmerged(&the_index)
 #define discard_cache() discard_index(&the_index)
+#define discard_cache_to_reread() discard_index_to_reread(&the_index)
 #define unmerged_cache() unmerged_index(&the_index)
 #define cache_name_pos(name, namelen) index_name_pos(&the_index,(name),(namelen))
 #define add_cache_entry(ce, option) add_index_entry(&the_index, (ce), (option))
@@ -509,15 +532,27 @@ extern int daemonize(void);
 struct lock_file;
 extern int read_index(struct index_state *);
 extern int read_index_preload(struct index_state *, const struct pathspec *pathspec);
+extern void preload_index(struct index_state *, const struct pathspec *pathspec);
+extern void prehash_files(const char **paths, int nr);
+extern int find_prehashed_file(const char *path, struct stat *st, unsigned char *sha1);
+extern void clear_prehashed_files(void);
 extern int do_read_index(struct index_state *istate, const char *path,
 			 int must_exist); /* for testting only! */
 extern int read_index_from(struct index_state *, const char *path);
 extern int is_index_unborn(struct index_state *);
+/* Bytes of $GIT_DIR/index.journal replayed on top of the index file */
+extern size_t index_journal_size(const struct index_state *);
 extern int read_index_unmerged(struct index_state *);
 #define COMMIT_LOCK		(1 << 0)
 #define CLOSE_LOCK		(1 << 1)
 extern int write_locked_index(struct index_state *, struct lock_file *lock, unsigned flags);
 extern int discard_index(struct index_state *);
+/*
+ * discard_index() of an index that is read again right after, e.g.
+ * once a hook that may have changed it has run; the name hash is kept
+ * for the next read, should it find the index unchanged.
+ */
+extern int discard_index_to_reread(struct index_state *);
 extern int unmerged_index(const struct index_state *);
 extern int verify_path(const char *path);
 extern struct cache_entry *index_dir_exists(struct index_state *istate, const char *name, int namelen);
@@ -542,6 +577,17 @@ extern int remove_file_from_index(struct index_state *, const char *path);
 extern int add_to_index(struct index_state *, const char *path, struct stat *, int flags);
 extern int add_file_to_index(struct index_state *, const char *path, int flags);
 extern struct cache_entry *make_cache_entry(unsigned int mode, const unsigned char *sha1, const char *path, int stage, unsigned int refresh_options);
+
+/*
+ * Cache entries that are added to an index are best allocated from
+ * its memory pool with make_empty_cache_entry() or dup_cache_entry():
+ * they are then released all at once by discard_index().  Use
+ * discard_cache_entry() rather than free() on entries that may have
+ * come from a pool.
+ */
+extern struct cache_entry *make_empty_cache_entry(struct index_state *istate, size_t name_len);
+extern struct cache_entry *dup_cache_entry(const struct cache_entry *ce, struct index_state *istate);
+extern void discard_cache_entry(struct cache_entry *ce);
 extern int ce_same_name(const struct cache_entry *a, const struct cache_entry *b);
 extern void set_object_name_for_intent_to_add_entry(struct cache_entry *ce);
 extern int index_name_is_other(const struct index_state *, const char *, int);
@@ -557,8 +603,11 @@ extern void *read_blob_data_from_index(struct index_state *, const char *, unsig
 #define CE_MATCH_IGNORE_MISSING		0x08
 /* enable stat refresh */
 #define CE_MATCH_REFRESH		0x10
+/* do stat comparison even if CE_FSMONITOR_VALID is true */
+#define CE_MATCH_IGNORE_FSMONITOR	0x20
 extern int ie_match_stat(const struct index_state *, const struct cache_entry *, struct stat *, unsigned int);
 extern int ie_modified(const struct index_state *, const struct cache_entry *, struct stat *, unsigned int);
+extern int is_racy_timestamp(const struct index_state *, const struct cache_entry *);
 
 #define HASH_WRITE_OBJECT 1
 #define HASH_FORMAT_CHECK 2
@@ -635,7 +684,11 @@ extern char *git_replace_ref_base;
 
 extern int fsync_object_files;
 extern int core_preload_index;
+extern const char *core_fsmonitor;
+extern int ignore_untracked_cache_config;
+extern int verify_index_checksum;
 extern int core_apply_sparse_checkout;
+extern int core_sparse_checkout_cone;
 extern int precomposed_unicode;
 extern int protect_hfs;
 extern int protect_ntfs;
@@ -939,6 +992,20 @@ static inline void *read_sha1_file(const unsigned char *sha1, enum object_type *
 	return read_sha1_file_extended(sha1, type, size, LOOKUP_REPLACE_OBJECT);
 }
 
+/*
+ * Between enable_obj_read_lock() and disable_obj_read_lock(), which
+ * must be called while no other thread reads objects, object reads
+ * (read_sha1_file(), sha1_object_info(), has_sha1_file() and
+ * unpack_entry()) may be called from several threads at once.  They
+ * take an internal lock, and drop it while inflating data and applying
+ * deltas.  obj_read_lock() takes the same (recursive) lock, for callers
+ * that need a sequence of calls into the object database to be atomic.
+ */
+extern void enable_obj_read_lock(void);
+extern void disable_obj_read_lock(void);
+extern void obj_read_lock(void);
+extern void obj_read_unlock(void);
+
 /*
  * This internal function is only declared here for the benefit of
  * lookup_replace_object().  Please do not call it directly.
@@ -969,6 +1036,8 @@ static inline const unsigned char *lookup_replace_object_extended(const unsigned
 extern int sha1_object_info(const unsigned char *, unsigned long *);
 extern int hash_sha1_file(const void *buf, unsigned long len, const char *type, unsigned char *sha1);
 extern int write_sha1_file(const void *buf, unsigned long len, const char *type, unsigned char *return_sha1);
+extern int write_loose_sha1_file(const void *buf, unsigned long len, const char *type, const unsigned char *sha1);
+extern int freshen_object(const unsigned char *sha1);
 extern int hash_sha1_file_literally(const void *buf, unsigned long len, const char *type, unsigned char *sha1, unsigned flags);
 extern int pretend_sha1_file(void *, unsigned long, enum object_type, unsigned char *);
 extern int force_object_loose(const unsigned char *sha1, time_t mtime);
@@ -992,8 +1061,11 @@ extern int has_sha1_pack(const unsigned char *sha1);
  * function does not respect replace references.
  *
  * If the QUICK flag is set, do not re-check the pack directory
- * when we cannot find the object (this means we may give a false
- * negative answer if another process is simultaneously repacking).
+ * when we cannot find the object, and look loose objects up in the
+ * listing of their directory read earlier (see loose_object_subdir())
+ * instead of stat()ing them (this means we may give a false negative
+ * answer if another process is simultaneously repacking or writing
+ * objects).
  */
 #define HAS_SHA1_QUICK 0x1
 extern int has_sha1_file_with_flags(const unsigned char *sha1, int flags);
@@ -1002,6 +1074,20 @@ static inline int has_sha1_file(const unsigned char *sha1)
 	return has_sha1_file_with_flags(sha1, 0);
 }
 
+/*
+ * The loose objects in the fan-out directory subdir_nr (the "xx/" of
+ * their path) of our own object directory (alt == NULL) or of alt, as
+ * a sorted array.  Each directory is read once, and then only again
+ * after we write an object into it ourselves or reprepare_packed_git(),
+ * so objects written by other processes meanwhile may be missing.
+ */
+struct alternate_object_database;
+struct sha1_array;
+extern struct sha1_array *loose_object_subdir(struct alternate_object_database *alt,
+					      int subdir_nr);
+/* Forget all the directories read so far, e.g. after a fetch. */
+extern void clear_loose_object_cache(void);
+
 /*
  * Return true iff an alternate object database has a loose object
  * with the specified name.  This function does not respect replace
@@ -1180,6 +1266,10 @@ struct checkout {
 
 #define TEMPORARY_FILENAME_LENGTH 25
 extern int checkout_entry(struct cache_entry *ce, const struct checkout *state, char *topath);
+extern void start_parallel_checkout(void);
+extern int finish_parallel_checkout(void);
+extern void start_checkout_dir_cache(void);
+extern void finish_checkout_dir_cache(void);
 
 struct cache_def {
 	struct strbuf path;
@@ -1203,6 +1293,7 @@ extern void remove_scheduled_dirs(void);
 extern struct alternate_object_database {
 	struct alternate_object_database *next;
 	char *name;
+	struct loose_object_cache *loose_objects; /* see loose_object_subdir() */
 	char base[FLEX_ARRAY]; /* more */
 } *alt_odb_list;
 extern void prepare_alt_odb(void);
@@ -1235,7 +1326,8 @@ extern struct packed_git {
 	unsigned pack_local:1,
 		 pack_keep:1,
 		 freshened:1,
-		 do_not_close:1;
+		 do_not_close:1,
+		 multi_pack_indexed:1;
 	unsigned char sha1[20];
 	/* something like ".git/objects/pack/xxxxx.pack" */
 	char pack_name[FLEX_ARRAY]; /* more */
@@ -1537,6 +1629,14 @@ extern int git_config_get_bool(const char *key, int *dest);
 extern int git_config_get_bool_or_int(const char *key, int *is_bool, int *dest);
 extern int git_config_get_maybe_bool(const char *key, int *dest);
 extern int git_config_get_pathname(const char *key, const char **dest);
+extern int git_config_get_fsmonitor(void);
+extern int git_config_get_index_journal(void);
+extern int git_config_get_index_verify_checksum(void);
+extern int git_config_get_index_threads(void);
+extern int git_config_get_untracked_cache(void);
+extern int git_config_get_split_index(void);
+extern int git_config_get_sparse_index(void);
+extern int git_config_get_max_percent_split_change(void);
 
 struct key_value_info {
 	const char *filename;
@@ -896,6 +896,11 @@ static int git_default_core_config(const char *var, const char *value)
 		return 0;
 	}
 
+	if (!strcmp(var, "core.sparsecheckoutcone")) {
+		core_sparse_checkout_cone = git_config_bool(var, value);
+		return 0;
+	}
+
 	if (!strcmp(var, "core.precomposeunicode")) {
 		precomposed_unicode = git_config_bool(var, value);
 		return 0;
@@ -1594,6 +1599,121 @@ int git_config_get_pathname(const char *key, const char **dest)
 	return ret;
 }
 
+int git_config_get_fsmonitor(void)
+{
+	if (git_config_get_pathname("core.fsmonitor", &core_fsmonitor))
+		core_fsmonitor = NULL;
+
+	if (core_fsmonitor && !*core_fsmonitor)
+		core_fsmonitor = NULL;
+
+	return !!core_fsmonitor;
+}
+
+/*
+ * Returns 1 to split the index, 0 to unsplit it and -1 when
+ * core.splitIndex is not set.
+ */
+int git_config_get_split_index(void)
+{
+	int val;
+
+	if (!git_config_get_maybe_bool("core.splitindex", &val))
+		return val;
+	return -1;
+}
+
+int git_config_get_sparse_index(void)
+{
+	int val;
+
+	if (!git_config_get_bool("index.sparse", &val))
+		return val;
+	return git_env_bool("GIT_TEST_SPARSE_INDEX", 0);
+}
+
+/*
+ * Returns the percentage of entries outside of the shared index above
+ * which a new shared index is written, or -1 when it is not (or badly)
+ * configured.
+ */
+int git_config_get_max_percent_split_change(void)
+{
+	int val = -1;
+
+	if (!git_config_get_int("splitindex.maxpercentchange", &val)) {
+		if (0 <= val && val <= 100)
+			return val;
+		error(_("splitIndex.maxPercentChange value '%d' "
+			"should be between 0 and 100"), val);
+	}
+	return -1;
+}
+
+/*
+ * Returns 1 to add an untracked cache to the index, 0 to remove it
+ * and -1 ("keep") to leave the index alone.  PTP repositories use the
+ * untracked cache unless told otherwise.
+ */
+int git_config_get_untracked_cache(void)
+{
+	int val = 1;
+	const char *v;
+
+	/* Hack for test programs like test-dump-untracked-cache */
+	if (ignore_untracked_cache_config)
+		return -1;
+
+	if (!git_config_get_maybe_bool("core.untrackedcache", &val))
+		return val;
+
+	if (!git_config_get_value("core.untrackedcache", &v)) {
+		if (!strcasecmp(v, "keep"))
+			return -1;
+		error(_("unknown core.untrackedCache value '%s'; "
+			"using 'keep' default value"), v);
+		return -1;
+	}
+
+	return val;
+}
+
+int git_config_get_index_journal(void)
+{
+	int val;
+
+	if (!git_config_get_bool("index.journal", &val))
+		return val;
+	return 0;
+}
+
+int git_config_get_index_verify_checksum(void)
+{
+	int val;
+
+	if (!git_config_get_bool("index.verifychecksum", &val))
+		return val;
+	return 1;
+}
+
+int git_config_get_index_threads(void)
+{
+	int is_bool, val;
+
+	val = git_env_ulong("GIT_TEST_INDEX_THREADS", 0);
+	if (val)
+		return val;
+
+	if (!git_config_get_bool_or_int("index.threads", &is_bool, &val)) {
+		if (is_bool)
+			return val ? 0 : 1;
+		else
+			return val;
+	}
+
+	return 0; /* auto */
+}
+
 NORETURN
 void git_die_config_linenr(const char *key, const char *filename, int linenr)
 {
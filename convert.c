@@ -777,6 +777,14 @@ int would_convert_to_git_filter_fd(const char *path)
 	return apply_filter(path, NULL, 0, -1, NULL, ca.drv->clean);
 }
 
+int has_filter_driver(const char *path)
+{
+	struct conv_attrs ca;
+
+	convert_attrs(&ca, path);
+	return ca.drv != NULL;
+}
+
 int convert_to_git(const char *path, const char *src, size_t len,
                    struct strbuf *dst, enum safe_crlf checksafe)
 {
@@ -49,6 +49,8 @@ extern void convert_to_git_filter_fd(const char *path, int fd,
 				     struct strbuf *dst,
 				     enum safe_crlf checksafe);
 extern int would_convert_to_git_filter_fd(const char *path);
+/* returns 1 if a "filter" driver is configured for path */
+extern int has_filter_driver(const char *path);
 
 /*****************************************************************
  *
@@ -15,6 +15,8 @@
 #include "utf8.h"
 #include "varint.h"
 #include "ewah/ewok.h"
+#include "fsmonitor.h"
+#include "thread-utils.h"
 
 struct path_simplify {
 	int len;
@@ -48,11 +50,38 @@ struct cached_dir {
 	struct untracked_cache_dir *ucd;
 };
 
+struct walk_queue;
+
 static enum path_treatment read_directory_recursive(struct dir_struct *dir,
 	const char *path, int len, struct untracked_cache_dir *untracked,
-	int check_only, const struct path_simplify *simplify);
+	int check_only, const struct path_simplify *simplify,
+	struct walk_queue *queue);
 static int get_dtype(struct dirent *de, const char *path, int len);
 
+#ifndef NO_PTHREADS
+/*
+ * Serializes the few things a parallel walk (see read_directory_parallel())
+ * does that are not thread-safe: reading objects and resolving gitlinks.
+ */
+static pthread_mutex_t dir_mutex;
+static int dir_use_threads;
+
+static inline void dir_lock(void)
+{
+	if (dir_use_threads)
+		pthread_mutex_lock(&dir_mutex);
+}
+
+static inline void dir_unlock(void)
+{
+	if (dir_use_threads)
+		pthread_mutex_unlock(&dir_mutex);
+}
+#else
+#define dir_lock()
+#define dir_unlock()
+#endif
+
 /* helper string functions with support for the ignore_case flag */
 int strcmp_icase(const char *a, const char *b)
 {
@@ -493,6 +522,289 @@ void parse_exclude_pattern(const char **pattern,
 	*patternlen = len;
 }
 
+/*
+ * Long exclude lists (generated ignore files can carry thousands of
+ * patterns) are indexed once they have been read, so that a path is
+ * only matched against the patterns that could possibly match it:
+ *
+ *  - "name" by the basename of the path,
+ *  - "*.ext" and "*name.ext" by the extension of the basename,
+ *  - "dir/sub/pat*" and "/name" by a leading part of the path below
+ *    the base of the list, which is looked up one path component at
+ *    a time,
+ *
+ * and everything else stays on a residual list that is scanned as
+ * before.  Every bucket records the positions of its patterns in
+ * el->excludes[] in decreasing order, so that the last matching
+ * pattern still wins.
+ */
+#define EXCLUDE_COMPILE_MIN 16
+
+struct exclude_bucket {
+	struct hashmap_entry ent;
+	const char *key;
+	int len;
+	int nr, alloc;
+	int *pos;
+};
+
+struct exclude_matcher {
+	struct hashmap literal;
+	struct hashmap suffix;
+	struct hashmap prefix;
+	int baselen;	/* of the patterns in "prefix" */
+	struct exclude_bucket residual;
+};
+
+static int exclude_bucket_cmp(const struct exclude_bucket *a,
+			      const struct exclude_bucket *b,
+			      const void *keydata)
+{
+	return a->len != b->len || strncmp_icase(a->key, b->key, a->len);
+}
+
+static struct exclude_bucket *exclude_bucket_get(struct hashmap *map,
+						 const char *key, int len)
+{
+	struct exclude_bucket k;
+
+	hashmap_entry_init(&k, ignore_case ? memihash(key, len) : memhash(key, len));
+	k.key = key;
+	k.len = len;
+	return hashmap_get(map, &k, NULL);
+}
+
+static void exclude_bucket_add(struct hashmap *map,
+			       const char *key, int len, int pos)
+{
+	struct exclude_bucket *b = exclude_bucket_get(map, key, len);
+
+	if (!b) {
+		b = xcalloc(1, sizeof(*b));
+		hashmap_entry_init(b, ignore_case ? memihash(key, len) : memhash(key, len));
+		b->key = key;
+		b->len = len;
+		hashmap_add(map, b);
+	}
+	ALLOC_GROW(b->pos, b->nr + 1, b->alloc);
+	b->pos[b->nr++] = pos;
+}
+
+static void free_exclude_buckets(struct hashmap *map)
+{
+	struct hashmap_iter iter;
+	struct exclude_bucket *b;
+
+	hashmap_iter_init(map, &iter);
+	while ((b = hashmap_iter_next(&iter)))
+		free(b->pos);
+	hashmap_free(map, 1);
+}
+
+static void free_exclude_matcher(struct exclude_list *el)
+{
+	struct exclude_matcher *m = el->matcher;
+
+	if (!m)
+		return;
+	free_exclude_buckets(&m->literal);
+	free_exclude_buckets(&m->suffix);
+	free_exclude_buckets(&m->prefix);
+	free(m->residual.pos);
+	free(m);
+	el->matcher = NULL;
+}
+
+static const char *last_dot(const char *s, int len)
+{
+	while (len--)
+		if (s[len] == '.')
+			return s + len;
+	return NULL;
+}
+
+/*
+ * Find the bucket for pattern "x", which is el->excludes[pos].  The
+ * lookup key must be something every path the pattern matches has,
+ * see last_compiled_exclude_matching().
+ */
+static void compile_exclude(struct exclude_matcher *m,
+			    struct exclude *x, int pos)
+{
+	const char *pattern = x->pattern;
+	int len = x->patternlen, prefix = x->nowildcardlen;
+
+	if (x->flags & EXC_FLAG_NODIR) {
+		const char *dot;
+
+		if (len && prefix == len) {
+			exclude_bucket_add(&m->literal, pattern, len, pos);
+			return;
+		}
+		/* the basename ends with pattern + 1, and so its extension */
+		if ((x->flags & EXC_FLAG_ENDSWITH) &&
+		    (dot = last_dot(pattern + 1, len - 1))) {
+			exclude_bucket_add(&m->suffix, dot,
+					   pattern + len - dot, pos);
+			return;
+		}
+	} else if (x->baselen == m->baselen) {
+		/* as in match_pathname() */
+		if (*pattern == '/') {
+			pattern++;
+			len--;
+			prefix--;
+		}
+		/*
+		 * A literal pattern matches only itself; otherwise the
+		 * matching path starts with the leading directories
+		 * spelled out before the first wildcard.
+		 */
+		if (prefix < len) {
+			while (prefix > 0 && pattern[prefix - 1] != '/')
+				prefix--;
+			prefix--;
+		}
+		if (prefix > 0) {
+			exclude_bucket_add(&m->prefix, pattern, prefix, pos);
+			return;
+		}
+	}
+	ALLOC_GROW(m->residual.pos, m->residual.nr + 1, m->residual.alloc);
+	m->residual.pos[m->residual.nr++] = pos;
+}
+
+static void compile_exclude_list(struct exclude_list *el)
+{
+	struct exclude_matcher *m;
+	int i;
+
+	free_exclude_matcher(el);
+	if (el->nr < EXCLUDE_COMPILE_MIN || el->use_cone_patterns)
+		return;
+
+	m = xcalloc(1, sizeof(*m));
+	hashmap_init(&m->literal, (hashmap_cmp_fn)exclude_bucket_cmp, 0);
+	hashmap_init(&m->suffix, (hashmap_cmp_fn)exclude_bucket_cmp, 0);
+	hashmap_init(&m->prefix, (hashmap_cmp_fn)exclude_bucket_cmp, 0);
+	m->baselen = el->excludes[0]->baselen;
+	for (i = el->nr - 1; 0 <= i; i--)
+		compile_exclude(m, el->excludes[i], i);
+	el->matcher = m;
+}
+
+/*
+ * A sparse checkout in "cone" mode lists whole directories instead of
+ * arbitrary patterns, in the few shapes described in the "Cone mode"
+ * section of git-read-tree(1): top-level files in, top-level
+ * directories out, everything below a directory in, and only the
+ * files directly in a directory.  The leading directories of a listed
+ * one have their own files in, whether they are listed or not.
+ *
+ * The directories are kept in two hashmaps, so that deciding a path
+ * takes one lookup per leading directory whatever the number of
+ * patterns.  Any other pattern turns cone mode off for the list,
+ * which is then matched as usual.
+ */
+static int cone_has(struct hashmap *map, const char *path, int len)
+{
+	return map->tablesize && exclude_bucket_get(map, path, len);
+}
+
+static void cone_add(struct hashmap *map, const char *path, int len)
+{
+	if (!map->tablesize)
+		hashmap_init(map, (hashmap_cmp_fn)exclude_bucket_cmp, 0);
+	if (!exclude_bucket_get(map, path, len))
+		exclude_bucket_add(map, path, len, 0);
+}
+
+static void cone_remove(struct hashmap *map, const char *path, int len)
+{
+	struct exclude_bucket *b = exclude_bucket_get(map, path, len);
+
+	if (b) {
+		hashmap_remove(map, b, NULL);
+		free(b->pos);
+		free(b);
+	}
+}
+
+static void free_cone_patterns(struct exclude_list *el)
+{
+	free_exclude_buckets(&el->recursive_dirs);
+	free_exclude_buckets(&el->parent_dirs);
+}
+
+static void add_cone_pattern(struct exclude *x, struct exclude_list *el)
+{
+	const char *pattern = x->pattern;
+	int len = x->patternlen, i;
+
+	if (x->baselen || *pattern != '/')
+		goto unrecognized;
+	if (len == 2 && pattern[1] == '*') {
+		if (x->flags == 0) {
+			el->cone_top_files = 1;
+			el->full_cone = 1;
+			return;
+		}
+		if (x->flags == (EXC_FLAG_NEGATIVE | EXC_FLAG_MUSTBEDIR) &&
+		    el->cone_top_files) {
+			el->full_cone = 0;
+			return;
+		}
+		goto unrecognized;
+	}
+	if (x->flags == EXC_FLAG_MUSTBEDIR && x->nowildcardlen == len &&
+	    len > 1) {
+		cone_add(&el->recursive_dirs, pattern + 1, len - 1);
+		for (i = 1; i < len; i++)
+			if (pattern[i] == '/')
+				cone_add(&el->parent_dirs, pattern + 1, i - 1);
+		return;
+	}
+	if (x->flags == (EXC_FLAG_NEGATIVE | EXC_FLAG_MUSTBEDIR) &&
+	    len > 3 && x->nowildcardlen == len - 1 &&
+	    !strcmp(pattern + len - 2, "/*") &&
+	    cone_has(&el->recursive_dirs, pattern + 1, len - 3)) {
+		cone_remove(&el->recursive_dirs, pattern + 1, len - 3);
+		cone_add(&el->parent_dirs, pattern + 1, len - 3);
+		return;
+	}
+
+unrecognized:
+	warning(_("unrecognized pattern in cone mode: '%s%s%s'; "
+		  "disabling cone pattern matching"),
+		x->flags & EXC_FLAG_NEGATIVE ? "!" : "", pattern,
+		x->flags & EXC_FLAG_MUSTBEDIR ? "/" : "");
+	free_cone_patterns(el);
+	el->use_cone_patterns = 0;
+}
+
+enum cone_match match_cone_patterns(const char *pathname, int pathlen,
+				    int dtype, struct exclude_list *el)
+{
+	int i;
+
+	if (el->full_cone)
+		return CONE_MATCHED_RECURSIVE;
+	for (i = 1; i <= pathlen; i++)
+		if ((i < pathlen ? pathname[i] == '/' : dtype == DT_DIR) &&
+		    cone_has(&el->recursive_dirs, pathname, i))
+			return CONE_MATCHED_RECURSIVE;
+	if (dtype == DT_DIR)
+		return cone_has(&el->parent_dirs, pathname, pathlen) ?
+			CONE_MATCHED : CONE_NOT_MATCHED;
+
+	for (i = pathlen - 1; 0 <= i && pathname[i] != '/'; i--)
+		; /* find the leading directory of the file */
+	if (i < 0)
+		return el->cone_top_files ? CONE_MATCHED : CONE_NOT_MATCHED;
+	return cone_has(&el->parent_dirs, pathname, i) ?
+		CONE_MATCHED : CONE_NOT_MATCHED;
+}
+
 void add_exclude(const char *string, const char *base,
 		 int baselen, struct exclude_list *el, int srcpos)
 {
@@ -522,6 +834,9 @@ void add_exclude(const char *string, const char *base,
 	ALLOC_GROW(el->excludes, el->nr + 1, el->alloc);
 	el->excludes[el->nr++] = x;
 	x->el = el;
+	free_exclude_matcher(el);
+	if (el->use_cone_patterns)
+		add_cone_pattern(x, el);
 }
 
 static void *read_skip_worktree_file_from_index(const char *path, size_t *size,
@@ -559,6 +874,8 @@ void clear_exclude_list(struct exclude_list *el)
 {
 	int i;
 
+	free_exclude_matcher(el);
+	free_cone_patterns(el);
 	for (i = 0; i < el->nr; i++)
 		free(el->excludes[i]);
 	free(el->excludes);
@@ -567,6 +884,9 @@ void clear_exclude_list(struct exclude_list *el)
 	el->nr = 0;
 	el->excludes = NULL;
 	el->filebuf = NULL;
+	el->use_cone_patterns = 0;
+	el->full_cone = 0;
+	el->cone_top_files = 0;
 }
 
 static void trim_trailing_spaces(char *buf)
@@ -691,8 +1011,12 @@ static int add_excludes(const char *fname, const char *base, int baselen,
 			warn_on_inaccessible(fname);
 		if (0 <= fd)
 			close(fd);
-		if (!check_index ||
-		    (buf = read_skip_worktree_file_from_index(fname, &size, sha1_stat)) == NULL)
+		if (!check_index)
+			return -1;
+		dir_lock();
+		buf = read_skip_worktree_file_from_index(fname, &size, sha1_stat);
+		dir_unlock();
+		if (!buf)
 			return -1;
 		if (size == 0) {
 			free(buf);
@@ -757,6 +1081,7 @@ static int add_excludes(const char *fname, const char *base, int baselen,
 			entry = buf + i + 1;
 		}
 	}
+	compile_exclude_list(el);
 	return 0;
 }
 
@@ -889,6 +1214,82 @@ int match_pathname(const char *pathname, int pathlen,
 				 WM_PATHNAME) == 0;
 }
 
+static int exclude_matches(struct exclude *x, const char *pathname,
+			   int pathlen, const char *basename, int *dtype)
+{
+	if (x->flags & EXC_FLAG_MUSTBEDIR) {
+		if (*dtype == DT_UNKNOWN)
+			*dtype = get_dtype(NULL, pathname, pathlen);
+		if (*dtype != DT_DIR)
+			return 0;
+	}
+
+	if (x->flags & EXC_FLAG_NODIR)
+		return match_basename(basename,
+				      pathlen - (basename - pathname),
+				      x->pattern, x->nowildcardlen,
+				      x->patternlen, x->flags);
+
+	assert(x->baselen == 0 || x->base[x->baselen - 1] == '/');
+	return match_pathname(pathname, pathlen,
+			      x->base, x->baselen ? x->baselen - 1 : 0,
+			      x->pattern, x->nowildcardlen, x->patternlen,
+			      x->flags);
+}
+
+/*
+ * Return the position of the last pattern in bucket "b" that matches
+ * and comes after el->excludes[best], or "best" if there is none.
+ */
+static int last_bucket_matching(struct exclude_bucket *b, int best,
+				const char *pathname, int pathlen,
+				const char *basename, int *dtype,
+				struct exclude_list *el)
+{
+	int i;
+
+	if (!b)
+		return best;
+	for (i = 0; i < b->nr && best < b->pos[i]; i++)
+		if (exclude_matches(el->excludes[b->pos[i]],
+				    pathname, pathlen, basename, dtype))
+			return b->pos[i];
+	return best;
+}
+
+static struct exclude *last_compiled_exclude_matching(const char *pathname,
+						      int pathlen,
+						      const char *basename,
+						      int *dtype,
+						      struct exclude_list *el)
+{
+	struct exclude_matcher *m = el->matcher;
+	int basenamelen = pathlen - (basename - pathname);
+	const char *dot = last_dot(basename, basenamelen);
+	int best = -1;
+
+	best = last_bucket_matching(exclude_bucket_get(&m->literal,
+						       basename, basenamelen),
+				    best, pathname, pathlen, basename, dtype, el);
+	if (dot)
+		best = last_bucket_matching(exclude_bucket_get(&m->suffix, dot,
+							       basename + basenamelen - dot),
+					    best, pathname, pathlen, basename, dtype, el);
+	if (m->prefix.size && m->baselen <= pathlen) {
+		const char *name = pathname + m->baselen;
+		int namelen = pathlen - m->baselen, i;
+
+		for (i = 1; i <= namelen; i++)
+			if (i == namelen || name[i] == '/')
+				best = last_bucket_matching(exclude_bucket_get(&m->prefix, name, i),
+							    best, pathname, pathlen,
+							    basename, dtype, el);
+	}
+	best = last_bucket_matching(&m->residual, best,
+				    pathname, pathlen, basename, dtype, el);
+	return best < 0 ? NULL : el->excludes[best];
+}
+
 /*
  * Scan the given exclude list in reverse to see whether pathname
  * should be ignored.  The first match (i.e. the last on the list), if
@@ -906,31 +1307,14 @@ static struct exclude *last_exclude_matching_from_list(const char *pathname,
 	if (!el->nr)
 		return NULL;	/* undefined */
 
+	if (el->matcher)
+		return last_compiled_exclude_matching(pathname, pathlen,
+						      basename, dtype, el);
+
 	for (i = el->nr - 1; 0 <= i; i--) {
 		struct exclude *x = el->excludes[i];
-		const char *exclude = x->pattern;
-		int prefix = x->nowildcardlen;
-
-		if (x->flags & EXC_FLAG_MUSTBEDIR) {
-			if (*dtype == DT_UNKNOWN)
-				*dtype = get_dtype(NULL, pathname, pathlen);
-			if (*dtype != DT_DIR)
-				continue;
-		}
 
-		if (x->flags & EXC_FLAG_NODIR) {
-			if (match_basename(basename,
-					   pathlen - (basename - pathname),
-					   exclude, prefix, x->patternlen,
-					   x->flags))
-				return x;
-			continue;
-		}
-
-		assert(x->baselen == 0 || x->base[x->baselen - 1] == '/');
-		if (match_pathname(pathname, pathlen,
-				   x->base, x->baselen ? x->baselen - 1 : 0,
-				   exclude, prefix, x->patternlen, x->flags))
+		if (exclude_matches(x, pathname, pathlen, basename, dtype))
 			return x;
 	}
 	return NULL; /* undecided */
@@ -945,6 +1329,13 @@ int is_excluded_from_list(const char *pathname,
 			  struct exclude_list *el)
 {
 	struct exclude *exclude;
+
+	if (el->use_cone_patterns) {
+		if (*dtype == DT_UNKNOWN)
+			*dtype = get_dtype(NULL, pathname, pathlen);
+		return match_cone_patterns(pathname, pathlen, *dtype, el) !=
+			CONE_NOT_MATCHED;
+	}
 	exclude = last_exclude_matching_from_list(pathname, pathlen, basename, dtype, el);
 	if (exclude)
 		return exclude->flags & EXC_FLAG_NEGATIVE ? 0 : 1;
@@ -1313,7 +1704,12 @@ static enum path_treatment treat_directory(struct dir_struct *dir,
 			break;
 		if (!(dir->flags & DIR_NO_GITLINKS)) {
 			unsigned char sha1[20];
-			if (resolve_gitlink_ref(dirname, "HEAD", sha1) == 0)
+			int is_gitlink;
+
+			dir_lock();
+			is_gitlink = !resolve_gitlink_ref(dirname, "HEAD", sha1);
+			dir_unlock();
+			if (is_gitlink)
 				return path_untracked;
 		}
 		return path_recurse;
@@ -1327,7 +1723,7 @@ static enum path_treatment treat_directory(struct dir_struct *dir,
 	untracked = lookup_untracked(dir->untracked, untracked,
 				     dirname + baselen, len - baselen);
 	return read_directory_recursive(dir, dirname, len,
-					untracked, 1, simplify);
+					untracked, 1, simplify, NULL);
 }
 
 /*
@@ -1528,7 +1924,7 @@ static enum path_treatment treat_path_fast(struct dir_struct *dir,
 		 * with check_only set.
 		 */
 		return read_directory_recursive(dir, path->buf, path->len,
-						cdir->ucd, 1, simplify);
+						cdir->ucd, 1, simplify, NULL);
 	/*
 	 * We get path_recurse in the first run when
 	 * directory_exists_in_index() returns index_nonexistent. We
@@ -1581,17 +1977,23 @@ static int valid_cached_dir(struct dir_struct *dir,
 	if (!untracked)
 		return 0;
 
-	if (stat(path->len ? path->buf : ".", &st)) {
-		invalidate_directory(dir->untracked, untracked);
-		memset(&untracked->stat_data, 0, sizeof(untracked->stat_data));
-		return 0;
-	}
-	if (!untracked->valid ||
-	    match_stat_data_racy(&the_index, &untracked->stat_data, &st)) {
-		if (untracked->valid)
+	/*
+	 * With fsmonitor, we can trust the untracked cache's valid field.
+	 */
+	refresh_fsmonitor(&the_index);
+	if (!(dir->untracked->use_fsmonitor && untracked->valid)) {
+		if (stat(path->len ? path->buf : ".", &st)) {
 			invalidate_directory(dir->untracked, untracked);
-		fill_stat_data(&untracked->stat_data, &st);
-		return 0;
+			memset(&untracked->stat_data, 0, sizeof(untracked->stat_data));
+			return 0;
+		}
+		if (!untracked->valid ||
+		    match_stat_data_racy(&the_index, &untracked->stat_data, &st)) {
+			if (untracked->valid)
+				invalidate_directory(dir->untracked, untracked);
+			fill_stat_data(&untracked->stat_data, &st);
+			return 0;
+		}
 	}
 
 	if (untracked->check_only != !!check_only) {
@@ -1676,6 +2078,34 @@ static void close_cached_dir(struct cached_dir *cdir)
 	}
 }
 
+/*
+ * Subdirectories of the top-level directory of a walk, to be read by
+ * read_directory_parallel().
+ */
+struct walk_job {
+	char *path;
+	int len;
+	struct untracked_cache_dir *untracked;
+};
+
+struct walk_queue {
+	struct walk_job *job;
+	int nr, alloc;
+	int next;
+};
+
+static void queue_directory(struct walk_queue *queue, struct strbuf *path,
+			    struct untracked_cache_dir *untracked)
+{
+	struct walk_job *job;
+
+	ALLOC_GROW(queue->job, queue->nr + 1, queue->alloc);
+	job = &queue->job[queue->nr++];
+	job->path = xmemdupz(path->buf, path->len);
+	job->len = path->len;
+	job->untracked = untracked;
+}
+
 /*
  * Read a directory tree. We currently ignore anything but
  * directories, regular files and symlinks. That's because git
@@ -1686,11 +2116,15 @@ static void close_cached_dir(struct cached_dir *cdir)
  * That likely will not change.
  *
  * Returns the most significant path_treatment value encountered in the scan.
+ *
+ * If "queue" is given, subdirectories are not recursed into but added
+ * to the queue, and the return value does not account for them.
  */
 static enum path_treatment read_directory_recursive(struct dir_struct *dir,
 				    const char *base, int baselen,
 				    struct untracked_cache_dir *untracked, int check_only,
-				    const struct path_simplify *simplify)
+				    const struct path_simplify *simplify,
+				    struct walk_queue *queue)
 {
 	struct cached_dir cdir;
 	enum path_treatment state, subdir_state, dir_state = path_none;
@@ -1717,9 +2151,14 @@ static enum path_treatment read_directory_recursive(struct dir_struct *dir,
 			ud = lookup_untracked(dir->untracked, untracked,
 					      path.buf + baselen,
 					      path.len - baselen);
+			if (queue && !check_only) {
+				queue_directory(queue, &path, ud);
+				continue;
+			}
 			subdir_state =
 				read_directory_recursive(dir, path.buf, path.len,
-							 ud, check_only, simplify);
+							 ud, check_only, simplify,
+							 NULL);
 			if (subdir_state > dir_state)
 				dir_state = subdir_state;
 		}
@@ -1766,6 +2205,192 @@ static enum path_treatment read_directory_recursive(struct dir_struct *dir,
 	return dir_state;
 }
 
+#ifndef NO_PTHREADS
+/*
+ * A worker gets its own copy of the dir_struct, sharing the command
+ * line and fallback exclude lists but building its own per-directory
+ * exclude stack, and its own copy of the untracked cache counters.
+ * The untracked cache nodes are shared: each job owns the subtree it
+ * walks, and the top-level node is not modified once the workers run.
+ */
+struct walk_worker {
+	pthread_t pthread;
+	struct dir_struct dir;
+	struct untracked_cache untracked;
+	struct walk_queue *queue;
+	const struct path_simplify *simplify;
+};
+
+#define MAX_WALK_THREADS 64
+
+static pthread_mutex_t walk_queue_mutex;
+
+static struct walk_job *next_walk_job(struct walk_queue *queue)
+{
+	struct walk_job *job = NULL;
+
+	pthread_mutex_lock(&walk_queue_mutex);
+	if (queue->next < queue->nr)
+		job = &queue->job[queue->next++];
+	pthread_mutex_unlock(&walk_queue_mutex);
+	return job;
+}
+
+static void *walk_thread(void *_data)
+{
+	struct walk_worker *w = _data;
+	struct walk_job *job;
+
+	while ((job = next_walk_job(w->queue)) != NULL)
+		read_directory_recursive(&w->dir, job->path, job->len,
+					 job->untracked, 0, w->simplify, NULL);
+	return NULL;
+}
+
+static void init_walk_worker(struct walk_worker *w, struct dir_struct *dir,
+			     struct walk_queue *queue,
+			     const struct path_simplify *simplify)
+{
+	w->dir = *dir;
+	w->dir.nr = w->dir.alloc = 0;
+	w->dir.entries = NULL;
+	w->dir.ignored_nr = w->dir.ignored_alloc = 0;
+	w->dir.ignored = NULL;
+	memset(&w->dir.exclude_list_group[EXC_DIRS], 0,
+	       sizeof(w->dir.exclude_list_group[EXC_DIRS]));
+	w->dir.exclude_stack = NULL;
+	w->dir.exclude = NULL;
+	memset(&w->dir.basebuf, 0, sizeof(w->dir.basebuf));
+	if (dir->untracked) {
+		w->untracked = *dir->untracked;
+		w->untracked.dir_created = 0;
+		w->untracked.gitignore_invalidated = 0;
+		w->untracked.dir_invalidated = 0;
+		w->untracked.dir_opened = 0;
+		w->dir.untracked = &w->untracked;
+	}
+	w->queue = queue;
+	w->simplify = simplify;
+}
+
+/* Hand the worker's findings to "dir" and free what is its own. */
+static void finish_walk_worker(struct walk_worker *w, struct dir_struct *dir)
+{
+	struct exclude_list_group *group = &w->dir.exclude_list_group[EXC_DIRS];
+	struct exclude_stack *stk;
+	int i;
+
+	ALLOC_GROW(dir->entries, dir->nr + w->dir.nr, dir->alloc);
+	memcpy(dir->entries + dir->nr, w->dir.entries,
+	       w->dir.nr * sizeof(*dir->entries));
+	dir->nr += w->dir.nr;
+	free(w->dir.entries);
+
+	ALLOC_GROW(dir->ignored, dir->ignored_nr + w->dir.ignored_nr,
+		   dir->ignored_alloc);
+	memcpy(dir->ignored + dir->ignored_nr, w->dir.ignored,
+	       w->dir.ignored_nr * sizeof(*dir->ignored));
+	dir->ignored_nr += w->dir.ignored_nr;
+	free(w->dir.ignored);
+
+	if (dir->untracked) {
+		dir->untracked->dir_created += w->untracked.dir_created;
+		dir->untracked->gitignore_invalidated +=
+			w->untracked.gitignore_invalidated;
+		dir->untracked->dir_invalidated += w->untracked.dir_invalidated;
+		dir->untracked->dir_opened += w->untracked.dir_opened;
+	}
+
+	for (i = 0; i < group->nr; i++) {
+		free((char *)group->el[i].src);
+		clear_exclude_list(&group->el[i]);
+	}
+	free(group->el);
+	stk = w->dir.exclude_stack;
+	while (stk) {
+		struct exclude_stack *prev = stk->prev;
+		free(stk);
+		stk = prev;
+	}
+	strbuf_release(&w->dir.basebuf);
+}
+
+/* the subdirectories to walk are not known yet; one thread per CPU */
+static int walk_threads(void)
+{
+	return thread_count("GIT_TEST_UNTRACKED_THREADS", 0, INT_MAX, 1,
+			    MAX_WALK_THREADS);
+}
+#else
+#define walk_threads() 1
+#endif
+
+/*
+ * Read the top-level directory on this thread, then walk the
+ * subdirectories it leads to on worker threads.  The entries come
+ * back in whatever order the workers found them in; read_directory()
+ * sorts them anyway.
+ */
+static void read_directory_parallel(struct dir_struct *dir,
+				    const char *path, int len,
+				    struct untracked_cache_dir *untracked,
+				    const struct path_simplify *simplify)
+{
+	struct walk_queue queue;
+	int threads = walk_threads();
+	int i;
+#ifndef NO_PTHREADS
+	struct walk_worker *worker;
+#endif
+
+	if (threads < 2) {
+		read_directory_recursive(dir, path, len, untracked, 0,
+					 simplify, NULL);
+		return;
+	}
+
+	memset(&queue, 0, sizeof(queue));
+	read_directory_recursive(dir, path, len, untracked, 0, simplify, &queue);
+	if (threads > queue.nr)
+		threads = queue.nr;
+
+#ifndef NO_PTHREADS
+	if (threads > 1) {
+		/* the workers look up paths in the index concurrently */
+		lazy_init_name_hash(&the_index);
+		pthread_mutex_init(&walk_queue_mutex, NULL);
+		pthread_mutex_init(&dir_mutex, NULL);
+		dir_use_threads = 1;
+
+		worker = xcalloc(threads, sizeof(*worker));
+		for (i = 0; i < threads; i++) {
+			init_walk_worker(&worker[i], dir, &queue, simplify);
+			if (pthread_create(&worker[i].pthread, NULL,
+					   walk_thread, &worker[i]))
+				die("unable to create directory walker thread");
+		}
+		for (i = 0; i < threads; i++) {
+			if (pthread_join(worker[i].pthread, NULL))
+				die("unable to join directory walker thread");
+			finish_walk_worker(&worker[i], dir);
+		}
+		free(worker);
+
+		dir_use_threads = 0;
+		pthread_mutex_destroy(&dir_mutex);
+		pthread_mutex_destroy(&walk_queue_mutex);
+	}
+#endif
+
+	for (i = queue.next; i < queue.nr; i++)
+		read_directory_recursive(dir, queue.job[i].path,
+					 queue.job[i].len, queue.job[i].untracked,
+					 0, simplify, NULL);
+	for (i = 0; i < queue.nr; i++)
+		free(queue.job[i].path);
+	free(queue.job);
+}
+
 static int cmp_name(const void *p1, const void *p2)
 {
 	const struct dir_entry *e1 = *(const struct dir_entry **)p1;
@@ -1876,6 +2501,45 @@ void add_untracked_ident(struct untracked_cache *uc)
 	strbuf_addch(&uc->ident, 0);
 }
 
+static void new_untracked_cache(struct index_state *istate)
+{
+	struct untracked_cache *uc = xcalloc(1, sizeof(*uc));
+	strbuf_init(&uc->ident, 100);
+	uc->exclude_per_dir = PER_DIR_EXCLUDE_FILE;
+	/* should be the same flags used by git-status */
+	uc->dir_flags = DIR_SHOW_OTHER_DIRECTORIES | DIR_HIDE_EMPTY_DIRECTORIES;
+	add_untracked_ident(uc);
+	istate->untracked = uc;
+	istate->cache_changed |= UNTRACKED_CHANGED;
+}
+
+/*
+ * Make sure the index carries an untracked cache that can actually be
+ * used here: one written on another machine or worktree location, or
+ * for a different per-directory exclude file (e.g. by a git that reads
+ * .gitignore), would be ignored by validate_untracked_cache() forever,
+ * so start over instead.
+ */
+void add_untracked_cache(struct index_state *istate)
+{
+	struct untracked_cache *uc = istate->untracked;
+
+	if (uc && ident_in_untracked(uc) &&
+	    !strcmp(uc->exclude_per_dir, PER_DIR_EXCLUDE_FILE))
+		return;
+	free_untracked_cache(uc);
+	new_untracked_cache(istate);
+}
+
+void remove_untracked_cache(struct index_state *istate)
+{
+	if (istate->untracked) {
+		free_untracked_cache(istate->untracked);
+		istate->untracked = NULL;
+		istate->cache_changed |= UNTRACKED_CHANGED;
+	}
+}
+
 static struct untracked_cache_dir *validate_untracked_cache(struct dir_struct *dir,
 						      int base_len,
 						      const struct pathspec *pathspec)
@@ -1996,7 +2660,7 @@ int read_directory(struct dir_struct *dir, const char *path, int len, const stru
 		 */
 		dir->untracked = NULL;
 	if (!len || treat_leading_path(dir, path, len, simplify))
-		read_directory_recursive(dir, path, len, untracked, 0, simplify);
+		read_directory_parallel(dir, path, len, untracked, simplify);
 	free_simplify(simplify);
 	qsort(dir->entries, dir->nr, sizeof(struct dir_entry *), cmp_name);
 	qsort(dir->ignored, dir->ignored_nr, sizeof(struct dir_entry *), cmp_name);
@@ -2191,7 +2855,7 @@ void setup_standard_excludes(struct dir_struct *dir)
 {
 	const char *path;
 
-	dir->exclude_per_dir = ".ptp-gitignore";
+	dir->exclude_per_dir = PER_DIR_EXCLUDE_FILE;
 
 	/* core.excludefile defaulting to $XDG_HOME/git/ignore */
 	if (!excludes_file)
@@ -54,6 +54,19 @@ struct exclude_list {
 	const char *src;
 
 	struct exclude **excludes;
+
+	/* lookup tables for long lists, see compile_exclude_list() */
+	struct exclude_matcher *matcher;
+
+	/*
+	 * Set before reading a sparse-checkout file to match its
+	 * directories as cones, see add_cone_pattern().
+	 */
+	unsigned use_cone_patterns : 1,
+		 full_cone : 1,
+		 cone_top_files : 1;
+	struct hashmap recursive_dirs;
+	struct hashmap parent_dirs;
 };
 
 /*
@@ -108,6 +121,12 @@ struct sha1_stat {
  *  their contents (exclude_sha1[], info_exclude_sha1[] and
  *  excludes_file_sha1[])
  */
+/*
+ * The name of the per-directory exclude file.  The untracked cache
+ * records it and is only trusted when it matches.
+ */
+#define PER_DIR_EXCLUDE_FILE ".ptp-gitignore"
+
 struct untracked_cache_dir {
 	struct untracked_cache_dir **dirs;
 	char **untracked;
@@ -134,6 +153,11 @@ struct untracked_cache {
 	 */
 	unsigned dir_flags;
 	struct untracked_cache_dir *root;
+	/*
+	 * Set when the filesystem monitor vouches for the "valid"
+	 * bits, so cached directories need not be stat()ed.
+	 */
+	unsigned use_fsmonitor : 1;
 	/* Statistics */
 	int dir_created;
 	int gitignore_invalidated;
@@ -219,6 +243,20 @@ extern int read_directory(struct dir_struct *, const char *path, int len, const
 
 extern int is_excluded_from_list(const char *pathname, int pathlen, const char *basename,
 				 int *dtype, struct exclude_list *el);
+
+enum cone_match {
+	CONE_NOT_MATCHED = 0,
+	CONE_MATCHED,
+	CONE_MATCHED_RECURSIVE
+};
+
+/*
+ * For a list with use_cone_patterns, whether "pathname" is in the
+ * sparse checkout; a directory all of whose paths are in gives
+ * CONE_MATCHED_RECURSIVE.
+ */
+extern enum cone_match match_cone_patterns(const char *pathname, int pathlen,
+					   int dtype, struct exclude_list *el);
 struct dir_entry *dir_add_ignored(struct dir_struct *dir, const char *pathname, int len);
 
 /*
@@ -308,4 +346,6 @@ void free_untracked_cache(struct untracked_cache *);
 struct untracked_cache *read_untracked_extension(const void *data, unsigned long sz);
 void write_untracked_extension(struct strbuf *out, struct untracked_cache *untracked);
 void add_untracked_ident(struct untracked_cache *);
+void add_untracked_cache(struct index_state *istate);
+void remove_untracked_cache(struct index_state *istate);
 #endif
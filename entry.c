@@ -2,13 +2,121 @@
 #include "blob.h"
 #include "dir.h"
 #include "streaming.h"
+#include "thread-utils.h"
+
+/*
+ * Files written per thread, below which a parallel checkout writes
+ * its files by itself; creating a file costs far more than an entry
+ * of the index.
+ */
+#define CHECKOUT_THREAD_COST 100
+#define MAX_CHECKOUT_THREADS 64
+
+/*
+ * Blobs larger than this are streamed by write_entry() rather than
+ * read in core by the threads of a parallel checkout.
+ */
+#define CHECKOUT_INCORE_MAX (16 * 1024 * 1024)
+
+/*
+ * Between start_checkout_dir_cache() and finish_checkout_dir_cache(),
+ * the leading directories that checkout_entry() created or found to be
+ * real directories are remembered, so that the files that follow in
+ * them do not lstat() (or mkdir()) each of their leading directories
+ * again.  Only removing a directory tree invalidates them.
+ */
+struct checkout_dir {
+	struct hashmap_entry ent;
+	int len;
+	char name[FLEX_ARRAY];
+};
+
+static struct checkout_dir_cache {
+	struct hashmap dirs;
+	int active;
+	unsigned int created, checked, skipped;
+} dir_cache;
+
+static int checkout_dir_cmp(const struct checkout_dir *a,
+			    const struct checkout_dir *b, const char *name)
+{
+	return a->len != b->len || memcmp(a->name, name ? name : b->name,
+					   a->len);
+}
+
+static int dir_cache_has(const char *name, int len)
+{
+	struct checkout_dir key;
+
+	if (!dir_cache.active)
+		return 0;
+	hashmap_entry_init(&key, memhash(name, len));
+	key.len = len;
+	return !!hashmap_get(&dir_cache.dirs, &key, name);
+}
+
+static void dir_cache_add(const char *name, int len)
+{
+	struct checkout_dir *dir;
+
+	if (!dir_cache.active)
+		return;
+	dir = xmalloc(sizeof(*dir) + len + 1);
+	hashmap_entry_init(dir, memhash(name, len));
+	dir->len = len;
+	memcpy(dir->name, name, len);
+	dir->name[len] = '\0';
+	hashmap_add(&dir_cache.dirs, dir);
+}
+
+static void dir_cache_clear(void)
+{
+	if (!dir_cache.active)
+		return;
+	hashmap_free(&dir_cache.dirs, 1);
+	hashmap_init(&dir_cache.dirs, (hashmap_cmp_fn)checkout_dir_cmp, 0);
+}
+
+void start_checkout_dir_cache(void)
+{
+	if (dir_cache.active)
+		die("BUG: checkout directory cache already started");
+	hashmap_init(&dir_cache.dirs, (hashmap_cmp_fn)checkout_dir_cmp, 0);
+	dir_cache.active = 1;
+	dir_cache.created = dir_cache.checked = dir_cache.skipped = 0;
+}
+
+void finish_checkout_dir_cache(void)
+{
+	if (!dir_cache.active)
+		return;
+	trace_printf("checkout: %u directories created, %u checked, "
+		     "%u checks skipped\n",
+		     dir_cache.created, dir_cache.checked, dir_cache.skipped);
+	hashmap_free(&dir_cache.dirs, 1);
+	dir_cache.active = 0;
+}
+
+static int leading_dir_len(const char *path, int len)
+{
+	while (len > 0 && path[len - 1] != '/')
+		len--;
+	return len ? len - 1 : 0;
+}
 
 static void create_directories(const char *path, int path_len,
 			       const struct checkout *state)
 {
-	char *buf = xmalloc(path_len + 1);
-	int len = 0;
+	char *buf;
+	int len = 0, dir_len = leading_dir_len(path, path_len);
 
+	/* the leading directories of a known directory are known, too */
+	if (dir_cache_has(path, dir_len)) {
+		dir_cache.skipped++;
+		return;
+	}
+
+	buf = xmalloc(path_len + 1);
 	while (len < path_len) {
 		do {
 			buf[len] = path[len];
@@ -18,6 +126,12 @@ static void create_directories(const char *path, int path_len,
 			break;
 		buf[len] = 0;
 
+		if (dir_cache_has(buf, len)) {
+			dir_cache.skipped++;
+			continue;
+		}
+		dir_cache_add(buf, len);
+
 		/*
 		 * For 'checkout-index --prefix=<dir>', <dir> is
 		 * allowed to be a symlink to an existing directory,
@@ -25,8 +139,10 @@ static void create_directories(const char *path, int path_len,
 		 * we test the path components of the prefix with the
 		 * stat() function instead of the lstat() function.
 		 */
+		dir_cache.checked++;
 		if (has_dirs_only_path(buf, len, state->base_dir_len))
 			continue; /* ok, it is already a directory. */
+		dir_cache.created++;
 
 		/*
 		 * If this mkdir() would fail, it could be that there
@@ -71,6 +187,7 @@ static void remove_subtree(struct strbuf *path)
 	closedir(dir);
 	if (rmdir(path->buf))
 		die_errno("cannot rmdir '%s'", path->buf);
+	dir_cache_clear();
 }
 
 static int create_file(const char *path, unsigned int mode)
@@ -220,6 +337,233 @@ finish:
 	return 0;
 }
 
+/*
+ * Between start_parallel_checkout() and finish_parallel_checkout(),
+ * checkout_entry() still does everything that depends on the order of
+ * the entries (removing what is in the way, creating the leading
+ * directories), but only queues the regular files whose conversion
+ * can be streamed.  finish_parallel_checkout() then reads, converts
+ * and writes them from several threads, and fills their stat data
+ * back into the index.
+ */
+struct parallel_checkout_item {
+	struct cache_entry *ce;
+	const struct checkout *state;
+	struct stream_filter *filter;
+	char *path;
+	int status;	/* 0 written, -1 failed, 1 left for write_entry() */
+};
+
+static struct parallel_checkout {
+	struct parallel_checkout_item *item;
+	int nr, alloc, next;
+	int active;
+} parallel_checkout;
+
+#ifndef NO_PTHREADS
+static pthread_mutex_t checkout_mutex;
+#endif
+
+void start_parallel_checkout(void)
+{
+#ifndef NO_PTHREADS
+	if (parallel_checkout.active)
+		die("BUG: parallel checkout already started");
+	parallel_checkout.active = 1;
+#endif
+}
+
+static int queue_parallel_checkout(struct cache_entry *ce, const char *path,
+				   const struct checkout *state)
+{
+	struct parallel_checkout_item *item;
+	struct stream_filter *filter;
+
+	if (!parallel_checkout.active || !S_ISREG(ce->ce_mode))
+		return -1;
+	/*
+	 * Two paths that differ only in case name the same file here,
+	 * and must be written one after the other.
+	 */
+	if (ignore_case)
+		return -1;
+	filter = get_stream_filter(ce->name, ce->sha1);
+	if (!filter)
+		return -1;
+
+	ALLOC_GROW(parallel_checkout.item, parallel_checkout.nr + 1,
+		   parallel_checkout.alloc);
+	item = &parallel_checkout.item[parallel_checkout.nr++];
+	item->ce = ce;
+	item->state = state;
+	item->filter = filter;
+	item->path = xstrdup(path);
+	item->status = 0;
+	return 0;
+}
+
+static int write_filtered(int fd, struct stream_filter *filter,
+			  const char *buf, size_t size)
+{
+	char obuf[16384];
+
+	if (is_null_stream_filter(filter))
+		return write_in_full(fd, buf, size) == size ? 0 : -1;
+
+	for (;;) {
+		size_t to_feed = size, to_receive = sizeof(obuf);
+		size_t filled;
+
+		if (stream_filter(filter, size ? buf : NULL,
+				  size ? &to_feed : NULL,
+				  obuf, &to_receive))
+			return -1;
+		buf += size - to_feed;
+		filled = sizeof(obuf) - to_receive;
+		if (!size && !filled)
+			return 0;
+		size = to_feed;
+		if (write_in_full(fd, obuf, filled) != filled)
+			return -1;
+	}
+}
+
+static int write_queued_entry(struct parallel_checkout_item *item)
+{
+	struct cache_entry *ce = item->ce;
+	const struct checkout *state = item->state;
+	enum object_type type;
+	unsigned long size;
+	void *new = NULL;
+	struct stat st;
+	int fd, ret, fstat_done;
+
+	/* large blobs are left to write_entry(), which streams them */
+	type = sha1_object_info(ce->sha1, &size);
+	if (type == OBJ_BLOB && size <= big_file_threshold &&
+	    size <= CHECKOUT_INCORE_MAX)
+		new = read_blob_entry(ce, &size);
+	if (!new)
+		return 1;
+
+	fd = open_output_fd(item->path, ce, 0);
+	if (fd < 0) {
+		free(new);
+		return error("unable to create file %s (%s)",
+			     item->path, strerror(errno));
+	}
+	ret = write_filtered(fd, item->filter, new, size);
+	fstat_done = fstat_output(fd, state, &st);
+	close(fd);
+	free(new);
+	if (ret) {
+		unlink(item->path);
+		return error("unable to write file %s", item->path);
+	}
+
+	if (state->refresh_cache) {
+		if (!fstat_done)
+			lstat(ce->name, &st);
+		fill_stat_cache_info(ce, &st);
+		ce->ce_flags |= CE_UPDATE_IN_BASE;
+	}
+	return 0;
+}
+
+#ifndef NO_PTHREADS
+static struct parallel_checkout_item *next_checkout_item(void)
+{
+	struct parallel_checkout_item *item = NULL;
+
+	pthread_mutex_lock(&checkout_mutex);
+	if (parallel_checkout.next < parallel_checkout.nr)
+		item = &parallel_checkout.item[parallel_checkout.next++];
+	pthread_mutex_unlock(&checkout_mutex);
+	return item;
+}
+
+static void *checkout_thread(void *unused)
+{
+	struct parallel_checkout_item *item;
+
+	while ((item = next_checkout_item()) != NULL)
+		item->status = write_queued_entry(item);
+	return NULL;
+}
+
+static int checkout_threads(int nr)
+{
+	int workers = 0;
+
+	git_config_get_int("checkout.workers", &workers);
+	return thread_count("GIT_TEST_CHECKOUT_THREADS", workers, nr,
+			    CHECKOUT_THREAD_COST, MAX_CHECKOUT_THREADS);
+}
+
+static void write_queued_entries_in_parallel(int threads)
+{
+	pthread_t *pthread;
+	int i;
+
+	pthread_mutex_init(&checkout_mutex, NULL);
+	enable_obj_read_lock();
+	pthread = xcalloc(threads, sizeof(*pthread));
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&pthread[i], NULL, checkout_thread, NULL))
+			die("unable to create checkout thread");
+	for (i = 0; i < threads; i++)
+		if (pthread_join(pthread[i], NULL))
+			die("unable to join checkout thread");
+	free(pthread);
+	disable_obj_read_lock();
+	pthread_mutex_destroy(&checkout_mutex);
+}
+#endif
+
+/*
+ * Write the files queued since start_parallel_checkout().  Returns
+ * non-zero if any of them could not be written.
+ */
+int finish_parallel_checkout(void)
+{
+	int i, threads = 0, errs = 0;
+
+	if (!parallel_checkout.active)
+		return 0;
+	parallel_checkout.active = 0;
+
+#ifndef NO_PTHREADS
+	threads = checkout_threads(parallel_checkout.nr);
+	if (threads >= 2)
+		write_queued_entries_in_parallel(threads);
+#endif
+	if (threads < 2)
+		for (i = 0; i < parallel_checkout.nr; i++) {
+			struct parallel_checkout_item *item;
+
+			item = &parallel_checkout.item[i];
+			item->status = write_queued_entry(item);
+		}
+	trace_printf("parallel checkout: %d files in %d threads\n",
+		     parallel_checkout.nr, threads < 2 ? 1 : threads);
+
+	for (i = 0; i < parallel_checkout.nr; i++) {
+		struct parallel_checkout_item *item = &parallel_checkout.item[i];
+
+		free_stream_filter(item->filter);
+		if (item->status > 0)
+			item->status = write_entry(item->ce, item->path,
+						   item->state, 0);
+		else if (!item->status && item->state->refresh_cache)
+			item->state->istate->cache_changed |= CE_ENTRY_CHANGED;
+		errs |= item->status;
+		free(item->path);
+	}
+	free(parallel_checkout.item);
+	memset(&parallel_checkout, 0, sizeof(parallel_checkout));
+	return errs;
+}
+
 /*
  * This is like 'lstat()', except it refuses to follow symlinks
  * in the path, after skipping "skiplen".
@@ -230,7 +574,9 @@ static int check_path(const char *path, int len, struct stat *st, int skiplen)
 
 	while (path < slash && *slash != '/')
 		slash--;
-	if (!has_dirs_only_path(path, slash - path, skiplen)) {
+	if (dir_cache_has(path, slash - path))
+		dir_cache.skipped++;
+	else if (!has_dirs_only_path(path, slash - path, skiplen)) {
 		errno = ENOENT;
 		return -1;
 	}
@@ -290,5 +636,7 @@ int checkout_entry(struct cache_entry *ce,
 		return 0;
 
 	create_directories(path.buf, path.len, state);
+	if (!queue_parallel_checkout(ce, path.buf, state))
+		return 0;
 	return write_entry(ce, path.buf, state, 0);
 }
@@ -61,6 +61,7 @@ enum object_creation_mode object_creation_mode = OBJECT_CREATION_MODE;
 char *notes_ref_name;
 int grafts_replace_parents = 1;
 int core_apply_sparse_checkout;
+int core_sparse_checkout_cone;
 int merge_log_config = -1;
 int precomposed_unicode = -1; /* see probe_utf8_pathname_composition() */
 struct startup_info *startup_info;
@@ -86,6 +87,18 @@ int auto_comment_line_char;
 /* Parallel index stat data preload? */
 int core_preload_index = 1;
 
+/* Socket of the filesystem monitor daemon, see fsmonitor.c */
+const char *core_fsmonitor;
+
+/* Leave the untracked cache alone whatever core.untrackedCache says */
+int ignore_untracked_cache_config;
+
+/*
+ * Check the trailing SHA-1 of the index when reading it?  -1 leaves
+ * it to index.verifyChecksum; git fsck always asks for the check.
+ */
+int verify_index_checksum = -1;
+
 /* This is set by setup_git_dir_gently() and/or git_default_config() */
 char *git_work_tree_cfg;
 static char *work_tree;
@@ -0,0 +1,412 @@
+/*
+ * Filesystem monitor daemon for core.fsmonitor.
+ *
+ * Watches the working tree with inotify(7) and answers "what changed
+ * since token X" queries from git over a unix socket.  See
+ * Documentation/git-fsmonitor--daemon.txt for the protocol.
+ */
+#include "cache.h"
+#include "tempfile.h"
+#include "unix-socket.h"
+#include "sigchain.h"
+#include "parse-options.h"
+#include "hashmap.h"
+#include "dir.h"
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+		    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+		    IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/* forget everything and answer "/" if we have to remember this much */
+#define MAX_CHANGED_PATHS (1024 * 1024)
+
+static struct tempfile socket_file;
+static int debug;
+static int inotify_fd = -1;
+
+/*
+ * Tokens look like "<instance>:<seq>".  The instance part makes sure
+ * that a token handed out by an earlier incarnation of the daemon is
+ * never mistaken for one of ours.
+ */
+static struct strbuf instance = STRBUF_INIT;
+static uintmax_t seq = 1;
+/* tokens older than this cannot be answered precisely any more */
+static uintmax_t everything_changed_seq = 1;
+
+/* watch descriptor -> directory relative to the top of the tree */
+static char **watched_dirs;
+static int watched_dirs_alloc;
+
+struct changed_path {
+	struct hashmap_entry ent;
+	uintmax_t seq;
+	char path[FLEX_ARRAY];
+};
+static struct hashmap changed_paths;
+
+static int changed_path_cmp(const struct changed_path *a,
+			    const struct changed_path *b,
+			    const char *key)
+{
+	return strcmp(a->path, key ? key : b->path);
+}
+
+static void trace_event(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!debug)
+		return;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static void forget_everything(void)
+{
+	hashmap_free(&changed_paths, 1);
+	hashmap_init(&changed_paths, (hashmap_cmp_fn)changed_path_cmp, 0);
+	everything_changed_seq = seq;
+	trace_event("everything changed at %"PRIuMAX, seq);
+}
+
+static void record_change(const char *path)
+{
+	struct changed_path *e;
+	unsigned int hash = strhash(path);
+
+	e = hashmap_get_from_hash(&changed_paths, hash, path);
+	if (!e) {
+		size_t len = strlen(path);
+
+		if (changed_paths.size >= MAX_CHANGED_PATHS) {
+			forget_everything();
+			return;
+		}
+		e = xmalloc(sizeof(*e) + len + 1);
+		memcpy(e->path, path, len + 1);
+		hashmap_entry_init(e, hash);
+		hashmap_add(&changed_paths, e);
+	}
+	e->seq = seq;
+	trace_event("changed '%s' at %"PRIuMAX, path, seq);
+}
+
+static void add_watch(const char *dir);
+
+/*
+ * Watch a new directory and everything below it.  Anything that was
+ * created before the watch was in place is reported as changed.
+ */
+static void add_watch_recursive(struct strbuf *path, int report)
+{
+	DIR *d;
+	struct dirent *de;
+	size_t len;
+
+	add_watch(path->buf);
+	d = opendir(path->len ? path->buf : ".");
+	if (!d)
+		return;
+	if (path->len)
+		strbuf_addch(path, '/');
+	len = path->len;
+	while ((de = readdir(d)) != NULL) {
+		struct stat st;
+
+		if (is_dot_or_dotdot(de->d_name) || !strcmp(de->d_name, ".git"))
+			continue;
+		strbuf_setlen(path, len);
+		strbuf_addstr(path, de->d_name);
+		if (report)
+			record_change(path->buf);
+		if (!lstat(path->buf, &st) && S_ISDIR(st.st_mode))
+			add_watch_recursive(path, report);
+	}
+	closedir(d);
+	strbuf_setlen(path, len ? len - 1 : 0);
+}
+
+static void add_watch(const char *dir)
+{
+	int wd = inotify_add_watch(inotify_fd, *dir ? dir : ".", WATCH_MASK);
+
+	if (wd < 0) {
+		/*
+		 * Out of watches (fs.inotify.max_user_watches) or the
+		 * directory vanished under us; either way we can no longer
+		 * vouch for anything.
+		 */
+		warning("unable to watch '%s': %s", dir, strerror(errno));
+		forget_everything();
+		return;
+	}
+	if (wd >= watched_dirs_alloc) {
+		int old_alloc = watched_dirs_alloc;
+		ALLOC_GROW(watched_dirs, wd + 1, watched_dirs_alloc);
+		memset(watched_dirs + old_alloc, 0,
+		       (watched_dirs_alloc - old_alloc) * sizeof(*watched_dirs));
+	}
+	free(watched_dirs[wd]);
+	watched_dirs[wd] = xstrdup(dir);
+}
+
+static void remove_watches_below(const char *dir)
+{
+	size_t len = strlen(dir);
+	int wd;
+
+	for (wd = 0; wd < watched_dirs_alloc; wd++) {
+		const char *p = watched_dirs[wd];
+		if (!p || strncmp(p, dir, len) || (p[len] && p[len] != '/'))
+			continue;
+		inotify_rm_watch(inotify_fd, wd);
+		free(watched_dirs[wd]);
+		watched_dirs[wd] = NULL;
+	}
+}
+
+static void handle_event(const struct inotify_event *ev)
+{
+	struct strbuf path = STRBUF_INIT;
+	const char *dir;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		forget_everything();
+		return;
+	}
+	if (ev->wd < 0 || ev->wd >= watched_dirs_alloc ||
+	    !(dir = watched_dirs[ev->wd]))
+		return;
+	if (ev->mask & IN_IGNORED) {
+		if (!*dir)
+			die("top-level directory went away");
+		free(watched_dirs[ev->wd]);
+		watched_dirs[ev->wd] = NULL;
+		return;
+	}
+	if (ev->mask & IN_DELETE_SELF)
+		return; /* reported by the parent directory */
+
+	if (ev->len && (ev->mask & IN_ISDIR) && !strcmp(ev->name, ".git"))
+		return;
+
+	strbuf_addstr(&path, dir);
+	if (ev->len && *ev->name) {
+		if (path.len)
+			strbuf_addch(&path, '/');
+		strbuf_addstr(&path, ev->name);
+	}
+
+	if ((ev->mask & IN_ISDIR) && (ev->mask & IN_MOVED_FROM)) {
+		/*
+		 * The paths below a directory that was moved away are
+		 * gone; a trailing slash asks git to check all of them.
+		 */
+		remove_watches_below(path.buf);
+		strbuf_addch(&path, '/');
+		record_change(path.buf);
+	} else if ((ev->mask & IN_ISDIR) &&
+		   (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+		record_change(path.buf);
+		add_watch_recursive(&path, 1);
+	} else
+		record_change(path.buf);
+	strbuf_release(&path);
+}
+
+/* Read and process everything the kernel has queued up so far. */
+static void drain_events(void)
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		ssize_t len = read(inotify_fd, buf, sizeof(buf));
+		char *p;
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return;
+			die_errno("read from inotify failed");
+		}
+		for (p = buf; p < buf + len; ) {
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+			handle_event(ev);
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+}
+
+/*
+ * Answer a query for the changes since "token": the new token, then
+ * each path changed since then, all NUL-terminated.
+ */
+static void answer_query(const char *token, FILE *out)
+{
+	const char *p;
+	char *end;
+	uintmax_t since = 0;
+	int everything = 1;
+
+	drain_events();
+
+	if (skip_prefix(token, instance.buf, &p) && *p++ == ':') {
+		since = strtoumax(p, &end, 10);
+		everything = *end || since < everything_changed_seq;
+	}
+
+	fprintf(out, "%s:%"PRIuMAX, instance.buf, seq);
+	fputc('\0', out);
+	if (everything) {
+		fputs("/", out);
+		fputc('\0', out);
+	} else {
+		struct hashmap_iter iter;
+		struct changed_path *e;
+
+		hashmap_iter_init(&changed_paths, &iter);
+		while ((e = hashmap_iter_next(&iter)))
+			if (e->seq > since) {
+				fputs(e->path, out);
+				fputc('\0', out);
+			}
+	}
+	trace_event("answered '%s' with %s", token,
+		    everything ? "everything" : "changed paths");
+
+	/* whatever happens from now on is after the token we handed out */
+	seq++;
+}
+
+static void serve_one_client(FILE *in, FILE *out)
+{
+	struct strbuf request = STRBUF_INIT;
+	const char *p;
+
+	if (strbuf_getline(&request, in, '\n'))
+		; /* ignore error */
+	else if (skip_prefix(request.buf, "query ", &p)) {
+		char *end;
+		long version = strtol(p, &end, 10);
+		if (version != 1 || (*end != ' ' && *end))
+			warning("unsupported fsmonitor protocol: %s", request.buf);
+		else
+			answer_query(*end ? end + 1 : end, out);
+	}
+	else if (!strcmp(request.buf, "quit"))
+		exit(0);
+	else
+		warning("fsmonitor client sent unknown request: %s", request.buf);
+	strbuf_release(&request);
+}
+
+static int serve_loop(int fd)
+{
+	struct pollfd pfd[2];
+
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = inotify_fd;
+	pfd[1].events = POLLIN;
+	if (poll(pfd, 2, -1) < 0) {
+		if (errno != EINTR)
+			die_errno("poll failed");
+		return 1;
+	}
+
+	if (pfd[1].revents & POLLIN)
+		drain_events();
+
+	if (pfd[0].revents & POLLIN) {
+		int client, client2;
+		FILE *in, *out;
+
+		client = accept(fd, NULL, NULL);
+		if (client < 0) {
+			warning("accept failed: %s", strerror(errno));
+			return 1;
+		}
+		client2 = dup(client);
+		if (client2 < 0) {
+			warning("dup failed: %s", strerror(errno));
+			close(client);
+			return 1;
+		}
+
+		in = xfdopen(client, "r");
+		out = xfdopen(client2, "w");
+		serve_one_client(in, out);
+		fclose(in);
+		fclose(out);
+	}
+	return 1;
+}
+
+static void serve(const char *socket_path)
+{
+	struct strbuf path = STRBUF_INIT;
+	int fd;
+
+	inotify_fd = inotify_init();
+	if (inotify_fd < 0)
+		die_errno("unable to initialize inotify");
+	if (fcntl(inotify_fd, F_SETFL, O_NONBLOCK) < 0)
+		die_errno("unable to make inotify descriptor non-blocking");
+	strbuf_addf(&instance, "%"PRIuMAX".%"PRIuMAX,
+		    (uintmax_t)getpid(), (uintmax_t)time(NULL));
+	hashmap_init(&changed_paths, (hashmap_cmp_fn)changed_path_cmp, 0);
+	add_watch_recursive(&path, 0);
+	strbuf_release(&path);
+
+	fd = unix_stream_listen(socket_path);
+	if (fd < 0)
+		die_errno("unable to bind to '%s'", socket_path);
+
+	printf("ok\n");
+	fclose(stdout);
+	if (!debug) {
+		if (!freopen("/dev/null", "w", stderr))
+			die_errno("unable to point stderr to /dev/null");
+	}
+
+	while (serve_loop(fd))
+		; /* nothing */
+
+	close(fd);
+}
+
+int main(int argc, const char **argv)
+{
+	const char *socket_path;
+	static const char *usage[] = {
+		"git-fsmonitor--daemon [opts] <socket_path>",
+		NULL
+	};
+	const struct option options[] = {
+		OPT_BOOL(0, "debug", &debug,
+			 N_("print debugging messages to stderr")),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, NULL, options, usage, 0);
+	socket_path = argv[0];
+
+	if (!socket_path)
+		usage_with_options(usage, options);
+
+	/* we are going to chdir to the top of the working tree */
+	socket_path = xstrdup(absolute_path(socket_path));
+	setup_git_directory();
+	setup_work_tree();
+	register_tempfile(&socket_file, socket_path);
+	serve(socket_path);
+	delete_tempfile(&socket_file);
+
+	return 0;
+}
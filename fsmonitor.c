@@ -0,0 +1,302 @@
+#include "cache.h"
+#include "dir.h"
+#include "ewah/ewok.h"
+#include "fsmonitor.h"
+#include "unix-socket.h"
+
+#define INDEX_EXTENSION_VERSION	(1)
+#define FSMONITOR_PROTOCOL_VERSION	(1)
+
+struct trace_key trace_fsmonitor = TRACE_KEY_INIT(FSMONITOR);
+
+static void fsmonitor_ewah_callback(size_t pos, void *is)
+{
+	struct index_state *istate = (struct index_state *)is;
+
+	if (pos < istate->cache_nr)
+		istate->cache[pos]->ce_flags &= ~CE_FSMONITOR_VALID;
+}
+
+int read_fsmonitor_extension(struct index_state *istate, const void *data,
+	unsigned long sz)
+{
+	const char *index = data;
+	uint32_t hdr_version;
+	uint32_t ewah_size;
+	struct ewah_bitmap *fsmonitor_dirty;
+	const char *token;
+	int ret;
+
+	if (sz < sizeof(uint32_t) + 1 + sizeof(uint32_t))
+		return error("corrupt fsmonitor extension (too short)");
+
+	hdr_version = get_be32(index);
+	index += sizeof(uint32_t);
+	if (hdr_version != INDEX_EXTENSION_VERSION)
+		return error("bad fsmonitor version %d", hdr_version);
+
+	token = index;
+	index = memchr(token, '\0', sz - sizeof(uint32_t));
+	if (!index || (const char *)data + sz - ++index < sizeof(uint32_t))
+		return error("corrupt fsmonitor extension (bad token)");
+
+	ewah_size = get_be32(index);
+	index += sizeof(uint32_t);
+
+	fsmonitor_dirty = ewah_new();
+	ret = ewah_read_mmap(fsmonitor_dirty, index, ewah_size);
+	if (ret != ewah_size) {
+		ewah_free(fsmonitor_dirty);
+		return error("failed to parse ewah bitmap reading fsmonitor index extension");
+	}
+	istate->fsmonitor_dirty = fsmonitor_dirty;
+	istate->fsmonitor_last_update = xstrdup(token);
+
+	trace_printf_key(&trace_fsmonitor, "read fsmonitor extension successful");
+	return 0;
+}
+
+void fill_fsmonitor_bitmap(struct index_state *istate)
+{
+	int i, skipped = 0;
+
+	if (istate->fsmonitor_dirty)
+		ewah_free(istate->fsmonitor_dirty);
+	istate->fsmonitor_dirty = ewah_new();
+	for (i = 0; i < istate->cache_nr; i++) {
+		/* entries marked CE_REMOVE are not written out */
+		if (istate->cache[i]->ce_flags & CE_REMOVE)
+			skipped++;
+		else if (!(istate->cache[i]->ce_flags & CE_FSMONITOR_VALID))
+			ewah_set(istate->fsmonitor_dirty, i - skipped);
+	}
+}
+
+void write_fsmonitor_extension(struct strbuf *sb, struct index_state *istate)
+{
+	uint32_t hdr_version;
+	uint32_t ewah_start;
+	uint32_t ewah_size = 0;
+	int fixup = 0;
+
+	put_be32(&hdr_version, INDEX_EXTENSION_VERSION);
+	strbuf_add(sb, &hdr_version, sizeof(uint32_t));
+
+	strbuf_addstr(sb, istate->fsmonitor_last_update);
+	strbuf_addch(sb, 0); /* Want to keep a NUL */
+
+	fixup = sb->len;
+	strbuf_add(sb, &ewah_size, sizeof(uint32_t)); /* we'll fix this up later */
+
+	ewah_start = sb->len;
+	ewah_serialize_strbuf(istate->fsmonitor_dirty, sb);
+	ewah_free(istate->fsmonitor_dirty);
+	istate->fsmonitor_dirty = NULL;
+
+	/* fix up size field */
+	put_be32(&ewah_size, sb->len - ewah_start);
+	memcpy(sb->buf + fixup, &ewah_size, sizeof(uint32_t));
+
+	trace_printf_key(&trace_fsmonitor, "write fsmonitor extension successful");
+}
+
+#ifndef NO_UNIX_SOCKETS
+/*
+ * Ask the daemon listening on core.fsmonitor for the paths changed
+ * since "last_update".  The request is a single line
+ *
+ *	query <protocol-version> <token>
+ *
+ * and the daemon answers with a new token followed by the list of
+ * changed paths, all NUL-terminated.  A path of "/" means that the
+ * daemon cannot tell what changed and everything must be checked.
+ */
+static int query_fsmonitor(const char *last_update, struct strbuf *answer)
+{
+	struct strbuf request = STRBUF_INIT;
+	int fd, ret = 0;
+
+	fd = unix_stream_connect(core_fsmonitor);
+	if (fd < 0)
+		return -1;
+
+	strbuf_addf(&request, "query %d %s\n",
+		    FSMONITOR_PROTOCOL_VERSION, last_update);
+	if (write_in_full(fd, request.buf, request.len) < 0)
+		ret = -1;
+	else {
+		shutdown(fd, SHUT_WR);
+		if (strbuf_read(answer, fd, 4096) < 0)
+			ret = -1;
+	}
+	close(fd);
+	strbuf_release(&request);
+	return ret;
+}
+#else
+static int query_fsmonitor(const char *last_update, struct strbuf *answer)
+{
+	return -1;
+}
+#endif
+
+static void fsmonitor_refresh_callback(struct index_state *istate, const char *name)
+{
+	int len = strlen(name);
+	int pos = index_name_pos(istate, name, len);
+
+	if (pos >= 0) {
+		struct cache_entry *ce = istate->cache[pos];
+		ce->ce_flags &= ~CE_FSMONITOR_VALID;
+	} else if (len && name[len - 1] == '/') {
+		/* a whole directory changed, e.g. it was renamed */
+		for (pos = -pos - 1; pos < istate->cache_nr; pos++) {
+			struct cache_entry *ce = istate->cache[pos];
+			if (ce_namelen(ce) < len || memcmp(ce->name, name, len))
+				break;
+			ce->ce_flags &= ~CE_FSMONITOR_VALID;
+		}
+	}
+
+	/*
+	 * Mark the untracked cache dirty even if it wasn't found in the index
+	 * as it could be a new untracked file.
+	 */
+	trace_printf_key(&trace_fsmonitor, "fsmonitor_refresh_callback '%s'", name);
+	untracked_cache_invalidate_path(istate, name);
+}
+
+void refresh_fsmonitor(struct index_state *istate)
+{
+	struct strbuf query_result = STRBUF_INIT;
+	int query_success = 0, everything = 0;
+	size_t bol = 0; /* beginning of line */
+	const char *buf;
+	int i;
+
+	if (!core_fsmonitor || !istate->fsmonitor_last_update ||
+	    istate->fsmonitor_has_run_once)
+		return;
+	istate->fsmonitor_has_run_once = 1;
+
+	trace_printf_key(&trace_fsmonitor, "refresh fsmonitor");
+	/*
+	 * The daemon answers with the token to use next time before
+	 * the list of changes.  Anything that happens after it handed
+	 * out that token will be reported by the next query, so the
+	 * stat data we are about to collect can never be newer than
+	 * what the token covers.
+	 */
+	if (!query_fsmonitor(istate->fsmonitor_last_update, &query_result) &&
+	    query_result.len) {
+		bol = strlen(query_result.buf) + 1;
+		query_success = bol <= query_result.len && bol > 1;
+	}
+	trace_printf_key(&trace_fsmonitor, "fsmonitor query '%s' %s",
+			 istate->fsmonitor_last_update,
+			 query_success ? "succeeded" : "failed");
+
+	if (query_success) {
+		buf = query_result.buf;
+		for (i = bol; i < query_result.len; i++) {
+			if (buf[i] != '\0')
+				continue;
+			if (!strcmp(buf + bol, "/")) {
+				everything = 1;
+				break;
+			}
+			if (i > bol)
+				fsmonitor_refresh_callback(istate, buf + bol);
+			bol = i + 1;
+		}
+	}
+
+	/*
+	 * A failed query or a path of "/" means the daemon cannot tell
+	 * what changed, so everything needs to be checked.
+	 */
+	if (!query_success || everything) {
+		for (i = 0; i < istate->cache_nr; i++)
+			istate->cache[i]->ce_flags &= ~CE_FSMONITOR_VALID;
+
+		if (istate->untracked)
+			istate->untracked->use_fsmonitor = 0;
+	}
+
+	/* Now that we've updated istate, save the last_update token */
+	if (query_success) {
+		/* write it out, or the list of changes only ever grows */
+		if (strcmp(istate->fsmonitor_last_update, query_result.buf))
+			istate->cache_changed |= FSMONITOR_CHANGED;
+		free(istate->fsmonitor_last_update);
+		istate->fsmonitor_last_update = xstrdup(query_result.buf);
+	}
+	strbuf_release(&query_result);
+}
+
+void add_fsmonitor(struct index_state *istate)
+{
+	int i;
+
+	if (!istate->fsmonitor_last_update) {
+		trace_printf_key(&trace_fsmonitor, "add fsmonitor");
+		istate->cache_changed |= FSMONITOR_CHANGED;
+		/* an empty token makes the daemon report everything */
+		istate->fsmonitor_last_update = xstrdup("");
+
+		/* reset the fsmonitor state */
+		for (i = 0; i < istate->cache_nr; i++)
+			istate->cache[i]->ce_flags &= ~CE_FSMONITOR_VALID;
+
+		if (istate->untracked)
+			istate->untracked->use_fsmonitor = 1;
+
+		/* Update the fsmonitor state */
+		refresh_fsmonitor(istate);
+	}
+}
+
+void remove_fsmonitor(struct index_state *istate)
+{
+	if (istate->fsmonitor_last_update) {
+		trace_printf_key(&trace_fsmonitor, "remove fsmonitor");
+		istate->cache_changed |= FSMONITOR_CHANGED;
+		free(istate->fsmonitor_last_update);
+		istate->fsmonitor_last_update = NULL;
+	}
+}
+
+void tweak_fsmonitor(struct index_state *istate)
+{
+	int i;
+	int fsmonitor_enabled = git_config_get_fsmonitor();
+
+	if (istate->fsmonitor_dirty) {
+		if (fsmonitor_enabled) {
+			/* Mark all entries valid */
+			for (i = 0; i < istate->cache_nr; i++)
+				istate->cache[i]->ce_flags |= CE_FSMONITOR_VALID;
+
+			/* Mark all previously saved entries as dirty */
+			ewah_each_bit(istate->fsmonitor_dirty, fsmonitor_ewah_callback, istate);
+
+			/* Now mark the untracked cache for fsmonitor usage */
+			if (istate->untracked)
+				istate->untracked->use_fsmonitor = 1;
+		}
+
+		ewah_free(istate->fsmonitor_dirty);
+		istate->fsmonitor_dirty = NULL;
+	}
+
+	if (fsmonitor_enabled) {
+		add_fsmonitor(istate);
+		/*
+		 * Callers like unpack_trees() trust CE_FSMONITOR_VALID via
+		 * ie_match_stat() without refreshing first, so bring the
+		 * flags up to date right away.
+		 */
+		refresh_fsmonitor(istate);
+	} else
+		remove_fsmonitor(istate);
+}
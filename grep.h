@@ -191,18 +191,21 @@ extern int grep_threads_ok(const struct grep_opt *opt);
  */
 extern int grep_use_locks;
 extern pthread_mutex_t grep_attr_mutex;
-extern pthread_mutex_t grep_read_mutex;
 
+/*
+ * Object reads lock by themselves; this makes longer sequences of
+ * object access (e.g. textconv) atomic.
+ */
 static inline void grep_read_lock(void)
 {
 	if (grep_use_locks)
-		pthread_mutex_lock(&grep_read_mutex);
+		obj_read_lock();
 }
 
 static inline void grep_read_unlock(void)
 {
 	if (grep_use_locks)
-		pthread_mutex_unlock(&grep_read_mutex);
+		obj_read_unlock();
 }
 
 #else
@@ -0,0 +1,390 @@
+#include "cache.h"
+#include "csum-file.h"
+#include "midx.h"
+
+static char *midx_path(const char *object_dir)
+{
+	return xstrfmt("%s/pack/multi-pack-index", object_dir);
+}
+
+static const char *pack_basename(const struct packed_git *p)
+{
+	const char *slash = strrchr(p->pack_name, '/');
+
+	return slash ? slash + 1 : p->pack_name;
+}
+
+static struct multi_pack_index *parse_multi_pack_index(const char *path,
+						       const unsigned char *data,
+						       size_t data_len)
+{
+	struct multi_pack_index *m;
+	const unsigned char *names, *end;
+	uint32_t i, names_len;
+	size_t fixed;
+
+	if (data_len < MIDX_HEADER_SIZE + 256 * 4 + 20) {
+		error("multi-pack index %s is too small", path);
+		return NULL;
+	}
+	if (get_be32(data) != MIDX_SIGNATURE) {
+		error("multi-pack index %s has a bad signature", path);
+		return NULL;
+	}
+	if (get_be32(data + 4) != MIDX_VERSION) {
+		error("multi-pack index %s has unknown version %"PRIu32,
+		      path, get_be32(data + 4));
+		return NULL;
+	}
+
+	m = xcalloc(1, sizeof(*m));
+	m->data = data;
+	m->data_len = data_len;
+	m->num_packs = get_be32(data + 8);
+	m->num_objects = get_be32(data + 12);
+	names_len = get_be32(data + 16);
+
+	fixed = MIDX_HEADER_SIZE + (size_t)names_len + 256 * 4 +
+		(size_t)m->num_objects * (20 + 4 + 4);
+	if (names_len & 3 || data_len - 20 < fixed ||
+	    (data_len - 20 - fixed) % 8)
+		goto corrupt;
+	m->num_large_offsets = (data_len - 20 - fixed) / 8;
+
+	names = data + MIDX_HEADER_SIZE;
+	end = names + names_len;
+	m->pack_names = xcalloc(m->num_packs, sizeof(*m->pack_names));
+	for (i = 0; i < m->num_packs; i++) {
+		const unsigned char *nul = memchr(names, '\0', end - names);
+
+		if (!nul || nul == names)
+			goto corrupt;
+		m->pack_names[i] = (const char *)names;
+		names = nul + 1;
+	}
+	m->packs = xcalloc(m->num_packs, sizeof(*m->packs));
+
+	m->fanout = end;
+	m->sha1s = m->fanout + 256 * 4;
+	m->pack_ids = m->sha1s + (size_t)m->num_objects * 20;
+	m->offsets = m->pack_ids + (size_t)m->num_objects * 4;
+	m->large_offsets = m->offsets + (size_t)m->num_objects * 4;
+	if (get_be32(m->fanout + 255 * 4) != m->num_objects)
+		goto corrupt;
+	return m;
+
+corrupt:
+	error("multi-pack index %s is corrupt", path);
+	free(m->pack_names);
+	free(m);
+	return NULL;
+}
+
+struct multi_pack_index *load_multi_pack_index(const char *object_dir)
+{
+	char *path = midx_path(object_dir);
+	struct multi_pack_index *m = NULL;
+	struct stat st;
+	void *data;
+	size_t len;
+	int fd;
+
+	fd = git_open_noatime(path);
+	if (fd < 0)
+		goto out;
+	if (fstat(fd, &st)) {
+		close(fd);
+		goto out;
+	}
+	len = xsize_t(st.st_size);
+	data = xmmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	m = parse_multi_pack_index(path, data, len);
+	if (m)
+		stat_validity_update(&m->validity, fd);
+	else
+		munmap(data, len);
+	close(fd);
+out:
+	free(path);
+	return m;
+}
+
+int multi_pack_index_is_current(struct multi_pack_index *m,
+				const char *object_dir)
+{
+	char *path = midx_path(object_dir);
+	int ret = stat_validity_check(&m->validity, path);
+
+	free(path);
+	return ret;
+}
+
+void close_multi_pack_index(struct multi_pack_index *m)
+{
+	if (!m)
+		return;
+	stat_validity_clear(&m->validity);
+	munmap((void *)m->data, m->data_len);
+	free(m->pack_names);
+	free(m->packs);
+	free(m);
+}
+
+int bsearch_midx(const struct multi_pack_index *m,
+		 const unsigned char *sha1, uint32_t *pos)
+{
+	uint32_t lo, hi;
+
+	hi = get_be32(m->fanout + *sha1 * 4);
+	lo = *sha1 ? get_be32(m->fanout + (*sha1 - 1) * 4) : 0;
+	if (hi > m->num_objects)
+		return 0;
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		int cmp = hashcmp(m->sha1s + (size_t)mi * 20, sha1);
+
+		if (!cmp) {
+			*pos = mi;
+			return 1;
+		}
+		if (cmp > 0)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
+	return 0;
+}
+
+int midx_pack_pos(const struct multi_pack_index *m, const char *name)
+{
+	uint32_t lo = 0, hi = m->num_packs;
+
+	while (lo < hi) {
+		uint32_t mi = lo + (hi - lo) / 2;
+		int cmp = strcmp(m->pack_names[mi], name);
+
+		if (!cmp)
+			return mi;
+		if (cmp > 0)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
+	return -1;
+}
+
+const unsigned char *nth_midxed_sha1(const struct multi_pack_index *m,
+				     uint32_t n)
+{
+	return m->sha1s + (size_t)n * 20;
+}
+
+uint32_t nth_midxed_pack_id(const struct multi_pack_index *m, uint32_t n)
+{
+	return get_be32(m->pack_ids + (size_t)n * 4);
+}
+
+off_t nth_midxed_offset(const struct multi_pack_index *m, uint32_t n)
+{
+	uint32_t off = get_be32(m->offsets + (size_t)n * 4);
+	const unsigned char *large;
+
+	if (!(off & 0x80000000))
+		return off;
+	off &= 0x7fffffff;
+	if (off >= m->num_large_offsets)
+		return 0;
+	large = m->large_offsets + (size_t)off * 8;
+	return ((uint64_t)get_be32(large) << 32) | get_be32(large + 4);
+}
+
+struct midx_entry {
+	unsigned char sha1[20];
+	uint32_t pack_id;
+	time_t mtime;
+	off_t offset;
+};
+
+static int midx_entry_cmp(const void *a_, const void *b_)
+{
+	const struct midx_entry *a = a_, *b = b_;
+	int cmp = hashcmp(a->sha1, b->sha1);
+
+	if (cmp)
+		return cmp;
+	/* of the copies of an object, keep the one in the youngest pack */
+	if (a->mtime != b->mtime)
+		return a->mtime > b->mtime ? -1 : 1;
+	return a->pack_id < b->pack_id ? -1 : a->pack_id > b->pack_id;
+}
+
+static int pack_name_cmp(const void *a_, const void *b_)
+{
+	const struct packed_git *a = *(const struct packed_git **)a_;
+	const struct packed_git *b = *(const struct packed_git **)b_;
+
+	return strcmp(pack_basename(a), pack_basename(b));
+}
+
+int write_multi_pack_index(const char *object_dir)
+{
+	static char tmp_file[PATH_MAX];
+	struct packed_git **packs = NULL, *p;
+	struct midx_entry *entries = NULL;
+	uint32_t nr_packs = 0, alloc_packs = 0, i, j;
+	uint32_t nr = 0, alloc = 0, nr_large = 0;
+	uint32_t names_len = 0, fanout[256];
+	struct sha1file *f;
+	char *path;
+	int fd;
+
+	prepare_packed_git();
+	for (p = packed_git; p; p = p->next) {
+		if (!p->pack_local)
+			continue;
+		if (open_pack_index(p))
+			return error("cannot open index for %s", p->pack_name);
+		ALLOC_GROW(packs, nr_packs + 1, alloc_packs);
+		packs[nr_packs++] = p;
+	}
+	qsort(packs, nr_packs, sizeof(*packs), pack_name_cmp);
+
+	for (i = 0; i < nr_packs; i++) {
+		p = packs[i];
+		names_len += strlen(pack_basename(p)) + 1;
+		ALLOC_GROW(entries, nr + p->num_objects, alloc);
+		for (j = 0; j < p->num_objects; j++) {
+			struct midx_entry *e = &entries[nr++];
+
+			hashcpy(e->sha1, nth_packed_object_sha1(p, j));
+			e->pack_id = i;
+			e->mtime = p->mtime;
+			e->offset = nth_packed_object_offset(p, j);
+		}
+	}
+	qsort(entries, nr, sizeof(*entries), midx_entry_cmp);
+	for (i = j = 0; i < nr; i++) {
+		if (j && !hashcmp(entries[j - 1].sha1, entries[i].sha1))
+			continue;
+		entries[j++] = entries[i];
+	}
+	nr = j;
+
+	fd = odb_mkstemp(tmp_file, sizeof(tmp_file), "pack/tmp_midx_XXXXXX");
+	if (fd < 0)
+		die_errno("unable to create '%s'", tmp_file);
+	f = sha1fd(fd, tmp_file);
+
+	sha1write_be32(f, MIDX_SIGNATURE);
+	sha1write_be32(f, MIDX_VERSION);
+	sha1write_be32(f, nr_packs);
+	sha1write_be32(f, nr);
+	sha1write_be32(f, (names_len + 3) & ~3);
+	for (i = 0; i < nr_packs; i++) {
+		const char *name = pack_basename(packs[i]);
+		sha1write(f, name, strlen(name) + 1);
+	}
+	for (i = names_len; i & 3; i++)
+		sha1write_u8(f, 0);
+
+	memset(fanout, 0, sizeof(fanout));
+	for (i = 0; i < nr; i++)
+		fanout[entries[i].sha1[0]]++;
+	for (i = 1; i < 256; i++)
+		fanout[i] += fanout[i - 1];
+	for (i = 0; i < 256; i++)
+		sha1write_be32(f, fanout[i]);
+	for (i = 0; i < nr; i++)
+		sha1write(f, entries[i].sha1, 20);
+	for (i = 0; i < nr; i++)
+		sha1write_be32(f, entries[i].pack_id);
+	for (i = 0; i < nr; i++) {
+		off_t offset = entries[i].offset;
+
+		if (offset >> 31)
+			sha1write_be32(f, 0x80000000 | nr_large++);
+		else
+			sha1write_be32(f, offset);
+	}
+	for (i = 0; i < nr; i++) {
+		off_t offset = entries[i].offset;
+
+		if (offset >> 31) {
+			sha1write_be32(f, (uint64_t)offset >> 32);
+			sha1write_be32(f, offset & 0xffffffff);
+		}
+	}
+	sha1close(f, NULL, CSUM_FSYNC);
+
+	path = midx_path(object_dir);
+	if (adjust_shared_perm(tmp_file))
+		die_errno("unable to make temporary multi-pack index readable");
+	if (rename(tmp_file, path))
+		die_errno("unable to rename temporary multi-pack index to '%s'",
+			  path);
+
+	free(path);
+	free(entries);
+	free(packs);
+	return 0;
+}
+
+int verify_multi_pack_index(const char *object_dir)
+{
+	struct multi_pack_index *m;
+	unsigned char sha1[20];
+	git_SHA_CTX ctx;
+	uint32_t i;
+	int errs = 0;
+
+	m = load_multi_pack_index(object_dir);
+	if (!m)
+		return error("no usable multi-pack index in %s", object_dir);
+
+	git_SHA1_Init(&ctx);
+	git_SHA1_Update(&ctx, m->data, m->data_len - 20);
+	git_SHA1_Final(sha1, &ctx);
+	if (hashcmp(sha1, m->data + m->data_len - 20))
+		errs |= error("multi-pack index checksum mismatch");
+
+	prepare_packed_git();
+	for (i = 0; i < m->num_packs; i++) {
+		struct packed_git *p;
+
+		if (i && strcmp(m->pack_names[i - 1], m->pack_names[i]) >= 0)
+			errs |= error("pack names out of order: '%s' before '%s'",
+				      m->pack_names[i - 1], m->pack_names[i]);
+		for (p = packed_git; p; p = p->next)
+			if (p->pack_local &&
+			    !strcmp(pack_basename(p), m->pack_names[i]))
+				break;
+		if (!p || open_pack_index(p))
+			errs |= error("missing pack %s", m->pack_names[i]);
+		m->packs[i] = p;
+	}
+	for (i = 1; i < 256; i++)
+		if (get_be32(m->fanout + (i - 1) * 4) >
+		    get_be32(m->fanout + i * 4))
+			errs |= error("fanout out of order at %"PRIu32, i);
+	for (i = 0; i < m->num_objects; i++) {
+		const unsigned char *name = nth_midxed_sha1(m, i);
+		uint32_t pack_id = nth_midxed_pack_id(m, i);
+		off_t offset;
+
+		if (i && hashcmp(nth_midxed_sha1(m, i - 1), name) >= 0)
+			errs |= error("object names out of order at %"PRIu32, i);
+		if (pack_id >= m->num_packs) {
+			errs |= error("bad pack for %s", sha1_to_hex(name));
+			continue;
+		}
+		if (!m->packs[pack_id])
+			continue;
+		offset = find_pack_entry_one(name, m->packs[pack_id]);
+		if (!offset || offset != nth_midxed_offset(m, i))
+			errs |= error("bad offset for %s in %s",
+				      sha1_to_hex(name),
+				      m->pack_names[pack_id]);
+	}
+	close_multi_pack_index(m);
+	return errs;
+}
@@ -0,0 +1,60 @@
+#ifndef MIDX_H
+#define MIDX_H
+
+/*
+ * A multi-pack index ($GIT_OBJECT_DIRECTORY/pack/multi-pack-index)
+ * lists the objects of all the packs of the object directory, with
+ * the pack and offset of each, so that an object is found with one
+ * binary search instead of one per pack.
+ * See Documentation/technical/pack-format.txt for the format.
+ */
+
+#define MIDX_SIGNATURE 0x4d494458 /* "MIDX" */
+#define MIDX_VERSION 1
+#define MIDX_HEADER_SIZE 20
+
+struct multi_pack_index {
+	const unsigned char *data;
+	size_t data_len;
+	uint32_t num_packs;
+	uint32_t num_objects;
+	uint32_t num_large_offsets;
+	const char **pack_names;	/* sorted, e.g. "pack-1234....pack" */
+	struct packed_git **packs;	/* filled by prepare_packed_git() */
+	const unsigned char *fanout;
+	const unsigned char *sha1s;
+	const unsigned char *pack_ids;
+	const unsigned char *offsets;
+	const unsigned char *large_offsets;
+	struct stat_validity validity;
+};
+
+extern struct multi_pack_index *load_multi_pack_index(const char *object_dir);
+extern void close_multi_pack_index(struct multi_pack_index *m);
+/* 1 if the file m was loaded from has not changed since */
+extern int multi_pack_index_is_current(struct multi_pack_index *m,
+				       const char *object_dir);
+
+/*
+ * Find sha1 in m; returns 1 and stores its position in *pos if found,
+ * 0 otherwise.
+ */
+extern int bsearch_midx(const struct multi_pack_index *m,
+			const unsigned char *sha1, uint32_t *pos);
+/* position of the pack name (e.g. "pack-1234....pack") in m, or -1 */
+extern int midx_pack_pos(const struct multi_pack_index *m, const char *name);
+extern const unsigned char *nth_midxed_sha1(const struct multi_pack_index *m,
+					    uint32_t n);
+extern uint32_t nth_midxed_pack_id(const struct multi_pack_index *m,
+				   uint32_t n);
+extern off_t nth_midxed_offset(const struct multi_pack_index *m, uint32_t n);
+
+/*
+ * Write a multi-pack index of the local packs of the repository, or
+ * check the one there is against the packs it lists.  Both return 0
+ * on success.
+ */
+extern int write_multi_pack_index(const char *object_dir);
+extern int verify_multi_pack_index(const char *object_dir);
+
+#endif
@@ -7,6 +7,7 @@
  */
 #define NO_THE_INDEX_COMPATIBILITY_MACROS
 #include "cache.h"
+#include "thread-utils.h"
 
 struct dir_entry {
 	struct hashmap_entry ent;
@@ -14,6 +15,8 @@ struct dir_entry {
 	struct cache_entry *ce;
 	int nr;
 	unsigned int namelen;
+	/* position of ce in the index while the entry is stashed */
+	int ce_pos;
 };
 
 static int dir_entry_cmp(const struct dir_entry *e1,
@@ -23,16 +26,22 @@ static int dir_entry_cmp(const struct dir_entry *e1,
 			name ? name : e2->ce->name, e1->namelen);
 }
 
-static struct dir_entry *find_dir_entry(struct index_state *istate,
+static struct dir_entry *find_dir_entry_1(struct hashmap *dir_hash,
 		const char *name, unsigned int namelen)
 {
 	struct dir_entry key;
 	hashmap_entry_init(&key, memihash(name, namelen));
 	key.namelen = namelen;
-	return hashmap_get(&istate->dir_hash, &key, name);
+	return hashmap_get(dir_hash, &key, name);
+}
+
+static struct dir_entry *find_dir_entry(struct index_state *istate,
+		const char *name, unsigned int namelen)
+{
+	return find_dir_entry_1(&istate->dir_hash, name, namelen);
 }
 
-static struct dir_entry *hash_dir_entry(struct index_state *istate,
+static struct dir_entry *hash_dir_entry(struct hashmap *dir_hash,
 		struct cache_entry *ce, int namelen)
 {
 	/*
@@ -60,17 +69,17 @@ static struct dir_entry *hash_dir_entry(struct index_state *istate,
 	namelen--;
 
 	/* lookup existing entry for that directory */
-	dir = find_dir_entry(istate, ce->name, namelen);
+	dir = find_dir_entry_1(dir_hash, ce->name, namelen);
 	if (!dir) {
 		/* not found, create it and add to hash table */
 		dir = xcalloc(1, sizeof(struct dir_entry));
 		hashmap_entry_init(dir, memihash(ce->name, namelen));
 		dir->namelen = namelen;
 		dir->ce = ce;
-		hashmap_add(&istate->dir_hash, dir);
+		hashmap_add(dir_hash, dir);
 
 		/* recursively add missing parent directories */
-		dir->parent = hash_dir_entry(istate, ce, namelen);
+		dir->parent = hash_dir_entry(dir_hash, ce, namelen);
 	}
 	return dir;
 }
@@ -78,7 +87,7 @@ static struct dir_entry *hash_dir_entry(struct index_state *istate,
 static void add_dir_entry(struct index_state *istate, struct cache_entry *ce)
 {
 	/* Add reference to the directory entry (and parents if 0). */
-	struct dir_entry *dir = hash_dir_entry(istate, ce, ce_namelen(ce));
+	struct dir_entry *dir = hash_dir_entry(&istate->dir_hash, ce, ce_namelen(ce));
 	while (dir && !(dir->nr++))
 		dir = dir->parent;
 }
@@ -89,7 +98,7 @@ static void remove_dir_entry(struct index_state *istate, struct cache_entry *ce)
 	 * Release reference to the directory entry. If 0, remove and continue
 	 * with parent directory.
 	 */
-	struct dir_entry *dir = hash_dir_entry(istate, ce, ce_namelen(ce));
+	struct dir_entry *dir = hash_dir_entry(&istate->dir_hash, ce, ce_namelen(ce));
 	while (dir && !(--dir->nr)) {
 		struct dir_entry *parent = dir->parent;
 		hashmap_remove(&istate->dir_hash, dir, NULL);
@@ -121,7 +130,232 @@ static int cache_entry_cmp(const struct cache_entry *ce1,
 	return remove ? !(ce1 == ce2) : 0;
 }
 
-static void lazy_init_name_hash(struct index_state *istate)
+/*
+ * The hashes of the last index discarded with discard_index_to_reread()
+ * without having been changed since it was read.  Commands that discard
+ * and re-read the same index (e.g. around running a hook or a child
+ * process) get them back instead of hashing every name again.
+ */
+static struct {
+	unsigned char sha1[20];
+	int nr;
+	size_t journal_size;
+	unsigned int *hash;
+	int has_dirs;
+	struct hashmap dir_hash;
+} stash;
+
+static void free_stash(void)
+{
+	free(stash.hash);
+	stash.hash = NULL;
+	hashmap_free(&stash.dir_hash, 1);
+}
+
+void stash_name_hash(struct index_state *istate)
+{
+	struct hashmap_iter iter;
+	struct dir_entry *dir;
+	int nr;
+
+	free_stash();
+	if (!istate->name_hash_initialized ||
+	    !istate->initialized || istate->cache_changed ||
+	    is_null_sha1(istate->sha1) ||
+	    istate->name_hash.size != (unsigned int)istate->cache_nr)
+		return;
+
+	hashcpy(stash.sha1, istate->sha1);
+	stash.nr = istate->cache_nr;
+	stash.journal_size = index_journal_size(istate);
+	stash.hash = xmalloc(sizeof(*stash.hash) * stash.nr);
+	for (nr = 0; nr < istate->cache_nr; nr++)
+		stash.hash[nr] = istate->cache[nr]->ent.hash;
+
+	stash.has_dirs = ignore_case;
+	hashmap_iter_init(&istate->dir_hash, &iter);
+	while ((dir = hashmap_iter_next(&iter))) {
+		int pos = index_name_pos(istate, dir->ce->name,
+					 ce_namelen(dir->ce));
+		dir->ce_pos = pos < 0 ? -pos - 1 : pos;
+		dir->ce = NULL;
+	}
+	stash.dir_hash = istate->dir_hash;
+	memset(&istate->dir_hash, 0, sizeof(istate->dir_hash));
+}
+
+static int restore_name_hash(struct index_state *istate)
+{
+	struct hashmap_iter iter;
+	struct dir_entry *dir;
+	int nr;
+
+	if (!stash.hash)
+		return 0;
+	if (stash.nr != istate->cache_nr || stash.has_dirs != ignore_case ||
+	    istate->cache_changed || hashcmp(stash.sha1, istate->sha1) ||
+	    stash.journal_size != index_journal_size(istate)) {
+		free_stash();
+		return 0;
+	}
+
+	for (nr = 0; nr < istate->cache_nr; nr++) {
+		struct cache_entry *ce = istate->cache[nr];
+
+		if (ce->ce_flags & CE_HASHED)
+			continue;
+		ce->ce_flags |= CE_HASHED;
+		hashmap_entry_init(ce, stash.hash[nr]);
+		hashmap_add(&istate->name_hash, ce);
+	}
+	free(stash.hash);
+	stash.hash = NULL;
+
+	hashmap_free(&istate->dir_hash, 1);
+	istate->dir_hash = stash.dir_hash;
+	memset(&stash.dir_hash, 0, sizeof(stash.dir_hash));
+	hashmap_iter_init(&istate->dir_hash, &iter);
+	while ((dir = hashmap_iter_next(&iter)))
+		dir->ce = istate->cache[dir->ce_pos];
+	return 1;
+}
+
+#ifndef NO_PTHREADS
+/*
+ * Entries per thread below which building the hashes in parallel does
+ * not pay for starting the threads.
+ */
+#define LAZY_THREAD_COST 2000
+#define LAZY_MAX_THREADS 16
+
+struct lazy_thread_data {
+	pthread_t pthread;
+	struct index_state *istate;
+	int begin, end;
+	struct hashmap dir_hash;
+};
+
+/*
+ * Hash the names of a range of the index, and collect the directories
+ * of its entries in a map of the thread's own.  Only the entries
+ * directly in a directory are counted here; its subdirectories are
+ * counted once the maps of all threads have been merged.
+ */
+static void *lazy_hash_thread(void *_data)
+{
+	struct lazy_thread_data *p = _data;
+	int nr;
+
+	for (nr = p->begin; nr < p->end; nr++) {
+		struct cache_entry *ce = p->istate->cache[nr];
+		struct dir_entry *dir;
+
+		if (ce->ce_flags & CE_HASHED)
+			continue;
+		hashmap_entry_init(ce, memihash(ce->name, ce_namelen(ce)));
+		if (!ignore_case)
+			continue;
+		dir = hash_dir_entry(&p->dir_hash, ce, ce_namelen(ce));
+		if (dir)
+			dir->nr++;
+	}
+	return NULL;
+}
+
+static void merge_dir_hash(struct index_state *istate, struct hashmap *dir_hash)
+{
+	struct hashmap_iter iter;
+	struct dir_entry *dir, *found;
+
+	hashmap_iter_init(dir_hash, &iter);
+	while ((dir = hashmap_iter_next(&iter))) {
+		found = hashmap_get(&istate->dir_hash, dir, NULL);
+		if (found) {
+			found->nr += dir->nr;
+			free(dir);
+		} else
+			hashmap_add(&istate->dir_hash, dir);
+	}
+	hashmap_free(dir_hash, 0);
+}
+
+/*
+ * Point the merged directories at their parents, and count each of
+ * them (none is empty) in its parent.
+ */
+static void link_dir_entries(struct index_state *istate)
+{
+	struct hashmap_iter iter;
+	struct dir_entry *dir;
+
+	hashmap_iter_init(&istate->dir_hash, &iter);
+	while ((dir = hashmap_iter_next(&iter))) {
+		int len = dir->namelen;
+
+		while (len > 0 && !is_dir_sep(dir->ce->name[len - 1]))
+			len--;
+		dir->parent = len > 0 ?
+			find_dir_entry(istate, dir->ce->name, len - 1) : NULL;
+		if (dir->parent)
+			dir->parent->nr++;
+	}
+}
+
+static int lazy_nr_threads(struct index_state *istate)
+{
+	return thread_count("GIT_TEST_NAME_HASH_THREADS", 0, istate->cache_nr,
+			    LAZY_THREAD_COST, LAZY_MAX_THREADS);
+}
+
+static int lazy_init_threaded(struct index_state *istate)
+{
+	struct lazy_thread_data *data;
+	int nr, threads = lazy_nr_threads(istate);
+	int chunk;
+
+	if (threads < 2 || istate->cache_nr < threads)
+		return 0;
+
+	data = xcalloc(threads, sizeof(*data));
+	chunk = DIV_ROUND_UP(istate->cache_nr, threads);
+	for (nr = 0; nr < threads; nr++) {
+		struct lazy_thread_data *p = &data[nr];
+
+		p->istate = istate;
+		p->begin = nr * chunk;
+		p->end = p->begin + chunk;
+		if (p->end > istate->cache_nr)
+			p->end = istate->cache_nr;
+		hashmap_init(&p->dir_hash, (hashmap_cmp_fn) dir_entry_cmp, 0);
+		if (pthread_create(&p->pthread, NULL, lazy_hash_thread, p))
+			die("unable to create lazy_init_name_hash thread");
+	}
+	for (nr = 0; nr < threads; nr++) {
+		if (pthread_join(data[nr].pthread, NULL))
+			die("unable to join lazy_init_name_hash thread");
+		merge_dir_hash(istate, &data[nr].dir_hash);
+	}
+	free(data);
+	link_dir_entries(istate);
+
+	for (nr = 0; nr < istate->cache_nr; nr++) {
+		struct cache_entry *ce = istate->cache[nr];
+
+		if (ce->ce_flags & CE_HASHED)
+			continue;
+		ce->ce_flags |= CE_HASHED;
+		hashmap_add(&istate->name_hash, ce);
+	}
+	return 1;
+}
+#else
+static inline int lazy_init_threaded(struct index_state *istate)
+{
+	return 0;
+}
+#endif
+
+void lazy_init_name_hash(struct index_state *istate)
 {
 	int nr;
 
@@ -130,8 +364,9 @@ static void lazy_init_name_hash(struct index_state *istate)
 	hashmap_init(&istate->name_hash, (hashmap_cmp_fn) cache_entry_cmp,
 			istate->cache_nr);
 	hashmap_init(&istate->dir_hash, (hashmap_cmp_fn) dir_entry_cmp, 0);
-	for (nr = 0; nr < istate->cache_nr; nr++)
-		hash_index_entry(istate, istate->cache[nr]);
+	if (!restore_name_hash(istate) && !lazy_init_threaded(istate))
+		for (nr = 0; nr < istate->cache_nr; nr++)
+			hash_index_entry(istate, istate->cache[nr]);
 	istate->name_hash_initialized = 1;
 }
 
@@ -0,0 +1,231 @@
+/*
+ * Hashing the new files of "git add" in parallel.
+ *
+ * prehash_files() reads, converts, hashes and writes as loose objects
+ * the files it is given from several threads, and remembers the object
+ * name of each with the stat data of the file it was read from.
+ * add_to_index() then picks up the object name of a file that has not
+ * changed since, instead of hashing the file again, so that the entries
+ * are still added to the index one after the other and in order.
+ */
+#include "cache.h"
+#include "blob.h"
+#include "convert.h"
+#include "thread-utils.h"
+
+/*
+ * Files hashed per thread, below which "git add" hashes its files by
+ * itself.
+ */
+#define PREHASH_THREAD_COST 50
+#define MAX_PREHASH_THREADS 64
+
+struct prehashed_file {
+	struct hashmap_entry ent;
+	struct stat_data sd;
+	unsigned char sha1[20];
+	char path[FLEX_ARRAY];
+};
+
+static struct hashmap prehashed_files;
+
+static int prehashed_file_cmp(const struct prehashed_file *a,
+			      const struct prehashed_file *b,
+			      const char *path)
+{
+	return strcmp(a->path, path ? path : b->path);
+}
+
+int find_prehashed_file(const char *path, struct stat *st, unsigned char *sha1)
+{
+	struct prehashed_file key, *file;
+
+	if (!prehashed_files.tablesize)
+		return 0;
+	hashmap_entry_init(&key, strhash(path));
+	file = hashmap_get(&prehashed_files, &key, path);
+	if (!file || match_stat_data(&file->sd, st))
+		return 0;
+	hashcpy(sha1, file->sha1);
+	return 1;
+}
+
+void clear_prehashed_files(void)
+{
+	hashmap_free(&prehashed_files, 1);
+}
+
+#ifndef NO_PTHREADS
+struct prehash_item {
+	const char *path;
+	struct stat st;
+	unsigned char sha1[20];
+	int status;	/* 0 written, -1 left for add_to_index() */
+};
+
+static struct prehash {
+	struct prehash_item *item;
+	int nr, next;
+	/*
+	 * A file modified in the same second as (or after) it was read
+	 * could have different contents with the same stat data.
+	 */
+	time_t start;
+} prehash;
+
+static pthread_mutex_t prehash_mutex;
+static pthread_mutex_t convert_mutex;
+
+static int prehash_file(struct prehash_item *item)
+{
+	struct strbuf buf = STRBUF_INIT, nbuf = STRBUF_INIT;
+	int fd, exists, ret = -1;
+	ssize_t size;
+
+	if (lstat(item->path, &item->st) || !S_ISREG(item->st.st_mode))
+		return -1;
+	fd = open(item->path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	/* large blobs are left to add_to_index(), which streams them */
+	if (fstat(fd, &item->st) || !S_ISREG(item->st.st_mode) ||
+	    item->st.st_size > big_file_threshold ||
+	    item->st.st_mtime >= prehash.start) {
+		close(fd);
+		return -1;
+	}
+	size = strbuf_read(&buf, fd, xsize_t(item->st.st_size));
+	close(fd);
+	if (size != item->st.st_size)
+		goto out;
+
+	/* the attributes and the index are not thread-safe */
+	pthread_mutex_lock(&convert_mutex);
+	if (convert_to_git(item->path, buf.buf, buf.len, &nbuf, safe_crlf))
+		strbuf_swap(&buf, &nbuf);
+	pthread_mutex_unlock(&convert_mutex);
+
+	hash_sha1_file(buf.buf, buf.len, blob_type, item->sha1);
+	obj_read_lock();
+	exists = freshen_object(item->sha1);
+	obj_read_unlock();
+	if (exists ||
+	    !write_loose_sha1_file(buf.buf, buf.len, blob_type, item->sha1))
+		ret = 0;
+out:
+	strbuf_release(&buf);
+	strbuf_release(&nbuf);
+	return ret;
+}
+
+static struct prehash_item *next_prehash_item(void)
+{
+	struct prehash_item *item = NULL;
+
+	pthread_mutex_lock(&prehash_mutex);
+	if (prehash.next < prehash.nr)
+		item = &prehash.item[prehash.next++];
+	pthread_mutex_unlock(&prehash_mutex);
+	return item;
+}
+
+static void *prehash_thread(void *unused)
+{
+	struct prehash_item *item;
+
+	while ((item = next_prehash_item()) != NULL)
+		item->status = prehash_file(item);
+	return NULL;
+}
+
+static int prehash_threads(int nr)
+{
+	int workers = 0;
+
+	git_config_get_int("add.workers", &workers);
+	return thread_count("GIT_TEST_ADD_THREADS", workers, nr,
+			    PREHASH_THREAD_COST, MAX_PREHASH_THREADS);
+}
+
+static void prehash_in_parallel(int threads)
+{
+	pthread_t *pthread;
+	int i;
+
+	pthread_mutex_init(&prehash_mutex, NULL);
+	pthread_mutex_init(&convert_mutex, NULL);
+	enable_obj_read_lock();
+	pthread = xcalloc(threads, sizeof(*pthread));
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&pthread[i], NULL, prehash_thread, NULL))
+			die("unable to create prehash thread");
+	for (i = 0; i < threads; i++)
+		if (pthread_join(pthread[i], NULL))
+			die("unable to join prehash thread");
+	disable_obj_read_lock();
+	clear_loose_object_cache();
+	free(pthread);
+	pthread_mutex_destroy(&convert_mutex);
+	pthread_mutex_destroy(&prehash_mutex);
+}
+
+static void remember_prehashed_file(struct prehash_item *item)
+{
+	struct prehashed_file *file;
+	size_t len = strlen(item->path);
+
+	file = xmalloc(sizeof(*file) + len + 1);
+	hashmap_entry_init(file, strhash(item->path));
+	fill_stat_data(&file->sd, &item->st);
+	hashcpy(file->sha1, item->sha1);
+	memcpy(file->path, item->path, len + 1);
+	hashmap_add(&prehashed_files, file);
+}
+
+/*
+ * Files with a "filter" driver run an external command to be
+ * converted, and are left to add_to_index(), as are the files of a
+ * case-insensitive file system, whose names may not be the ones
+ * add_to_index() looks up.
+ */
+void prehash_files(const char **paths, int nr)
+{
+	int i, threads, hashed = 0;
+
+	if (ignore_case)
+		return;
+	threads = prehash_threads(nr);
+	if (threads < 2)
+		return;
+
+	prehash.item = xcalloc(nr, sizeof(*prehash.item));
+	for (i = 0; i < nr; i++) {
+		if (has_filter_driver(paths[i]))
+			continue;
+		prehash.item[prehash.nr++].path = paths[i];
+	}
+	prehash.start = time(NULL);
+	if (threads > prehash.nr)
+		threads = prehash.nr;
+	if (threads)
+		prehash_in_parallel(threads);
+
+	hashmap_init(&prehashed_files, (hashmap_cmp_fn)prehashed_file_cmp,
+		     prehash.nr);
+	for (i = 0; i < prehash.nr; i++) {
+		if (prehash.item[i].status)
+			continue;
+		remember_prehashed_file(&prehash.item[i]);
+		hashed++;
+	}
+	trace_printf("parallel add: %d of %d files hashed in %d threads\n",
+		     hashed, nr, threads);
+	free(prehash.item);
+	memset(&prehash, 0, sizeof(prehash));
+}
+#else
+void prehash_files(const char **paths, int nr)
+{
+	; /* nothing */
+}
+#endif
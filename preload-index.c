@@ -4,10 +4,14 @@
 #include "cache.h"
 #include "pathspec.h"
 #include "dir.h"
+#include "fsmonitor.h"
+#include "convert.h"
+#include "blob.h"
+#include "thread-utils.h"
 
 #ifdef NO_PTHREADS
-static void preload_index(struct index_state *index,
-			  const struct pathspec *pathspec)
+void preload_index(struct index_state *index,
+		   const struct pathspec *pathspec)
 {
 	; /* nothing */
 }
@@ -16,82 +20,322 @@ static void preload_index(struct index_state *index,
 #include <pthread.h>
 
 /*
- * Mostly randomly chosen maximum thread counts: we
- * cap the parallelism to 20 threads, and we want
- * to have at least 500 lstat's per thread for it to
- * be worth starting a thread.
+ * We want to have at least THREAD_COST lstat's per thread for it
+ * to be worth starting a thread, and we do not start more threads
+ * than there are CPUs.  When lstat() turns out to be slow (e.g. on
+ * a network filesystem) the threads spend most of their time waiting
+ * for the server, so we are willing to start more of them, and
+ * earlier.  MAX_PARALLEL is only a sanity cap.
  */
-#define MAX_PARALLEL (20)
+#define MAX_PARALLEL (64)
 #define THREAD_COST (500)
+#define SLOW_THREAD_COST (50)
+#define SLOW_LSTAT_NS (50000)
+#define SLOW_LSTAT_THREADS_PER_CPU (4)
+#define LSTAT_SAMPLE (16)
+
+/*
+ * The index is cut into CHUNKS_PER_THREAD times as many chunks as
+ * there are threads; threads that finish early pick up the chunks
+ * the slower ones have not got to yet.
+ */
+#define CHUNKS_PER_THREAD (4)
+
+struct preload_queue {
+	pthread_mutex_t mutex;
+	int *chunk;	/* chunk i is [chunk[i], chunk[i + 1]) */
+	int nr_chunks;
+	int next;
+};
 
 struct thread_data {
 	pthread_t pthread;
 	struct index_state *index;
 	struct pathspec pathspec;
-	int offset, nr;
+	struct preload_queue *queue;
+	int fsmonitor_marked;
+
+	/* racily clean entries that need hashing */
+	int *racy;
+	int racy_nr, racy_alloc;
 };
 
-static void *preload_thread(void *_data)
+static int next_chunk(struct preload_queue *queue)
 {
 	int nr;
+
+	pthread_mutex_lock(&queue->mutex);
+	nr = queue->next < queue->nr_chunks ? queue->next++ : -1;
+	pthread_mutex_unlock(&queue->mutex);
+	return nr;
+}
+
+static void mark_uptodate(struct thread_data *p, struct cache_entry *ce)
+{
+	ce_mark_uptodate(ce);
+	if (core_fsmonitor) {
+		/* index->cache_changed is updated by the main thread */
+		ce->ce_flags |= CE_FSMONITOR_VALID;
+		p->fsmonitor_marked = 1;
+	}
+}
+
+/*
+ * An entry whose stat data matches but whose timestamp is racy has to
+ * be hashed to tell whether it is clean.  Rather than leaving that to
+ * ce_compare_data() on the main thread, the lstat threads collect such
+ * entries, and those that are plain blobs that do not need to go
+ * through convert_to_git() are hashed by a second round of threads.
+ */
+static int is_racy_candidate(struct index_state *index,
+			     const struct cache_entry *ce, struct stat *st)
+{
+	return S_ISREG(st->st_mode) &&
+		ce->ce_stat_data.sd_size == (unsigned int)st->st_size &&
+		xsize_t(st->st_size) <= big_file_threshold &&
+		is_racy_timestamp(index, ce);
+}
+
+static int racy_entry_is_clean(const struct cache_entry *ce)
+{
+	struct strbuf sb = STRBUF_INIT;
+	unsigned char sha1[20];
+	int clean = 0;
+
+	if (strbuf_read_file(&sb, ce->name, ce->ce_stat_data.sd_size) ==
+	    ce->ce_stat_data.sd_size &&
+	    !hash_sha1_file(sb.buf, sb.len, blob_type, sha1))
+		clean = !hashcmp(sha1, ce->sha1);
+	strbuf_release(&sb);
+	return clean;
+}
+
+static void *preload_thread(void *_data)
+{
 	struct thread_data *p = _data;
 	struct index_state *index = p->index;
-	struct cache_entry **cep = index->cache + p->offset;
 	struct cache_def cache = CACHE_DEF_INIT;
+	int c;
 
-	nr = p->nr;
-	if (nr + p->offset > index->cache_nr)
-		nr = index->cache_nr - p->offset;
+	while ((c = next_chunk(p->queue)) >= 0) {
+		int i;
 
-	do {
-		struct cache_entry *ce = *cep++;
-		struct stat st;
+		for (i = p->queue->chunk[c]; i < p->queue->chunk[c + 1]; i++) {
+			struct cache_entry *ce = index->cache[i];
+			struct stat st;
+			int changed;
 
-		if (ce_stage(ce))
-			continue;
-		if (S_ISGITLINK(ce->ce_mode))
-			continue;
-		if (ce_uptodate(ce))
-			continue;
-		if (!ce_path_match(ce, &p->pathspec, NULL))
-			continue;
-		if (threaded_has_symlink_leading_path(&cache, ce->name, ce_namelen(ce)))
-			continue;
-		if (lstat(ce->name, &st))
-			continue;
-		if (ie_match_stat(index, ce, &st, CE_MATCH_RACY_IS_DIRTY))
-			continue;
-		ce_mark_uptodate(ce);
-	} while (--nr > 0);
+			if (ce_stage(ce))
+				continue;
+			if (S_ISGITLINK(ce->ce_mode))
+				continue;
+			if (ce_uptodate(ce))
+				continue;
+			if (ce->ce_flags & CE_FSMONITOR_VALID)
+				continue;
+			if (!ce_path_match(ce, &p->pathspec, NULL))
+				continue;
+			if (threaded_has_symlink_leading_path(&cache, ce->name, ce_namelen(ce)))
+				continue;
+			if (lstat(ce->name, &st))
+				continue;
+			changed = ie_match_stat(index, ce, &st, CE_MATCH_RACY_IS_DIRTY);
+			if (changed) {
+				if (changed == DATA_CHANGED &&
+				    is_racy_candidate(index, ce, &st)) {
+					ALLOC_GROW(p->racy, p->racy_nr + 1,
+						   p->racy_alloc);
+					p->racy[p->racy_nr++] = i;
+				}
+				continue;
+			}
+			mark_uptodate(p, ce);
+		}
+	}
 	cache_def_clear(&cache);
 	return NULL;
 }
 
-static void preload_index(struct index_state *index,
-			  const struct pathspec *pathspec)
+static void *hash_thread(void *_data)
 {
-	int threads, i, work, offset;
-	struct thread_data data[MAX_PARALLEL];
+	struct thread_data *p = _data;
+	int i;
+
+	for (i = 0; i < p->racy_nr; i++) {
+		struct cache_entry *ce = p->index->cache[p->racy[i]];
+		if (racy_entry_is_clean(ce))
+			mark_uptodate(p, ce);
+	}
+	return NULL;
+}
+
+/*
+ * Check the attributes of the racy entries the lstat threads found
+ * (the attribute machinery is not thread-safe, and looks at other
+ * index entries whose flags the lstat threads are updating) and hash
+ * those that need no conversion on "threads" threads.
+ */
+static void hash_racy_entries(struct thread_data *data, int threads)
+{
+	int *racy = NULL;
+	int nr = 0, alloc = 0, i, work;
+
+	for (i = 0; i < threads; i++) {
+		struct thread_data *p = data+i;
+		int j;
+
+		for (j = 0; j < p->racy_nr; j++) {
+			if (would_convert_to_git(p->index->cache[p->racy[j]]->name))
+				continue;
+			ALLOC_GROW(racy, nr + 1, alloc);
+			racy[nr++] = p->racy[j];
+		}
+		free(p->racy);
+		p->racy = NULL;
+		p->racy_nr = 0;
+	}
+	if (!nr)
+		return;
+
+	if (threads > nr)
+		threads = nr;
+	work = DIV_ROUND_UP(nr, threads);
+	for (i = 0; i < threads; i++) {
+		struct thread_data *p = data+i;
+		p->racy = racy + i * work;
+		p->racy_nr = nr - i * work < work ? nr - i * work : work;
+		if (pthread_create(&p->pthread, NULL, hash_thread, p))
+			die("unable to create threaded hash");
+	}
+	for (i = 0; i < threads; i++) {
+		struct thread_data *p = data+i;
+		if (pthread_join(p->pthread, NULL))
+			die("unable to join threaded hash");
+		p->racy = NULL;
+	}
+	free(racy);
+}
+
+static int same_directory(const struct cache_entry *a,
+			  const struct cache_entry *b)
+{
+	const char *slash_a = strrchr(a->name, '/');
+	const char *slash_b = strrchr(b->name, '/');
+	int len_a = slash_a ? slash_a - a->name : 0;
+	int len_b = slash_b ? slash_b - b->name : 0;
+
+	return len_a == len_b && !memcmp(a->name, b->name, len_a);
+}
+
+/*
+ * Cut the index into chunks of roughly "size" entries.  A chunk is
+ * grown (up to twice its size) so that it does not end in the middle
+ * of a directory; this keeps the leading-path cache of the thread that
+ * processes it warm and keeps threads from stat'ing the same
+ * directories.
+ */
+static int partition_index(struct index_state *index, int size, int **chunk)
+{
+	int nr = 0, alloc = 0, start = 0;
+
+	*chunk = NULL;
+	while (start < index->cache_nr) {
+		int end = start + size;
+
+		if (end >= index->cache_nr)
+			end = index->cache_nr;
+		else
+			while (end < index->cache_nr &&
+			       end < start + 2 * size &&
+			       same_directory(index->cache[end - 1],
+					      index->cache[end]))
+				end++;
+		ALLOC_GROW(*chunk, nr + 1, alloc);
+		(*chunk)[nr++] = start;
+		start = end;
+	}
+	ALLOC_GROW(*chunk, nr + 1, alloc);
+	(*chunk)[nr] = index->cache_nr;
+	return nr;
+}
+
+/*
+ * Time a handful of lstat() calls spread over the index to find out
+ * whether we are on a filesystem where it pays to have more threads
+ * waiting for the answers than we have CPUs.
+ */
+static uint64_t sample_lstat_latency(struct index_state *index)
+{
+	static uint64_t latency;
+	uint64_t start;
+	int i, step;
+
+	if (latency)
+		return latency;
+
+	step = index->cache_nr / LSTAT_SAMPLE;
+	if (!step)
+		step = 1;
+	start = getnanotime();
+	for (i = 0; i < LSTAT_SAMPLE && i * step < index->cache_nr; i++) {
+		struct stat st;
+		lstat(index->cache[i * step]->name, &st);
+	}
+	latency = (getnanotime() - start) / (i ? i : 1);
+	if (!latency)
+		latency = 1;
+	return latency;
+}
+
+static int preload_threads(struct index_state *index)
+{
+	int max_threads = online_cpus();
+	int cost = THREAD_COST;
+
+	/* the tests ask for threads whatever lstat() costs */
+	if (!git_env_ulong("GIT_TEST_PRELOAD_THREADS", 0)) {
+		if (index->cache_nr < 2 * SLOW_THREAD_COST)
+			return 0;
+		if (sample_lstat_latency(index) >= SLOW_LSTAT_NS) {
+			max_threads *= SLOW_LSTAT_THREADS_PER_CPU;
+			cost = SLOW_THREAD_COST;
+		}
+	}
+	return thread_count("GIT_TEST_PRELOAD_THREADS", max_threads,
+			    index->cache_nr, cost, MAX_PARALLEL);
+}
+
+void preload_index(struct index_state *index,
+		   const struct pathspec *pathspec)
+{
+	int threads, i;
+	struct thread_data *data;
+	struct preload_queue queue;
+	uint64_t start = getnanotime();
 
 	if (!core_preload_index)
 		return;
 
-	threads = index->cache_nr / THREAD_COST;
+	/* let the filesystem monitor rule out unchanged entries first */
+	refresh_fsmonitor(index);
+
+	threads = preload_threads(index);
 	if (threads < 2)
 		return;
-	if (threads > MAX_PARALLEL)
-		threads = MAX_PARALLEL;
-	offset = 0;
-	work = DIV_ROUND_UP(index->cache_nr, threads);
-	memset(&data, 0, sizeof(data));
+
+	memset(&queue, 0, sizeof(queue));
+	queue.nr_chunks = partition_index(index,
+			DIV_ROUND_UP(index->cache_nr, threads * CHUNKS_PER_THREAD),
+			&queue.chunk);
+	pthread_mutex_init(&queue.mutex, NULL);
+
+	data = xcalloc(threads, sizeof(*data));
 	for (i = 0; i < threads; i++) {
 		struct thread_data *p = data+i;
 		p->index = index;
+		p->queue = &queue;
 		if (pathspec)
 			copy_pathspec(&p->pathspec, pathspec);
-		p->offset = offset;
-		p->nr = work;
-		offset += work;
 		if (pthread_create(&p->pthread, NULL, preload_thread, p))
 			die("unable to create threaded lstat");
 	}
@@ -99,7 +343,18 @@ static void preload_index(struct index_state *index,
 		struct thread_data *p = data+i;
 		if (pthread_join(p->pthread, NULL))
 			die("unable to join threaded lstat");
+		free_pathspec(&p->pathspec);
 	}
+	hash_racy_entries(data, threads);
+	for (i = 0; i < threads; i++)
+		if (data[i].fsmonitor_marked)
+			index->cache_changed |= FSMONITOR_CHANGED;
+
+	pthread_mutex_destroy(&queue.mutex);
+	free(queue.chunk);
+	free(data);
+	trace_performance_since(start, "preload index (%d threads, %d chunks)",
+				threads, queue.nr_chunks);
 }
 #endif
 
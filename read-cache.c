@@ -17,8 +17,13 @@
 #include "strbuf.h"
 #include "varint.h"
 #include "split-index.h"
+#include "sparse-index.h"
 #include "sigchain.h"
 #include "utf8.h"
+#include "fsmonitor.h"
+#include "ewah/ewok.h"
+#include "thread-utils.h"
+#include "mem-pool.h"
 
 static struct cache_entry *refresh_cache_entry(struct cache_entry *ce,
 					       unsigned int options);
@@ -41,11 +46,15 @@ static struct cache_entry *refresh_cache_entry(struct cache_entry *ce,
 #define CACHE_EXT_RESOLVE_UNDO 0x52455543 /* "REUC" */
 #define CACHE_EXT_LINK 0x6c696e6b	  /* "link" */
 #define CACHE_EXT_UNTRACKED 0x554E5452	  /* "UNTR" */
+#define CACHE_EXT_FSMONITOR 0x46534D4E	  /* "FSMN" */
+#define CACHE_EXT_ENDOFINDEXENTRIES 0x454F4945	/* "EOIE" */
+#define CACHE_EXT_INDEXENTRYOFFSETTABLE 0x49454F54 /* "IEOT" */
+#define CACHE_EXT_SPARSE_DIRECTORIES 0x73646972 /* "sdir" */
 
 /* changes that can be kept in $GIT_DIR/index (basically all extensions) */
 #define EXTMASK (RESOLVE_UNDO_CHANGED | CACHE_TREE_CHANGED | \
 		 CE_ENTRY_ADDED | CE_ENTRY_REMOVED | CE_ENTRY_CHANGED | \
-		 SPLIT_INDEX_ORDERED | UNTRACKED_CHANGED)
+		 SPLIT_INDEX_ORDERED | UNTRACKED_CHANGED | FSMONITOR_CHANGED)
 
 struct index_state the_index;
 static const char *alternate_index_output;
@@ -62,7 +71,7 @@ static void replace_index_entry(struct index_state *istate, int nr, struct cache
 
 	replace_index_entry_in_base(istate, old, ce);
 	remove_name_hash(istate, old);
-	free(old);
+	discard_cache_entry(old);
 	set_index_entry(istate, nr, ce);
 	ce->ce_flags |= CE_UPDATE_IN_BASE;
 	istate->cache_changed |= CE_ENTRY_CHANGED;
@@ -73,9 +82,9 @@ void rename_index_entry_at(struct index_state *istate, int nr, const char *new_n
 	struct cache_entry *old = istate->cache[nr], *new;
 	int namelen = strlen(new_name);
 
-	new = xmalloc(cache_entry_size(namelen));
+	new = make_empty_cache_entry(istate, namelen);
 	copy_cache_entry(new, old);
-	new->ce_flags &= ~CE_HASHED;
+	new->ce_flags &= ~(CE_HASHED | CE_FSMONITOR_VALID);
 	new->ce_namelen = namelen;
 	new->index = 0;
 	memcpy(new->name, new_name, namelen + 1);
@@ -288,8 +297,8 @@ static int is_racy_stat(const struct index_state *istate,
 		);
 }
 
-static int is_racy_timestamp(const struct index_state *istate,
-			     const struct cache_entry *ce)
+int is_racy_timestamp(const struct index_state *istate,
+		      const struct cache_entry *ce)
 {
 	return (!S_ISGITLINK(ce->ce_mode) &&
 		is_racy_stat(istate, &ce->ce_stat_data));
@@ -311,6 +320,7 @@ int ie_match_stat(const struct index_state *istate,
 	int ignore_valid = options & CE_MATCH_IGNORE_VALID;
 	int ignore_skip_worktree = options & CE_MATCH_IGNORE_SKIP_WORKTREE;
 	int assume_racy_is_modified = options & CE_MATCH_RACY_IS_DIRTY;
+	int ignore_fsmonitor = options & CE_MATCH_IGNORE_FSMONITOR;
 
 	/*
 	 * If it's marked as always valid in the index, it's
@@ -322,6 +332,8 @@ int ie_match_stat(const struct index_state *istate,
 		return 0;
 	if (!ignore_valid && (ce->ce_flags & CE_VALID))
 		return 0;
+	if (!ignore_fsmonitor && (ce->ce_flags & CE_FSMONITOR_VALID))
+		return 0;
 
 	/*
 	 * Intent-to-add entries have not been added, so the index entry
@@ -499,6 +511,21 @@ static int index_name_stage_pos(const struct index_state *istate, const char *na
 		}
 		first = next+1;
 	}
+
+	/*
+	 * A path inside a directory of a sparse index is only found
+	 * once the directory has been expanded.
+	 */
+	if (istate->sparse_index && first > 0) {
+		struct cache_entry *ce = istate->cache[first - 1];
+
+		if (S_ISSPARSEDIR(ce->ce_mode) &&
+		    ce_namelen(ce) < namelen &&
+		    !memcmp(name, ce->name, ce_namelen(ce))) {
+			ensure_full_index((struct index_state *)istate);
+			return index_name_stage_pos(istate, name, namelen, stage);
+		}
+	}
 	return -first-1;
 }
 
@@ -616,7 +643,7 @@ static struct cache_entry *create_alias_ce(struct index_state *istate,
 
 	/* Ok, create the new entry using the name of the existing alias */
 	len = ce_namelen(alias);
-	new = xcalloc(1, cache_entry_size(len));
+	new = make_empty_cache_entry(istate, len);
 	memcpy(new->name, alias->name, len);
 	copy_cache_entry(new, ce);
 	save_or_free_index_entry(istate, ce);
@@ -633,10 +660,10 @@ void set_object_name_for_intent_to_add_entry(struct cache_entry *ce)
 
 int add_to_index(struct index_state *istate, const char *path, struct stat *st, int flags)
 {
-	int size, namelen, was_same;
+	int namelen, was_same;
 	mode_t st_mode = st->st_mode;
 	struct cache_entry *ce, *alias;
-	unsigned ce_option = CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE|CE_MATCH_RACY_IS_DIRTY;
+	unsigned ce_option = CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE|CE_MATCH_RACY_IS_DIRTY|CE_MATCH_IGNORE_FSMONITOR;
 	int verbose = flags & (ADD_CACHE_VERBOSE | ADD_CACHE_PRETEND);
 	int pretend = flags & ADD_CACHE_PRETEND;
 	int intent_only = flags & ADD_CACHE_INTENT;
@@ -651,8 +678,7 @@ int add_to_index(struct index_state *istate, const char *path, struct stat *st,
 		while (namelen && path[namelen-1] == '/')
 			namelen--;
 	}
-	size = cache_entry_size(namelen);
-	ce = xcalloc(1, size);
+	ce = make_empty_cache_entry(istate, namelen);
 	memcpy(ce->name, path, namelen);
 	ce->ce_namelen = namelen;
 	if (!intent_only)
@@ -703,12 +729,13 @@ int add_to_index(struct index_state *istate, const char *path, struct stat *st,
 			ce_mark_uptodate(alias);
 		alias->ce_flags |= CE_ADDED;
 
-		free(ce);
+		discard_cache_entry(ce);
 		return 0;
 	}
 	if (!intent_only) {
-		if (index_path(ce->sha1, path, st, HASH_WRITE_OBJECT)) {
-			free(ce);
+		if (!find_prehashed_file(path, st, ce->sha1) &&
+		    index_path(ce->sha1, path, st, HASH_WRITE_OBJECT)) {
+			discard_cache_entry(ce);
 			return error("unable to index file %s", path);
 		}
 	} else
@@ -725,9 +752,9 @@ int add_to_index(struct index_state *istate, const char *path, struct stat *st,
 		    ce->ce_mode == alias->ce_mode);
 
 	if (pretend)
-		free(ce);
+		discard_cache_entry(ce);
 	else if (add_index_entry(istate, ce, add_option)) {
-		free(ce);
+		discard_cache_entry(ce);
 		return error("unable to add %s to index", path);
 	}
 	if (verbose && !was_same)
@@ -743,6 +770,33 @@ int add_file_to_index(struct index_state *istate, const char *path, int flags)
 	return add_to_index(istate, path, &st, flags);
 }
 
+struct cache_entry *make_empty_cache_entry(struct index_state *istate, size_t len)
+{
+	struct cache_entry *ce;
+
+	mem_pool_init(&istate->ce_mem_pool, 0);
+	ce = mem_pool_calloc(istate->ce_mem_pool, 1, cache_entry_size(len));
+	ce->mem_pool_allocated = 1;
+	return ce;
+}
+
+struct cache_entry *dup_cache_entry(const struct cache_entry *ce,
+				    struct index_state *istate)
+{
+	struct cache_entry *new = make_empty_cache_entry(istate, ce_namelen(ce));
+
+	memcpy(new, ce, ce_size(ce));
+	new->mem_pool_allocated = 1;
+	return new;
+}
+
+void discard_cache_entry(struct cache_entry *ce)
+{
+	/* pool allocated entries go away with their pool */
+	if (ce && !ce->mem_pool_allocated)
+		free(ce);
+}
+
 struct cache_entry *make_cache_entry(unsigned int mode,
 		const unsigned char *sha1, const char *path, int stage,
 		unsigned int refresh_options)
@@ -1082,10 +1136,22 @@ static struct cache_entry *refresh_cache_ent(struct index_state *istate,
 	int ignore_valid = options & CE_MATCH_IGNORE_VALID;
 	int ignore_skip_worktree = options & CE_MATCH_IGNORE_SKIP_WORKTREE;
 	int ignore_missing = options & CE_MATCH_IGNORE_MISSING;
+	int ignore_fsmonitor = options & CE_MATCH_IGNORE_FSMONITOR;
 
 	if (!refresh || ce_uptodate(ce))
 		return ce;
 
+	if (!ignore_fsmonitor)
+		refresh_fsmonitor(istate);
+	/*
+	 * The filesystem monitor has not seen this path change since we
+	 * last found it to be clean, so there is no need to lstat() it.
+	 */
+	if (!ignore_fsmonitor && (ce->ce_flags & CE_FSMONITOR_VALID)) {
+		ce_mark_uptodate(ce);
+		return ce;
+	}
+
 	/*
 	 * CE_VALID or CE_SKIP_WORKTREE means the user promised us
 	 * that the change to the work tree does not matter and told
@@ -1136,8 +1202,10 @@ static struct cache_entry *refresh_cache_ent(struct index_state *istate,
 			 * because CE_UPTODATE flag is in-core only;
 			 * we are not going to write this change out.
 			 */
-			if (!S_ISGITLINK(ce->ce_mode))
+			if (!S_ISGITLINK(ce->ce_mode)) {
 				ce_mark_uptodate(ce);
+				mark_fsmonitor_valid(istate, ce);
+			}
 			return ce;
 		}
 	}
@@ -1151,6 +1219,7 @@ static struct cache_entry *refresh_cache_ent(struct index_state *istate,
 	size = ce_size(ce);
 	updated = xmalloc(size);
 	memcpy(updated, ce, size);
+	updated->mem_pool_allocated = 0;
 	fill_stat_cache_info(updated, &st);
 	/*
 	 * If ignore_valid is not set, we should leave CE_VALID bit
@@ -1198,6 +1267,15 @@ int refresh_index(struct index_state *istate, unsigned int flags,
 	const char *added_fmt;
 	const char *unmerged_fmt;
 
+	refresh_fsmonitor(istate);
+	/*
+	 * Let the preload threads weed out the entries that are clean
+	 * first; --really-refresh has to look past CE_VALID, which the
+	 * threads would honor.
+	 */
+	if (!really)
+		preload_index(istate, pathspec);
+
 	modified_fmt = (in_porcelain ? "M\t%s\n" : "%s: needs update\n");
 	deleted_fmt = (in_porcelain ? "D\t%s\n" : "%s: needs update\n");
 	typechange_fmt = (in_porcelain ? "T\t%s\n" : "%s needs update\n");
@@ -1371,6 +1449,17 @@ static int verify_hdr(struct cache_header *hdr, unsigned long size)
 	hdr_version = ntohl(hdr->hdr_version);
 	if (hdr_version < INDEX_FORMAT_LB || INDEX_FORMAT_UB < hdr_version)
 		return error("bad index version %d", hdr_version);
+
+	/*
+	 * The index is only ever replaced by renaming a complete lockfile
+	 * over it, so a reader cannot see a half-written one; hashing the
+	 * whole file on every read only guards against corruption at rest.
+	 */
+	if (verify_index_checksum < 0)
+		verify_index_checksum = git_config_get_index_verify_checksum();
+	if (!verify_index_checksum)
+		return 0;
+
 	git_SHA1_Init(&c);
 	git_SHA1_Update(&c, hdr, size - 20);
 	git_SHA1_Final(sha1, &c);
@@ -1396,6 +1485,17 @@ static int read_index_extension(struct index_state *istate,
 	case CACHE_EXT_UNTRACKED:
 		istate->untracked = read_untracked_extension(data, sz);
 		break;
+	case CACHE_EXT_FSMONITOR:
+		read_fsmonitor_extension(istate, data, sz);
+		break;
+	case CACHE_EXT_ENDOFINDEXENTRIES:
+	case CACHE_EXT_INDEXENTRYOFFSETTABLE:
+		/* already handled in do_read_index() */
+		break;
+	case CACHE_EXT_SPARSE_DIRECTORIES:
+		/* no content, only an indication that this is a sparse index */
+		istate->sparse_index = 1;
+		break;
 	default:
 		if (*ext < 'A' || 'Z' < *ext)
 			return error("index uses %.4s extension, which we do not understand",
@@ -1419,13 +1519,15 @@ int read_index(struct index_state *istate)
 	return read_index_from(istate, get_index_file());
 }
 
-static struct cache_entry *cache_entry_from_ondisk(struct ondisk_cache_entry *ondisk,
+static struct cache_entry *cache_entry_from_ondisk(struct mem_pool *mem_pool,
+						   struct ondisk_cache_entry *ondisk,
 						   unsigned int flags,
 						   const char *name,
 						   size_t len)
 {
-	struct cache_entry *ce = xmalloc(cache_entry_size(len));
+	struct cache_entry *ce = mem_pool_alloc(mem_pool, cache_entry_size(len));
 
+	ce->mem_pool_allocated = 1;
 	ce->ce_stat_data.sd_ctime.sec = get_be32(&ondisk->ctime.sec);
 	ce->ce_stat_data.sd_mtime.sec = get_be32(&ondisk->mtime.sec);
 	ce->ce_stat_data.sd_ctime.nsec = get_be32(&ondisk->ctime.nsec);
@@ -1452,11 +1554,18 @@ static struct cache_entry *cache_entry_from_ondisk(struct ondisk_cache_entry *on
  * number of bytes to be stripped from the end of the previous name,
  * and the bytes to append to the result, to come up with its name.
  */
-static unsigned long expand_name_field(struct strbuf *name, const char *cp_)
+static unsigned long expand_name_field(struct strbuf *name, const char *cp_,
+				       int name_unknown)
 {
 	const unsigned char *ep, *cp = (const unsigned char *)cp_;
 	size_t len = decode_varint(&cp);
 
+	/*
+	 * A block of the entry offset table is decoded without the
+	 * name that precedes it; its first entry strips all of it.
+	 */
+	if (name_unknown)
+		len = 0;
 	if (name->len < len)
 		die("malformed name field in the index");
 	strbuf_remove(name, name->len - len, len);
@@ -1466,9 +1575,11 @@ static unsigned long expand_name_field(struct strbuf *name, const char *cp_)
 	return (const char *)ep + 1 - cp_;
 }
 
-static struct cache_entry *create_from_disk(struct ondisk_cache_entry *ondisk,
+static struct cache_entry *create_from_disk(struct mem_pool *mem_pool,
+					    struct ondisk_cache_entry *ondisk,
 					    unsigned long *ent_size,
-					    struct strbuf *previous_name)
+					    struct strbuf *previous_name,
+					    int previous_unknown)
 {
 	struct cache_entry *ce;
 	size_t len;
@@ -1497,13 +1608,14 @@ static struct cache_entry *create_from_disk(struct ondisk_cache_entry *ondisk,
 		/* v3 and earlier */
 		if (len == CE_NAMEMASK)
 			len = strlen(name);
-		ce = cache_entry_from_ondisk(ondisk, flags, name, len);
+		ce = cache_entry_from_ondisk(mem_pool, ondisk, flags, name, len);
 
 		*ent_size = ondisk_ce_size(ce);
 	} else {
 		unsigned long consumed;
-		consumed = expand_name_field(previous_name, name);
-		ce = cache_entry_from_ondisk(ondisk, flags,
+		consumed = expand_name_field(previous_name, name,
+					     previous_unknown);
+		ce = cache_entry_from_ondisk(mem_pool, ondisk, flags,
 					     previous_name->buf,
 					     previous_name->len);
 
@@ -1534,16 +1646,411 @@ static void check_ce_order(struct index_state *istate)
 	}
 }
 
+/*
+ * The "EOIE" (end of index entries) extension is always written last,
+ * right before the trailing checksum.  It records where the entries
+ * end and the extensions start, so the extensions can be loaded
+ * without walking all the (variable length) entries first:
+ *
+ *   - 32-bit offset to the first extension
+ *   - 160-bit SHA-1 over the 8-byte header of each extension that
+ *     follows the entries, to make sure the offset is not stale
+ */
+#define EOIE_SIZE (4 + GIT_SHA1_RAWSZ)
+#define EOIE_SIZE_WITH_HEADER (4 + 4 + EOIE_SIZE)
+
+static void write_eoie_extension(struct strbuf *sb, git_SHA_CTX *eoie_context,
+				 size_t offset)
+{
+	uint32_t buffer;
+	unsigned char sha1[GIT_SHA1_RAWSZ];
+
+	put_be32(&buffer, offset);
+	strbuf_add(sb, &buffer, sizeof(uint32_t));
+
+	git_SHA1_Final(sha1, eoie_context);
+	strbuf_add(sb, sha1, GIT_SHA1_RAWSZ);
+}
+
+/*
+ * The "IEOT" (index entry offset table) extension splits the entries
+ * into blocks that can be decoded independently: for version 4 the
+ * prefix compression starts afresh at the beginning of each block.
+ *
+ *   - 32-bit version (currently 1)
+ *   - for each block: 32-bit offset of its first entry, followed by
+ *     the 32-bit number of entries in it
+ */
+#define IEOT_VERSION (1)
+
+struct index_entry_offset {
+	uint32_t offset;
+	uint32_t nr;
+};
+
+struct index_entry_offset_table {
+	int nr;
+	struct index_entry_offset entries[FLEX_ARRAY];
+};
+
+static void write_ieot_extension(struct strbuf *sb, struct index_entry_offset_table *ieot)
+{
+	uint32_t buffer;
+	int i;
+
+	put_be32(&buffer, IEOT_VERSION);
+	strbuf_add(sb, &buffer, sizeof(uint32_t));
+
+	for (i = 0; i < ieot->nr; i++) {
+		put_be32(&buffer, ieot->entries[i].offset);
+		strbuf_add(sb, &buffer, sizeof(uint32_t));
+		put_be32(&buffer, ieot->entries[i].nr);
+		strbuf_add(sb, &buffer, sizeof(uint32_t));
+	}
+}
+
+/*
+ * A thread needs at least this many cache entries to decode before
+ * it is worth starting.
+ */
+#define THREAD_COST		(10000)
+
+static int index_read_threads(struct index_state *istate)
+{
+	int nr_threads = git_config_get_index_threads();
+
+	if (!nr_threads) {
+		nr_threads = istate->cache_nr / THREAD_COST;
+		if (nr_threads > online_cpus())
+			nr_threads = online_cpus();
+	}
+#ifdef NO_PTHREADS
+	nr_threads = 1;
+#endif
+	return nr_threads > 1 ? nr_threads : 1;
+}
+
+struct load_index_extensions {
+#ifndef NO_PTHREADS
+	pthread_t pthread;
+#endif
+	struct index_state *istate;
+	const char *mmap;
+	size_t mmap_size;
+	unsigned long src_offset;
+};
+
+static void *load_index_extensions(void *_data)
+{
+	struct load_index_extensions *p = _data;
+	unsigned long src_offset = p->src_offset;
+
+	while (src_offset <= p->mmap_size - 20 - 8) {
+		/* After an array of active_nr index entries,
+		 * there can be arbitrary number of extended
+		 * sections, each of which is prefixed with
+		 * extension name (4-byte) and section length
+		 * in 4-byte network byte order.
+		 */
+		uint32_t extsize;
+		memcpy(&extsize, p->mmap + src_offset + 4, 4);
+		extsize = ntohl(extsize);
+		if (read_index_extension(p->istate,
+					 p->mmap + src_offset,
+					 (char *)p->mmap + src_offset + 8,
+					 extsize) < 0) {
+			munmap((void *)p->mmap, p->mmap_size);
+			die("index file corrupt");
+		}
+		src_offset += 8;
+		src_offset += extsize;
+	}
+
+	return NULL;
+}
+
+/*
+ * Estimate how much memory the in-memory cache entries decoded from
+ * "nr" of the "entries" entries of an index of "ondisk_size" bytes
+ * need, to size the memory pool in one go.
+ */
+static size_t estimate_cache_size(size_t ondisk_size, unsigned int entries,
+				  unsigned int nr)
+{
+	size_t per_entry = sizeof(struct cache_entry) -
+			   offsetof(struct ondisk_cache_entry, name) +
+			   sizeof(uintmax_t); /* alignment */
+
+	if (!entries)
+		return 0;
+	return ondisk_size / entries * nr + nr * per_entry;
+}
+
+/*
+ * Names are prefix compressed in a v4 index, so the on-disk size does
+ * not tell much; assume an average path length instead.
+ */
+#define CACHE_ENTRY_PATH_LENGTH 80
+
+static size_t estimate_cache_size_from_compressed(unsigned int entries)
+{
+	return entries * (sizeof(struct cache_entry) + CACHE_ENTRY_PATH_LENGTH);
+}
+
+/*
+ * Decode "nr" entries starting at "start_offset" into the cache
+ * slots starting at "offset"; returns the number of bytes consumed.
+ */
+static unsigned long load_cache_entry_block(struct index_state *istate,
+					    struct mem_pool *ce_mem_pool,
+					    const char *mmap, int nr,
+					    unsigned long start_offset,
+					    int offset)
+{
+	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
+	unsigned long src_offset = start_offset;
+	int i;
+
+	previous_name = (istate->version == 4) ? &previous_name_buf : NULL;
+	for (i = offset; i < offset + nr; i++) {
+		struct ondisk_cache_entry *disk_ce;
+		struct cache_entry *ce;
+		unsigned long consumed;
+
+		disk_ce = (struct ondisk_cache_entry *)(mmap + src_offset);
+		/* blocks after the first follow a name we have not read */
+		ce = create_from_disk(ce_mem_pool, disk_ce, &consumed,
+				      previous_name, i == offset && offset);
+		set_index_entry(istate, i, ce);
+
+		src_offset += consumed;
+	}
+	strbuf_release(&previous_name_buf);
+	return src_offset - start_offset;
+}
+
+#ifndef NO_PTHREADS
+static size_t read_eoie_extension(const char *mmap, size_t mmap_size)
+{
+	const char *index, *eoie;
+	uint32_t extsize;
+	size_t offset, src_offset;
+	unsigned char sha1[GIT_SHA1_RAWSZ];
+	git_SHA_CTX c;
+
+	/* ensure we have an index big enough to contain an EOIE extension */
+	if (mmap_size < sizeof(struct cache_header) + EOIE_SIZE_WITH_HEADER + GIT_SHA1_RAWSZ)
+		return 0;
+
+	index = eoie = mmap + mmap_size - EOIE_SIZE_WITH_HEADER - GIT_SHA1_RAWSZ;
+	if (CACHE_EXT(index) != CACHE_EXT_ENDOFINDEXENTRIES)
+		return 0;
+	index += sizeof(uint32_t);
+
+	extsize = get_be32(index);
+	if (extsize != EOIE_SIZE)
+		return 0;
+	index += sizeof(uint32_t);
+
+	offset = get_be32(index);
+	if (offset < sizeof(struct cache_header) || offset > eoie - mmap)
+		return 0;
+	index += sizeof(uint32_t);
+
+	/* the hash must match the headers of the extensions in between */
+	git_SHA1_Init(&c);
+	src_offset = offset;
+	while (src_offset < eoie - mmap) {
+		memcpy(&extsize, mmap + src_offset + 4, 4);
+		extsize = ntohl(extsize);
+
+		/* verify the extension size isn't so large it will wrap around */
+		if (src_offset + 8 + extsize < src_offset)
+			return 0;
+
+		git_SHA1_Update(&c, mmap + src_offset, 8);
+
+		src_offset += 8;
+		src_offset += extsize;
+	}
+	git_SHA1_Final(sha1, &c);
+	if (hashcmp(sha1, (const unsigned char *)index))
+		return 0;
+
+	/* validate that the extensions end where the EOIE starts */
+	if (src_offset != eoie - mmap)
+		return 0;
+
+	return offset;
+}
+
+static struct index_entry_offset_table *read_ieot_extension(const char *mmap,
+							    size_t mmap_size,
+							    size_t offset)
+{
+	const char *index = NULL;
+	uint32_t extsize, ext_version;
+	struct index_entry_offset_table *ieot;
+	int i, nr;
+
+	/* find the IEOT extension */
+	if (!offset)
+		return NULL;
+	while (offset <= mmap_size - GIT_SHA1_RAWSZ - 8) {
+		extsize = get_be32(mmap + offset + 4);
+		if (offset + 8 + extsize > mmap_size - GIT_SHA1_RAWSZ)
+			return NULL;
+		if (CACHE_EXT((mmap + offset)) == CACHE_EXT_INDEXENTRYOFFSETTABLE) {
+			index = mmap + offset + 4 + 4;
+			break;
+		}
+		offset += 8;
+		offset += extsize;
+	}
+	if (!index)
+		return NULL;
+
+	/* validate the version is IEOT_VERSION */
+	if (extsize < sizeof(uint32_t))
+		return NULL;
+	ext_version = get_be32(index);
+	if (ext_version != IEOT_VERSION) {
+		error("invalid IEOT version %d", ext_version);
+		return NULL;
+	}
+	index += sizeof(uint32_t);
+
+	/* extension size - version bytes / bytes per entry */
+	nr = (extsize - sizeof(uint32_t)) / (sizeof(uint32_t) + sizeof(uint32_t));
+	if (!nr) {
+		error("invalid number of IEOT entries %d", nr);
+		return NULL;
+	}
+	ieot = xmalloc(sizeof(struct index_entry_offset_table)
+		       + (nr * sizeof(struct index_entry_offset)));
+	ieot->nr = nr;
+	for (i = 0; i < nr; i++) {
+		ieot->entries[i].offset = get_be32(index);
+		index += sizeof(uint32_t);
+		ieot->entries[i].nr = get_be32(index);
+		index += sizeof(uint32_t);
+	}
+
+	return ieot;
+}
+
+/*
+ * The offset table is only usable when its blocks account for every
+ * entry and each one starts within the entries.
+ */
+static int ieot_is_valid(struct index_state *istate,
+			 struct index_entry_offset_table *ieot,
+			 size_t extension_offset)
+{
+	unsigned int nr = 0;
+	int i;
+
+	for (i = 0; i < ieot->nr; i++) {
+		if (ieot->entries[i].offset < sizeof(struct cache_header) ||
+		    (ieot->entries[i].nr && ieot->entries[i].offset >= extension_offset))
+			return 0;
+		nr += ieot->entries[i].nr;
+	}
+	return nr == istate->cache_nr;
+}
+
+struct load_cache_entries_thread_data {
+	pthread_t pthread;
+	struct index_state *istate;
+	struct mem_pool *ce_mem_pool;
+	const char *mmap;
+	struct index_entry_offset_table *ieot;
+	int ieot_start;		/* starting index into the ieot array */
+	int ieot_blocks;	/* count of ieot entries to process */
+	int offset;		/* first cache slot of the first block */
+};
+
+static void *load_cache_entries_thread(void *_data)
+{
+	struct load_cache_entries_thread_data *p = _data;
+	int i, offset = p->offset;
+
+	for (i = p->ieot_start; i < p->ieot_start + p->ieot_blocks; i++) {
+		load_cache_entry_block(p->istate, p->ce_mem_pool, p->mmap,
+				       p->ieot->entries[i].nr,
+				       p->ieot->entries[i].offset, offset);
+		offset += p->ieot->entries[i].nr;
+	}
+	return NULL;
+}
+
+static void load_cache_entries_threaded(struct index_state *istate,
+					const char *mmap, size_t mmap_size,
+					int nr_threads,
+					struct index_entry_offset_table *ieot)
+{
+	struct load_cache_entries_thread_data *data;
+	int i, ieot_blocks, ieot_start = 0, offset = 0, nr;
+
+	/* ensure we have no more threads than we have blocks to process */
+	if (nr_threads > ieot->nr)
+		nr_threads = ieot->nr;
+	data = xcalloc(nr_threads, sizeof(*data));
+
+	ieot_blocks = DIV_ROUND_UP(ieot->nr, nr_threads);
+	for (i = 0; i < nr_threads; i++) {
+		struct load_cache_entries_thread_data *p = &data[i];
+		int j;
+
+		if (ieot_start + ieot_blocks > ieot->nr)
+			ieot_blocks = ieot->nr - ieot_start;
+
+		p->istate = istate;
+		p->mmap = mmap;
+		p->ieot = ieot;
+		p->ieot_start = ieot_start;
+		p->ieot_blocks = ieot_blocks;
+		p->offset = offset;
+
+		nr = 0;
+		for (j = ieot_start; j < ieot_start + ieot_blocks; j++)
+			nr += ieot->entries[j].nr;
+		offset += nr;
+		ieot_start += ieot_blocks;
+
+		/* the pool is not thread-safe, so each thread gets its own */
+		mem_pool_init(&p->ce_mem_pool, istate->version == 4 ?
+			      estimate_cache_size_from_compressed(nr) :
+			      estimate_cache_size(mmap_size, istate->cache_nr, nr));
+
+		if (pthread_create(&p->pthread, NULL, load_cache_entries_thread, p))
+			die("unable to create load_cache_entries thread");
+	}
+
+	mem_pool_init(&istate->ce_mem_pool, 0);
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_join(data[i].pthread, NULL))
+			die("unable to join load_cache_entries thread");
+		mem_pool_combine(istate->ce_mem_pool, data[i].ce_mem_pool);
+		mem_pool_discard(data[i].ce_mem_pool);
+	}
+	free(data);
+}
+#endif
+
 /* remember to discard_cache() before reading a different cache! */
 int do_read_index(struct index_state *istate, const char *path, int must_exist)
 {
-	int fd, i;
+	int fd;
 	struct stat st;
 	unsigned long src_offset;
 	struct cache_header *hdr;
 	void *mmap;
 	size_t mmap_size;
-	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
+	struct load_index_extensions p;
+	size_t extension_offset = 0;
+	int nr_threads;
+	struct index_entry_offset_table *ieot = NULL;
 
 	if (istate->initialized)
 		return istate->cache_nr;
@@ -1580,44 +2087,65 @@ int do_read_index(struct index_state *istate, const char *path, int must_exist)
 	istate->cache = xcalloc(istate->cache_alloc, sizeof(*istate->cache));
 	istate->initialized = 1;
 
-	if (istate->version == 4)
-		previous_name = &previous_name_buf;
-	else
-		previous_name = NULL;
+	p.istate = istate;
+	p.mmap = mmap;
+	p.mmap_size = mmap_size;
 
 	src_offset = sizeof(*hdr);
-	for (i = 0; i < istate->cache_nr; i++) {
-		struct ondisk_cache_entry *disk_ce;
-		struct cache_entry *ce;
-		unsigned long consumed;
+	nr_threads = index_read_threads(istate);
 
-		disk_ce = (struct ondisk_cache_entry *)((char *)mmap + src_offset);
-		ce = create_from_disk(disk_ce, &consumed, previous_name);
-		set_index_entry(istate, i, ce);
+#ifndef NO_PTHREADS
+	/*
+	 * With an EOIE extension we know where the extensions start, so
+	 * one thread loads them while the others decode the entries.
+	 */
+	if (nr_threads > 1) {
+		extension_offset = read_eoie_extension(mmap, mmap_size);
+		if (extension_offset) {
+			p.src_offset = extension_offset;
+			if (pthread_create(&p.pthread, NULL, load_index_extensions, &p))
+				die("unable to create load_index_extensions thread");
+			nr_threads--;
+		}
+	}
 
-		src_offset += consumed;
+	if (extension_offset && nr_threads > 1) {
+		ieot = read_ieot_extension(mmap, mmap_size, extension_offset);
+		if (ieot && !ieot_is_valid(istate, ieot, extension_offset)) {
+			free(ieot);
+			ieot = NULL;
+		}
 	}
-	strbuf_release(&previous_name_buf);
+
+	if (ieot) {
+		load_cache_entries_threaded(istate, mmap, mmap_size, nr_threads, ieot);
+		src_offset = extension_offset;
+		free(ieot);
+	} else
+#endif
+	{
+		mem_pool_init(&istate->ce_mem_pool, istate->version == 4 ?
+			      estimate_cache_size_from_compressed(istate->cache_nr) :
+			      estimate_cache_size(mmap_size, istate->cache_nr,
+						  istate->cache_nr));
+		src_offset += load_cache_entry_block(istate, istate->ce_mem_pool,
+						     mmap, istate->cache_nr,
+						     src_offset, 0);
+	}
+
 	istate->timestamp.sec = st.st_mtime;
 	istate->timestamp.nsec = ST_MTIME_NSEC(st);
 
-	while (src_offset <= mmap_size - 20 - 8) {
-		/* After an array of active_nr index entries,
-		 * there can be arbitrary number of extended
-		 * sections, each of which is prefixed with
-		 * extension name (4-byte) and section length
-		 * in 4-byte network byte order.
-		 */
-		uint32_t extsize;
-		memcpy(&extsize, (char *)mmap + src_offset + 4, 4);
-		extsize = ntohl(extsize);
-		if (read_index_extension(istate,
-					 (const char *) mmap + src_offset,
-					 (char *) mmap + src_offset + 8,
-					 extsize) < 0)
-			goto unmap;
-		src_offset += 8;
-		src_offset += extsize;
+	/* if we created a thread, join it otherwise load the extensions on the primary thread */
+#ifndef NO_PTHREADS
+	if (extension_offset) {
+		if (pthread_join(p.pthread, NULL))
+			die("unable to join load_index_extensions thread");
+	}
+#endif
+	if (!extension_offset) {
+		p.src_offset = src_offset;
+		load_index_extensions(&p);
 	}
 	munmap(mmap, mmap_size);
 	return istate->cache_nr;
@@ -1627,6 +2155,233 @@ unmap:
 	die("index file corrupt");
 }
 
+static void tweak_untracked_cache(struct index_state *istate)
+{
+	/* the cache records the location of the work tree it describes */
+	if (!get_git_work_tree())
+		return;
+
+	switch (git_config_get_untracked_cache()) {
+	case -1: /* keep: do nothing */
+		break;
+	case 0: /* false */
+		remove_untracked_cache(istate);
+		break;
+	case 1: /* true */
+		add_untracked_cache(istate);
+		break;
+	}
+}
+
+static void tweak_split_index(struct index_state *istate)
+{
+	int min_entries;
+
+	switch (git_config_get_split_index()) {
+	case -1: /* unset: split large indexes, if asked to */
+		if (!istate->split_index &&
+		    !git_config_get_int("splitindex.minentries", &min_entries) &&
+		    min_entries > 0 && istate->cache_nr >= min_entries)
+			add_split_index(istate);
+		break;
+	case 0: /* false */
+		remove_split_index(istate);
+		break;
+	case 1: /* true */
+		add_split_index(istate);
+		break;
+	}
+}
+
+/*
+ * An index journal ("<index>.journal") lets small updates to a large
+ * index be appended as change records instead of rewriting (and
+ * re-hashing) the whole file.  It starts with a header naming the
+ * index file it applies to by its checksum and stat data, followed
+ * by records of the form
+ *
+ *   32-bit payload size
+ *   32-bit number of entries, 32-bit number of removals
+ *   the added or replaced entries, in the v2/v3 on-disk format
+ *   the removals, each a stage byte followed by a NUL-terminated path
+ *   SHA-1 over all of the above
+ *
+ * Readers replay the records in order and stop at the first one that
+ * is incomplete or fails its checksum.  A journal whose header does
+ * not match the index is stale and ignored.
+ */
+#define INDEX_JOURNAL_SIGNATURE 0x494A4E4C /* "IJNL" */
+#define INDEX_JOURNAL_VERSION 1
+#define INDEX_JOURNAL_HEADER_SIZE (4 + 4 + 20 + 4 * 4)
+
+/*
+ * Once the journal would grow beyond this fraction of the index, the
+ * index is written out in full instead, which leaves the journal
+ * stale until the next record starts it over.
+ */
+#define INDEX_JOURNAL_MAX_RATIO 4
+
+struct index_journal {
+	char *path;
+	unsigned char header[INDEX_JOURNAL_HEADER_SIZE];
+	size_t size;		/* of the replayed part, header included */
+	size_t file_size;	/* of the file as it was read */
+	size_t index_size;
+
+	/* istate->cache[] as read, to find what changed when writing */
+	struct cache_entry **base;
+	unsigned int base_nr;
+};
+
+static void free_index_journal(struct index_journal *j)
+{
+	if (!j)
+		return;
+	free(j->path);
+	free(j->base);
+	free(j);
+}
+
+size_t index_journal_size(const struct index_state *istate)
+{
+	return istate->journal ? istate->journal->size : 0;
+}
+
+static void prepare_journal_header(unsigned char *hdr,
+				   const unsigned char *sha1, struct stat *st)
+{
+	put_be32(hdr, INDEX_JOURNAL_SIGNATURE);
+	put_be32(hdr + 4, INDEX_JOURNAL_VERSION);
+	hashcpy(hdr + 8, sha1);
+	put_be32(hdr + 28, (uint32_t)st->st_size);
+	put_be32(hdr + 32, (uint32_t)st->st_mtime);
+	put_be32(hdr + 36, (uint32_t)ST_MTIME_NSEC(*st));
+	put_be32(hdr + 40, (uint32_t)st->st_ino);
+}
+
+/* Returns the size of the record at "buf", or 0 if it is not usable */
+static size_t replay_journal_record(struct index_state *istate,
+				    const char *buf, size_t len)
+{
+	git_SHA_CTX c;
+	unsigned char sha1[20];
+	const char *p, *end;
+	uint32_t size, nr_entries, nr_removals, i;
+
+	if (len < 4 + 8 + 20)
+		return 0;
+	size = get_be32(buf);
+	if (size < 8 || len - 4 - 20 < size)
+		return 0;
+	git_SHA1_Init(&c);
+	git_SHA1_Update(&c, buf, 4 + size);
+	git_SHA1_Final(sha1, &c);
+	if (hashcmp(sha1, (const unsigned char *)buf + 4 + size))
+		return 0;
+
+	nr_entries = get_be32(buf + 4);
+	nr_removals = get_be32(buf + 8);
+	p = buf + 12;
+	end = buf + 4 + size;
+	mem_pool_init(&istate->ce_mem_pool, 0);
+	for (i = 0; i < nr_entries; i++) {
+		struct cache_entry *ce;
+		unsigned long consumed;
+
+		if (end - p < offsetof(struct ondisk_cache_entry, name))
+			die("corrupt index journal");
+		ce = create_from_disk(istate->ce_mem_pool,
+				      (struct ondisk_cache_entry *)p,
+				      &consumed, NULL, 0);
+		if (end - p < consumed)
+			die("corrupt index journal");
+		p += consumed;
+		if (add_index_entry(istate, ce, ADD_CACHE_OK_TO_ADD |
+				    ADD_CACHE_OK_TO_REPLACE |
+				    ADD_CACHE_SKIP_DFCHECK))
+			die("unable to replay index journal entry '%s'", ce->name);
+	}
+	for (i = 0; i < nr_removals; i++) {
+		const char *name = p + 1;
+		size_t namelen;
+		int pos;
+
+		if (p >= end || !memchr(name, '\0', end - name))
+			die("corrupt index journal");
+		namelen = strlen(name);
+		pos = index_name_stage_pos(istate, name, namelen,
+					   (unsigned char)*p);
+		if (pos >= 0)
+			istate->cache[pos]->ce_flags |= CE_REMOVE;
+		cache_tree_invalidate_path(istate, name);
+		untracked_cache_remove_from_index(istate, name);
+		p = name + namelen + 1;
+	}
+	if (nr_removals)
+		remove_marked_cache_entries(istate);
+	return 4 + size + 20;
+}
+
+static void read_index_journal(struct index_state *istate, const char *path)
+{
+	struct index_journal *j;
+	struct strbuf sb = STRBUF_INIT;
+	struct stat st;
+	int fd, enabled = git_config_get_index_journal();
+
+	if (stat(path, &st))
+		return;
+	j = xcalloc(1, sizeof(*j));
+	/* absolute, to compare with the path of the lock when writing */
+	j->path = xstrfmt("%s.journal", absolute_path(path));
+	j->index_size = xsize_t(st.st_size);
+	prepare_journal_header(j->header, istate->sha1, &st);
+
+	fd = open(j->path, O_RDONLY);
+	if (fd >= 0 && !fstat(fd, &st)) {
+		unsigned char hdr[INDEX_JOURNAL_HEADER_SIZE];
+
+		j->file_size = xsize_t(st.st_size);
+		/* a stale journal is only looked at up to its header */
+		if (read_in_full(fd, hdr, sizeof(hdr)) == sizeof(hdr) &&
+		    !memcmp(hdr, j->header, sizeof(hdr)) &&
+		    strbuf_read(&sb, fd, j->file_size - sizeof(hdr)) < 0)
+			strbuf_reset(&sb);
+	}
+	if (fd >= 0)
+		close(fd);
+	if (sb.len) {
+		size_t len, pos = 0;
+
+		while ((len = replay_journal_record(istate, sb.buf + pos,
+						    sb.len - pos)))
+			pos += len;
+		j->size = INDEX_JOURNAL_HEADER_SIZE + pos;
+		/*
+		 * The writer of the last record smudged the racily clean
+		 * entries, so the journal is as new as its last record;
+		 * after a torn record we cannot tell how new that is.
+		 */
+		if (pos == sb.len) {
+			istate->timestamp.sec = st.st_mtime;
+			istate->timestamp.nsec = ST_MTIME_NSEC(st);
+		}
+		istate->cache_changed = 0;
+	}
+	strbuf_release(&sb);
+
+	/* what we would record is against the expanded index */
+	if (enabled && !istate->sparse_index) {
+		j->base_nr = istate->cache_nr;
+		j->base = xmalloc(sizeof(*j->base) * j->base_nr);
+		memcpy(j->base, istate->cache, sizeof(*j->base) * j->base_nr);
+	} else if (!j->file_size) {
+		free_index_journal(j);
+		return;
+	}
+	istate->journal = j;
+}
+
 int read_index_from(struct index_state *istate, const char *path)
 {
 	struct split_index *split_index;
@@ -1639,8 +2394,16 @@ int read_index_from(struct index_state *istate, const char *path)
 	ret = do_read_index(istate, path, 0);
 	split_index = istate->split_index;
 	if (!split_index || is_null_sha1(split_index->base_sha1)) {
+		if (istate->initialized)
+			read_index_journal(istate, path);
 		check_ce_order(istate);
-		return ret;
+		tweak_untracked_cache(istate);
+		tweak_split_index(istate);
+		tweak_fsmonitor(istate);
+		if (command_requires_full_index ||
+		    !is_sparse_index_enabled(istate))
+			ensure_full_index(istate);
+		return istate->cache_nr;
 	}
 
 	if (split_index->base)
@@ -1658,6 +2421,12 @@ int read_index_from(struct index_state *istate, const char *path)
 		    sha1_to_hex(split_index->base->sha1));
 	merge_base_index(istate);
 	check_ce_order(istate);
+	tweak_untracked_cache(istate);
+	tweak_split_index(istate);
+	tweak_fsmonitor(istate);
+	if (command_requires_full_index ||
+	    !is_sparse_index_enabled(istate))
+		ensure_full_index(istate);
 	return ret;
 }
 
@@ -1666,6 +2435,12 @@ int is_index_unborn(struct index_state *istate)
 	return (!istate->cache_nr && !istate->timestamp.sec);
 }
 
+int discard_index_to_reread(struct index_state *istate)
+{
+	stash_name_hash(istate);
+	return discard_index(istate);
+}
+
 int discard_index(struct index_state *istate)
 {
 	int i;
@@ -1677,7 +2452,7 @@ int discard_index(struct index_state *istate)
 		    istate->cache[i]->index <= istate->split_index->base->cache_nr &&
 		    istate->cache[i] == istate->split_index->base->cache[istate->cache[i]->index - 1])
 			continue;
-		free(istate->cache[i]);
+		discard_cache_entry(istate->cache[i]);
 	}
 	resolve_undo_clear_index(istate);
 	istate->cache_nr = 0;
@@ -1690,9 +2465,33 @@ int discard_index(struct index_state *istate)
 	free(istate->cache);
 	istate->cache = NULL;
 	istate->cache_alloc = 0;
+	istate->sparse_index = 0;
+	if (istate->ce_mem_pool && istate->split_index &&
+	    istate->split_index->base) {
+		/*
+		 * Replaced entries of the base index may live in our
+		 * pool, and the base may be shared with another index
+		 * (see unpack_trees()); the memory goes with the base.
+		 */
+		struct index_state *base = istate->split_index->base;
+		mem_pool_init(&base->ce_mem_pool, 0);
+		mem_pool_combine(base->ce_mem_pool, istate->ce_mem_pool);
+	}
 	discard_split_index(istate);
+	free_index_journal(istate->journal);
+	istate->journal = NULL;
 	free_untracked_cache(istate->untracked);
 	istate->untracked = NULL;
+	free(istate->fsmonitor_last_update);
+	istate->fsmonitor_last_update = NULL;
+	if (istate->fsmonitor_dirty)
+		ewah_free(istate->fsmonitor_dirty);
+	istate->fsmonitor_dirty = NULL;
+	istate->fsmonitor_has_run_once = 0;
+	if (istate->ce_mem_pool) {
+		mem_pool_discard(istate->ce_mem_pool);
+		istate->ce_mem_pool = NULL;
+	}
 	return 0;
 }
 
@@ -1744,11 +2543,15 @@ static int ce_write(git_SHA_CTX *context, int fd, void *data, unsigned int len)
 	return 0;
 }
 
-static int write_index_ext_header(git_SHA_CTX *context, int fd,
-				  unsigned int ext, unsigned int sz)
+static int write_index_ext_header(git_SHA_CTX *context, git_SHA_CTX *eoie_context,
+				  int fd, unsigned int ext, unsigned int sz)
 {
 	ext = htonl(ext);
 	sz = htonl(sz);
+	if (eoie_context) {
+		git_SHA1_Update(eoie_context, &ext, 4);
+		git_SHA1_Update(eoie_context, &sz, 4);
+	}
 	return ((ce_write(context, fd, &ext, 4) < 0) ||
 		(ce_write(context, fd, &sz, 4) < 0)) ? -1 : 0;
 }
@@ -1951,9 +2754,29 @@ out:
 	return 0;
 }
 
+/*
+ * Nobody may have appended to the journal of the index either, as
+ * our own records would then be replayed over theirs.
+ */
+static int verify_index_journal(const struct index_state *istate,
+				const char *path)
+{
+	const struct index_journal *j = istate->journal;
+	struct strbuf journal = STRBUF_INIT;
+	struct stat st;
+	size_t size = 0;
+
+	strbuf_addf(&journal, "%s.journal", path);
+	if (!stat(journal.buf, &st))
+		size = xsize_t(st.st_size);
+	strbuf_release(&journal);
+	return size == (j ? j->file_size : 0);
+}
+
 static int verify_index(const struct index_state *istate)
 {
-	return verify_index_from(istate, get_index_file());
+	return verify_index_from(istate, get_index_file()) &&
+		verify_index_journal(istate, get_index_file());
 }
 
 static int has_racy_timestamp(struct index_state *istate)
@@ -1990,6 +2813,10 @@ static int do_write_index(struct index_state *istate, int newfd,
 	int entries = istate->cache_nr;
 	struct stat st;
 	struct strbuf previous_name_buf = STRBUF_INIT, *previous_name;
+	git_SHA_CTX eoie_context, *eoie_c = NULL;
+	struct index_entry_offset_table *ieot = NULL;
+	int nr, ieot_entries = 1;
+	size_t offset;
 
 	for (i = removed = extended = 0; i < entries; i++) {
 		if (cache[i]->ce_flags & CE_REMOVE)
@@ -2023,11 +2850,50 @@ static int do_write_index(struct index_state *istate, int newfd,
 	if (ce_write(&c, newfd, &hdr, sizeof(hdr)) < 0)
 		return -1;
 
+	/*
+	 * Cut the entries into blocks that readers can decode in
+	 * parallel if they are going to use threads.
+	 */
+	if (!strip_extensions) {
+		int ieot_blocks = git_config_get_index_threads();
+#ifdef NO_PTHREADS
+		ieot_blocks = 1;
+#endif
+		if (!ieot_blocks) {
+			/* one of the reader's threads loads the extensions */
+			ieot_blocks = istate->cache_nr / THREAD_COST;
+			if (ieot_blocks > online_cpus() - 1)
+				ieot_blocks = online_cpus() - 1;
+		} else if (ieot_blocks > istate->cache_nr)
+			ieot_blocks = istate->cache_nr;
+		if (ieot_blocks > 1) {
+			ieot = xcalloc(1, sizeof(struct index_entry_offset_table)
+				       + (ieot_blocks * sizeof(struct index_entry_offset)));
+			ieot_entries = DIV_ROUND_UP(entries, ieot_blocks);
+		}
+	}
+
+	offset = lseek(newfd, 0, SEEK_CUR) + write_buffer_len;
+	nr = 0;
 	previous_name = (hdr_version == 4) ? &previous_name_buf : NULL;
 	for (i = 0; i < entries; i++) {
 		struct cache_entry *ce = cache[i];
 		if (ce->ce_flags & CE_REMOVE)
 			continue;
+		if (ieot && i && (i % ieot_entries == 0)) {
+			ieot->entries[ieot->nr].nr = nr;
+			ieot->entries[ieot->nr].offset = offset;
+			ieot->nr++;
+			/*
+			 * Make sure the first entry of a block of a v4 index
+			 * has nothing in common with the previous one, so it
+			 * can be decoded on its own.
+			 */
+			if (previous_name && previous_name->len)
+				previous_name->buf[0] = '\0';
+			nr = 0;
+			offset = lseek(newfd, 0, SEEK_CUR) + write_buffer_len;
+		}
 		if (!ce_uptodate(ce) && is_racy_timestamp(istate, ce))
 			ce_smudge_racily_clean_entry(ce);
 		if (is_null_sha1(ce->sha1)) {
@@ -2038,31 +2904,63 @@ static int do_write_index(struct index_state *istate, int newfd,
 				allow = git_env_bool("GIT_ALLOW_NULL_SHA1", 0);
 			if (allow)
 				warning(msg, ce->name);
-			else
+			else {
+				free(ieot);
 				return error(msg, ce->name);
+			}
 		}
-		if (ce_write_entry(&c, newfd, ce, previous_name) < 0)
+		if (ce_write_entry(&c, newfd, ce, previous_name) < 0) {
+			free(ieot);
 			return -1;
+		}
+		nr++;
+	}
+	if (ieot) {
+		ieot->entries[ieot->nr].nr = nr;
+		ieot->entries[ieot->nr].offset = offset;
+		ieot->nr++;
 	}
 	strbuf_release(&previous_name_buf);
 
+	offset = lseek(newfd, 0, SEEK_CUR) + write_buffer_len;
+	if (ieot) {
+		struct strbuf sb = STRBUF_INIT;
+
+		eoie_c = &eoie_context;
+		git_SHA1_Init(eoie_c);
+
+		write_ieot_extension(&sb, ieot);
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_INDEXENTRYOFFSETTABLE, sb.len) < 0
+			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		free(ieot);
+		if (err)
+			return -1;
+	}
+
 	/* Write extension data here */
 	if (!strip_extensions && istate->split_index) {
 		struct strbuf sb = STRBUF_INIT;
 
 		err = write_link_extension(&sb, istate) < 0 ||
-			write_index_ext_header(&c, newfd, CACHE_EXT_LINK,
+			write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_LINK,
 					       sb.len) < 0 ||
 			ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
 		if (err)
 			return -1;
 	}
+	if (!strip_extensions && istate->sparse_index) {
+		err = write_index_ext_header(&c, eoie_c, newfd,
+					     CACHE_EXT_SPARSE_DIRECTORIES, 0) < 0;
+		if (err)
+			return -1;
+	}
 	if (!strip_extensions && istate->cache_tree) {
 		struct strbuf sb = STRBUF_INIT;
 
 		cache_tree_write(&sb, istate->cache_tree);
-		err = write_index_ext_header(&c, newfd, CACHE_EXT_TREE, sb.len) < 0
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_TREE, sb.len) < 0
 			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
 		if (err)
@@ -2072,7 +2970,7 @@ static int do_write_index(struct index_state *istate, int newfd,
 		struct strbuf sb = STRBUF_INIT;
 
 		resolve_undo_write(&sb, istate->resolve_undo);
-		err = write_index_ext_header(&c, newfd, CACHE_EXT_RESOLVE_UNDO,
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_RESOLVE_UNDO,
 					     sb.len) < 0
 			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
@@ -2083,13 +2981,39 @@ static int do_write_index(struct index_state *istate, int newfd,
 		struct strbuf sb = STRBUF_INIT;
 
 		write_untracked_extension(&sb, istate->untracked);
-		err = write_index_ext_header(&c, newfd, CACHE_EXT_UNTRACKED,
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_UNTRACKED,
 					     sb.len) < 0 ||
 			ce_write(&c, newfd, sb.buf, sb.len) < 0;
 		strbuf_release(&sb);
 		if (err)
 			return -1;
 	}
+	if (!strip_extensions && istate->fsmonitor_last_update &&
+	    istate->fsmonitor_dirty) {
+		struct strbuf sb = STRBUF_INIT;
+
+		write_fsmonitor_extension(&sb, istate);
+		err = write_index_ext_header(&c, eoie_c, newfd, CACHE_EXT_FSMONITOR, sb.len) < 0
+			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			return -1;
+	}
+
+	/*
+	 * The EOIE extension must come last, right before the checksum,
+	 * so that readers can find it.
+	 */
+	if (eoie_c) {
+		struct strbuf sb = STRBUF_INIT;
+
+		write_eoie_extension(&sb, eoie_c, offset);
+		err = write_index_ext_header(&c, NULL, newfd, CACHE_EXT_ENDOFINDEXENTRIES, sb.len) < 0
+			|| ce_write(&c, newfd, sb.buf, sb.len) < 0;
+		strbuf_release(&sb);
+		if (err)
+			return -1;
+	}
 
 	if (ce_flush(&c, newfd, istate->sha1) || fstat(newfd, &st))
 		return -1;
@@ -2114,7 +3038,10 @@ static int commit_locked_index(struct lock_file *lk)
 static int do_write_locked_index(struct index_state *istate, struct lock_file *lock,
 				 unsigned flags)
 {
+	int sparse = prepare_to_write_sparse_index(istate);
 	int ret = do_write_index(istate, get_lock_file_fd(lock), 0);
+	if (sparse)
+		finish_writing_sparse_index(istate);
 	if (ret)
 		return ret;
 	assert((flags & (COMMIT_LOCK | CLOSE_LOCK)) !=
@@ -2164,11 +3091,329 @@ static int write_shared_index(struct index_state *istate,
 	return ret;
 }
 
+static const int default_max_percent_split_change = 20;
+
+/*
+ * Entries that are not in the shared index are written to the split
+ * index every time; once there are too many of them it is cheaper to
+ * start over with a new shared index.
+ */
+static int too_many_not_shared_entries(struct index_state *istate)
+{
+	struct index_state *base = istate->split_index->base;
+	int i, shared = 0, not_shared;
+	int max_split = git_config_get_max_percent_split_change();
+
+	switch (max_split) {
+	case -1: /* not or badly configured: use the default value */
+		max_split = default_max_percent_split_change;
+		break;
+	case 0:
+		return 1; /* 0% means always write a new shared index */
+	case 100:
+		return 0; /* 100% means never write a new shared index */
+	}
+
+	for (i = 0; i < istate->cache_nr; i++)
+		if (istate->cache[i]->index)
+			shared++;
+	not_shared = istate->cache_nr - shared;
+	if (base)
+		not_shared += base->cache_nr - shared; /* deletions */
+
+	return (int64_t)istate->cache_nr * max_split < (int64_t)not_shared * 100;
+}
+
+static const char *shared_index_expire = "2.weeks.ago";
+
+static unsigned long get_shared_index_expire_date(void)
+{
+	static unsigned long shared_index_expire_date;
+	static int shared_index_expire_date_prepared;
+
+	if (!shared_index_expire_date_prepared) {
+		git_config_get_string_const("splitindex.sharedindexexpire",
+					    &shared_index_expire);
+		shared_index_expire_date = approxidate(shared_index_expire);
+		shared_index_expire_date_prepared = 1;
+	}
+	return shared_index_expire_date;
+}
+
+/*
+ * Shared index files are only referenced by the index files of this
+ * repository, which may be temporary ones we know nothing about; those
+ * that have not been used (see freshen_shared_index()) since the
+ * expiry date are assumed to be gone.
+ */
+static int should_delete_shared_index(const char *shared_index_path)
+{
+	struct stat st;
+	unsigned long expiration;
+
+	expiration = get_shared_index_expire_date();
+	if (!expiration)
+		return 0;
+	if (stat(shared_index_path, &st))
+		return error("could not stat '%s': %s",
+			     shared_index_path, strerror(errno));
+	if (st.st_mtime > expiration)
+		return 0;
+	return 1;
+}
+
+static int clean_shared_index_files(const char *current_hex)
+{
+	struct dirent *de;
+	DIR *dir = opendir(get_git_dir());
+
+	if (!dir)
+		return error("unable to open git dir %s: %s",
+			     get_git_dir(), strerror(errno));
+
+	while ((de = readdir(dir)) != NULL) {
+		const char *sha1_hex;
+		const char *shared_index_path;
+
+		if (!skip_prefix(de->d_name, "sharedindex.", &sha1_hex))
+			continue;
+		if (!strcmp(sha1_hex, current_hex))
+			continue;
+		shared_index_path = git_path("%s", de->d_name);
+		if (should_delete_shared_index(shared_index_path) > 0 &&
+		    unlink(shared_index_path))
+			warning("unable to unlink %s: %s",
+				shared_index_path, strerror(errno));
+	}
+	closedir(dir);
+	return 0;
+}
+
+/* Keep the shared index we still refer to from expiring. */
+static void freshen_shared_index(const unsigned char *sha1)
+{
+	const char *path = git_path("sharedindex.%s", sha1_to_hex(sha1));
+	struct utimbuf t;
+
+	t.actime = t.modtime = time(NULL);
+	if (utime(path, &t) && errno != ENOENT)
+		warning("could not freshen shared index '%s': %s",
+			path, strerror(errno));
+}
+
+static void journal_add_entry(struct strbuf *sb, struct cache_entry *ce)
+{
+	int size;
+	struct ondisk_cache_entry *ondisk;
+	char *name;
+
+	ce->ce_flags &= ~CE_EXTENDED;
+	if (ce->ce_flags & CE_EXTENDED_FLAGS)
+		ce->ce_flags |= CE_EXTENDED;
+	size = ondisk_ce_size(ce);
+	ondisk = xcalloc(1, size);
+	name = copy_cache_entry_to_ondisk(ondisk, ce);
+	memcpy(name, ce->name, ce_namelen(ce));
+	strbuf_add(sb, ondisk, size);
+	free(ondisk);
+}
+
+static void journal_add_removal(struct strbuf *sb, struct cache_entry *ce)
+{
+	strbuf_addch(sb, ce_stage(ce));
+	strbuf_add(sb, ce->name, ce_namelen(ce) + 1);
+}
+
+/*
+ * Build the journal record that turns the index as it was read into
+ * istate->cache[].  Entries are compared by pointer; those that were
+ * modified in place are marked CE_UPDATE_IN_BASE, as for the split
+ * index.  Returns -1 if an entry cannot be written.
+ */
+static int prepare_journal_record(struct index_state *istate,
+				  struct strbuf *record)
+{
+	struct index_journal *j = istate->journal;
+	struct strbuf removals = STRBUF_INIT;
+	uint32_t nr_entries = 0, nr_removals = 0;
+	unsigned int i = 0, k = 0;
+	git_SHA_CTX c;
+
+	/* size and counts, filled in below */
+	strbuf_addchars(record, 0, 12);
+	while (i < istate->cache_nr || k < j->base_nr) {
+		struct cache_entry *ce = NULL, *old = NULL;
+		int cmp;
+
+		if (i < istate->cache_nr && (istate->cache[i]->ce_flags & CE_REMOVE)) {
+			i++;
+			continue;
+		}
+		if (i < istate->cache_nr)
+			ce = istate->cache[i];
+		if (k < j->base_nr)
+			old = j->base[k];
+		if (ce == old) {
+			if (ce->ce_flags & CE_UPDATE_IN_BASE) {
+				journal_add_entry(record, ce);
+				nr_entries++;
+			}
+			i++;
+			k++;
+			continue;
+		}
+		if (!ce)
+			cmp = 1;
+		else if (!old)
+			cmp = -1;
+		else
+			cmp = cache_name_stage_compare(ce->name, ce_namelen(ce), ce_stage(ce),
+						       old->name, ce_namelen(old), ce_stage(old));
+		if (cmp > 0) {
+			journal_add_removal(&removals, old);
+			nr_removals++;
+			k++;
+			continue;
+		}
+		if (is_null_sha1(ce->sha1)) {
+			strbuf_release(&removals);
+			return -1;
+		}
+		journal_add_entry(record, ce);
+		nr_entries++;
+		i++;
+		if (!cmp)
+			k++;
+	}
+	strbuf_addbuf(record, &removals);
+	strbuf_release(&removals);
+
+	put_be32(record->buf, record->len - 4);
+	put_be32(record->buf + 4, nr_entries);
+	put_be32(record->buf + 8, nr_removals);
+	git_SHA1_Init(&c);
+	git_SHA1_Update(&c, record->buf, record->len);
+	strbuf_grow(record, 20);
+	git_SHA1_Final((unsigned char *)record->buf + record->len, &c);
+	strbuf_setlen(record, record->len + 20);
+	return 0;
+}
+
+/*
+ * Append the changes to istate since it was read to its journal and
+ * drop the lock, leaving the index file alone.  Returns 1 when the
+ * index has to be written out in full instead.
+ */
+static int write_index_journal(struct index_state *istate,
+			       struct lock_file *lock, unsigned flags)
+{
+	struct index_journal *j = istate->journal;
+	struct strbuf record = STRBUF_INIT;
+	char *path;
+	struct stat st;
+	int fd, i, ok;
+
+	if (!j || !j->base || !(flags & COMMIT_LOCK) ||
+	    alternate_index_output || istate->split_index ||
+	    istate->fsmonitor_last_update || is_sparse_index_enabled(istate) ||
+	    !git_config_get_index_journal())
+		return 1;
+	/* only the entries themselves are journaled */
+	if (istate->cache_changed &
+	    ~(CE_ENTRY_CHANGED | CE_ENTRY_REMOVED | CE_ENTRY_ADDED |
+	      CACHE_TREE_CHANGED))
+		return 1;
+	/*
+	 * Replaying the records invalidates the cache tree along their
+	 * paths, which matches what changing the entries did; a tree
+	 * that was recomputed is worth writing out.
+	 */
+	if ((istate->cache_changed & CACHE_TREE_CHANGED) &&
+	    istate->cache_tree && istate->cache_tree->entry_count >= 0)
+		return 1;
+
+	path = get_locked_file_path(lock);
+	ok = !strcmp(j->path, mkpath("%s.journal", path));
+	free(path);
+	if (!ok)
+		return 1;
+
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		unsigned int size = ce->ce_stat_data.sd_size;
+
+		if (ce->ce_flags & CE_REMOVE)
+			continue;
+		if (!ce_uptodate(ce) && is_racy_timestamp(istate, ce)) {
+			ce_smudge_racily_clean_entry(ce);
+			if (ce->ce_stat_data.sd_size != size)
+				ce->ce_flags |= CE_UPDATE_IN_BASE;
+		}
+	}
+
+	if (prepare_journal_record(istate, &record) ||
+	    (j->size ? j->size : INDEX_JOURNAL_HEADER_SIZE) + record.len >
+	    j->index_size / INDEX_JOURNAL_MAX_RATIO) {
+		strbuf_release(&record);
+		return 1;
+	}
+
+	fd = open(j->path, O_RDWR | O_CREAT, 0666);
+	if (fd < 0) {
+		strbuf_release(&record);
+		return 1;
+	}
+	/* start over after a stale journal, or drop a torn record */
+	ok = !ftruncate(fd, j->size) &&
+		lseek(fd, 0, SEEK_END) == j->size &&
+		(j->size ||
+		 write_in_full(fd, j->header, INDEX_JOURNAL_HEADER_SIZE) ==
+		 INDEX_JOURNAL_HEADER_SIZE) &&
+		write_in_full(fd, record.buf, record.len) == record.len &&
+		!fstat(fd, &st);
+	close(fd);
+	if (!ok) {
+		/* whatever we left behind is not replayed once the index changes */
+		strbuf_release(&record);
+		return 1;
+	}
+	adjust_shared_perm(j->path);
+
+	j->size = j->file_size = xsize_t(st.st_size);
+	istate->timestamp.sec = (unsigned int)st.st_mtime;
+	istate->timestamp.nsec = ST_MTIME_NSEC(st);
+	/* a second write by this process rewrites the index */
+	free(j->base);
+	j->base = NULL;
+	strbuf_release(&record);
+	rollback_lock_file(lock);
+	return 0;
+}
+
 int write_locked_index(struct index_state *istate, struct lock_file *lock,
 		       unsigned flags)
 {
 	struct split_index *si = istate->split_index;
 
+	/* only a plain index can be sparse */
+	if (istate->sparse_index && !is_sparse_index_enabled(istate))
+		ensure_full_index(istate);
+
+	/*
+	 * The dirty bitmap refers to positions in the full index, so
+	 * it has to be computed before the index is split for writing.
+	 */
+	if (istate->fsmonitor_last_update)
+		fill_fsmonitor_bitmap(istate);
+
+	if (istate->journal) {
+		if (!write_index_journal(istate, lock, flags))
+			return 0;
+		/* the journal does not apply to what we write now */
+		free_index_journal(istate->journal);
+		istate->journal = NULL;
+	}
+
 	if (!si || alternate_index_output ||
 	    (istate->cache_changed & ~EXTMASK)) {
 		if (si)
@@ -2181,11 +3426,14 @@ int write_locked_index(struct index_state *istate, struct lock_file *lock,
 		if ((v & 15) < 6)
 			istate->cache_changed |= SPLIT_INDEX_ORDERED;
 	}
-	if (istate->cache_changed & SPLIT_INDEX_ORDERED) {
+	if ((istate->cache_changed & SPLIT_INDEX_ORDERED) ||
+	    too_many_not_shared_entries(istate)) {
 		int ret = write_shared_index(istate, lock, flags);
 		if (ret)
 			return ret;
-	}
+		clean_shared_index_files(sha1_to_hex(si->base_sha1));
+	} else
+		freshen_shared_index(si->base_sha1);
 
 	return write_split_index(istate, lock, flags);
 }
@@ -2206,14 +3454,13 @@ int read_index_unmerged(struct index_state *istate)
 	for (i = 0; i < istate->cache_nr; i++) {
 		struct cache_entry *ce = istate->cache[i];
 		struct cache_entry *new_ce;
-		int size, len;
+		int len;
 
 		if (!ce_stage(ce))
 			continue;
 		unmerged = 1;
 		len = ce_namelen(ce);
-		size = cache_entry_size(len);
-		new_ce = xcalloc(1, size);
+		new_ce = make_empty_cache_entry(istate, len);
 		memcpy(new_ce->name, ce->name, len);
 		new_ce->ce_flags = create_ce_flags(0) | CE_CONFLICTED;
 		new_ce->ce_namelen = len;
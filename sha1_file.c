@@ -19,10 +19,13 @@
 #include "tree-walk.h"
 #include "refs.h"
 #include "pack-revindex.h"
+#include "midx.h"
 #include "sha1-lookup.h"
+#include "sha1-array.h"
 #include "bulk-checkin.h"
 #include "streaming.h"
 #include "dir.h"
+#include "thread-utils.h"
 
 #ifndef O_NOATIME
 #if defined(__linux__) && (defined(__i386__) || defined(__PPC__))
@@ -65,6 +68,7 @@ static struct cached_object empty_tree = {
  * packfile as one another.
  */
 static struct packed_git *last_found_pack;
+static struct multi_pack_index *multi_pack_index;
 
 static struct cached_object *find_cached_object(const unsigned char *sha1)
 {
@@ -182,9 +186,9 @@ static void fill_sha1_path(char *pathbuf, const unsigned char *sha1)
 	}
 }
 
-const char *sha1_file_name(const unsigned char *sha1)
+/* buf must have room for PATH_MAX bytes */
+static void fill_sha1_file_name(char *buf, const unsigned char *sha1)
 {
-	static char buf[PATH_MAX];
 	const char *objdir;
 	int len;
 
@@ -199,6 +203,13 @@ const char *sha1_file_name(const unsigned char *sha1)
 	buf[len+3] = '/';
 	buf[len+42] = '\0';
 	fill_sha1_path(buf + len + 1, sha1);
+}
+
+const char *sha1_file_name(const unsigned char *sha1)
+{
+	static char buf[PATH_MAX];
+
+	fill_sha1_file_name(buf, sha1);
 	return buf;
 }
 
@@ -297,6 +308,7 @@ static int link_alt_odb_entry(const char *entry, const char *relative_base,
 	strbuf_release(&pathbuf);
 
 	ent->name = ent->base + pfxlen + 1;
+	ent->loose_objects = NULL;
 	ent->base[pfxlen + 3] = '/';
 	ent->base[pfxlen] = ent->base[entlen-1] = 0;
 
@@ -499,7 +511,10 @@ static int check_and_freshen_file(const char *fn, int freshen)
 
 static int check_and_freshen_local(const unsigned char *sha1, int freshen)
 {
-	return check_and_freshen_file(sha1_file_name(sha1), freshen);
+	const char *deferred = deferred_loose_object_path(sha1);
+
+	return check_and_freshen_file(deferred ? deferred : sha1_file_name(sha1),
+				      freshen);
 }
 
 static int check_and_freshen_nonlocal(const unsigned char *sha1, int freshen)
@@ -898,6 +913,10 @@ void free_pack_by_name(const char *pack_name)
 		p = *pp;
 		if (strcmp(pack_name, p->pack_name) == 0) {
 			clear_delta_base_cache();
+			if (p->multi_pack_indexed) {
+				close_multi_pack_index(multi_pack_index);
+				multi_pack_index = NULL;
+			}
 			close_pack_windows(p);
 			if (p->pack_fd != -1) {
 				close(p->pack_fd);
@@ -1143,7 +1162,9 @@ static struct packed_git *alloc_packed_git(int extra)
 
 static void try_to_free_pack_memory(size_t size)
 {
+	obj_read_lock();
 	release_pack_memory(size);
+	obj_read_unlock();
 }
 
 struct packed_git *add_packed_git(const char *path, int path_len, int local)
@@ -1327,6 +1348,8 @@ static void prepare_packed_git_one(char *objdir, int local)
 		    ends_with(de->d_name, ".bitmap") ||
 		    ends_with(de->d_name, ".keep"))
 			string_list_append(&garbage, path.buf);
+		else if (!strcmp(de->d_name, "multi-pack-index"))
+			; /* not garbage */
 		else
 			report_garbage("garbage found", path.buf);
 	}
@@ -1390,6 +1413,58 @@ static void rearrange_packed_git(void)
 	free(ary);
 }
 
+/*
+ * Load the multi-pack index of the local object directory, and find
+ * the packs it lists among those we have.  It is not used at all if
+ * any of them is missing (e.g. "repack -d" deleted it after the index
+ * was written); packs that are not listed are searched one by one.
+ */
+static void prepare_multi_pack_index(void)
+{
+	struct multi_pack_index *m;
+	struct packed_git *p;
+	uint32_t i;
+
+	/*
+	 * The packs it was matched to are still there, as
+	 * free_pack_by_name() drops the index with any of them.
+	 */
+	if (multi_pack_index &&
+	    multi_pack_index_is_current(multi_pack_index,
+					get_object_directory()))
+		return;
+	close_multi_pack_index(multi_pack_index);
+	multi_pack_index = NULL;
+	for (p = packed_git; p; p = p->next)
+		p->multi_pack_indexed = 0;
+
+	m = load_multi_pack_index(get_object_directory());
+	if (!m)
+		return;
+	for (p = packed_git; p; p = p->next) {
+		const char *slash = strrchr(p->pack_name, '/');
+		int pos;
+
+		if (!p->pack_local || !slash)
+			continue;
+		pos = midx_pack_pos(m, slash + 1);
+		if (pos >= 0)
+			m->packs[pos] = p;
+	}
+	for (i = 0; i < m->num_packs; i++)
+		if (!m->packs[i]) {
+			trace_printf("multi-pack index: %s is missing, not used\n",
+				     m->pack_names[i]);
+			close_multi_pack_index(m);
+			return;
+		}
+	for (i = 0; i < m->num_packs; i++)
+		m->packs[i]->multi_pack_indexed = 1;
+	trace_printf("multi-pack index: %"PRIu32" objects in %"PRIu32" packs\n",
+		     m->num_objects, m->num_packs);
+	multi_pack_index = m;
+}
+
 static int prepare_packed_git_run_once = 0;
 void prepare_packed_git(void)
 {
@@ -1405,13 +1480,18 @@ void prepare_packed_git(void)
 		alt->name[-1] = '/';
 	}
 	rearrange_packed_git();
+	prepare_multi_pack_index();
 	prepare_packed_git_run_once = 1;
 }
 
 void reprepare_packed_git(void)
 {
+	obj_read_lock();
 	prepare_packed_git_run_once = 0;
 	prepare_packed_git();
+	/* loose objects may have come and gone just as well */
+	clear_loose_object_cache();
+	obj_read_unlock();
 }
 
 static void mark_bad_packed_object(struct packed_git *p,
@@ -1511,8 +1591,9 @@ int git_open_noatime(const char *name)
 static int stat_sha1_file(const unsigned char *sha1, struct stat *st)
 {
 	struct alternate_object_database *alt;
+	const char *deferred = deferred_loose_object_path(sha1);
 
-	if (!lstat(sha1_file_name(sha1), st))
+	if (!lstat(deferred ? deferred : sha1_file_name(sha1), st))
 		return 0;
 
 	prepare_alt_odb();
@@ -1531,8 +1612,9 @@ static int open_sha1_file(const unsigned char *sha1)
 	int fd;
 	struct alternate_object_database *alt;
 	int most_interesting_errno;
+	const char *deferred = deferred_loose_object_path(sha1);
 
-	fd = git_open_noatime(sha1_file_name(sha1));
+	fd = git_open_noatime(deferred ? deferred : sha1_file_name(sha1));
 	if (fd >= 0)
 		return fd;
 	most_interesting_errno = errno;
@@ -2066,6 +2148,120 @@ out:
 	return type;
 }
 
+static struct trace_key trace_obj_read_lock = TRACE_KEY_INIT(OBJ_READ_LOCK);
+
+#ifndef NO_PTHREADS
+/*
+ * Pack windows, the delta base cache and the rest of the object
+ * database state live in globals.  Once enable_obj_read_lock() has
+ * been called, readers hold obj_read_mutex while they touch them, and
+ * let go of it only while inflating or applying a delta to data no
+ * other thread can see.  Only the public entry points take the lock,
+ * so that letting go of it there releases it for good.
+ */
+static pthread_mutex_t obj_read_mutex;
+static int obj_read_use_lock;
+static int obj_read_depth;	/* of the holder of obj_read_mutex */
+
+static struct obj_read_stats {
+	unsigned unlocked, locked;	/* inflates and deltas */
+	unsigned running, peak;		/* of those run unlocked */
+} obj_read_stats;
+
+void enable_obj_read_lock(void)
+{
+	if (obj_read_use_lock++)
+		return;
+	init_recursive_mutex(&obj_read_mutex);
+	memset(&obj_read_stats, 0, sizeof(obj_read_stats));
+}
+
+void disable_obj_read_lock(void)
+{
+	struct obj_read_stats *st = &obj_read_stats;
+
+	if (!obj_read_use_lock)
+		die("BUG: object read lock was not enabled");
+	if (--obj_read_use_lock)
+		return;
+	pthread_mutex_destroy(&obj_read_mutex);
+	trace_printf_key(&trace_obj_read_lock,
+			 "object read lock: %u unlocked, %u locked, "
+			 "at most %u at once\n",
+			 st->unlocked, st->locked, st->peak);
+}
+
+void obj_read_lock(void)
+{
+	if (!obj_read_use_lock)
+		return;
+	pthread_mutex_lock(&obj_read_mutex);
+	obj_read_depth++;
+}
+
+void obj_read_unlock(void)
+{
+	if (!obj_read_use_lock)
+		return;
+	obj_read_depth--;
+	pthread_mutex_unlock(&obj_read_mutex);
+}
+
+/*
+ * Let go of the object read lock while inflating or applying a delta.
+ * A caller that nested obj_read_lock() still holds it afterwards; the
+ * trace counts such work as "locked".
+ */
+static void obj_read_unlock_for_work(void)
+{
+	struct obj_read_stats *st = &obj_read_stats;
+
+	if (!obj_read_use_lock)
+		return;
+	if (obj_read_depth > 1) {
+		st->locked++;
+	} else {
+		st->unlocked++;
+		if (++st->running > st->peak)
+			st->peak = st->running;
+	}
+	obj_read_unlock();
+}
+
+static void obj_read_lock_after_work(void)
+{
+	if (!obj_read_use_lock)
+		return;
+	obj_read_lock();
+	if (obj_read_depth == 1)
+		obj_read_stats.running--;
+}
+#else
+void enable_obj_read_lock(void)
+{
+}
+
+void disable_obj_read_lock(void)
+{
+}
+
+void obj_read_lock(void)
+{
+}
+
+void obj_read_unlock(void)
+{
+}
+
+static void obj_read_unlock_for_work(void)
+{
+}
+
+static void obj_read_lock_after_work(void)
+{
+}
+#endif
+
 static void *unpack_compressed_entry(struct packed_git *p,
 				    struct pack_window **w_curs,
 				    off_t curpos,
@@ -2086,7 +2282,10 @@ static void *unpack_compressed_entry(struct packed_git *p,
 	do {
 		in = use_pack(p, w_curs, curpos, &stream.avail_in);
 		stream.next_in = in;
+		/* our window is in use, so nobody unmaps it meanwhile */
+		obj_read_unlock_for_work();
 		st = git_inflate(&stream, Z_FINISH);
+		obj_read_lock_after_work();
 		if (!stream.avail_out)
 			break; /* the payload is larger than it should be */
 		curpos += stream.next_in - in;
@@ -2100,8 +2299,13 @@ static void *unpack_compressed_entry(struct packed_git *p,
 	return buffer;
 }
 
-#define MAX_DELTA_CACHE (256)
-
+/*
+ * The delta base cache keeps the bases that unpack_entry() inflated
+ * (or rebuilt from their own deltas) to apply the deltas on top of
+ * them, up to delta_base_cache_limit bytes, dropping the least
+ * recently used first.  Entries are found by pack and offset.
+ */
+static struct hashmap delta_base_cache;
 static size_t delta_base_cached;
 
 static struct delta_base_cache_lru_list {
@@ -2109,52 +2313,99 @@ static struct delta_base_cache_lru_list {
 	struct delta_base_cache_lru_list *next;
 } delta_base_cache_lru = { &delta_base_cache_lru, &delta_base_cache_lru };
 
-static struct delta_base_cache_entry {
-	struct delta_base_cache_lru_list lru;
-	void *data;
+struct delta_base_cache_key {
 	struct packed_git *p;
 	off_t base_offset;
+};
+
+struct delta_base_cache_entry {
+	struct hashmap_entry ent;
+	struct delta_base_cache_key key;
+	struct delta_base_cache_lru_list lru;
+	void *data;
 	unsigned long size;
 	enum object_type type;
-} delta_base_cache[MAX_DELTA_CACHE];
+};
+
+#define lru_to_delta_base_cache_entry(l) \
+	((struct delta_base_cache_entry *) \
+	 ((char *)(l) - offsetof(struct delta_base_cache_entry, lru)))
+
+static struct trace_key trace_delta_base_cache = TRACE_KEY_INIT(DELTA_BASE_CACHE);
+
+static struct delta_base_cache_stats {
+	unsigned hits, misses, evictions;
+	size_t peak;
+} delta_base_cache_stats;
 
-static unsigned long pack_entry_hash(struct packed_git *p, off_t base_offset)
+static void report_delta_base_cache_stats(void)
 {
-	unsigned long hash;
+	struct delta_base_cache_stats *st = &delta_base_cache_stats;
 
-	hash = (unsigned long)p + (unsigned long)base_offset;
+	trace_printf_key(&trace_delta_base_cache,
+			 "delta base cache: %u hits, %u misses, %u evictions, "
+			 "peak %"PRIuMAX" bytes\n", st->hits, st->misses,
+			 st->evictions, (uintmax_t)st->peak);
+}
+
+static unsigned int pack_entry_hash(struct packed_git *p, off_t base_offset)
+{
+	unsigned int hash;
+
+	hash = (unsigned int)(intptr_t)p + (unsigned int)base_offset;
 	hash += (hash >> 8) + (hash >> 16);
-	return hash % MAX_DELTA_CACHE;
+	return hash;
 }
 
-static struct delta_base_cache_entry *
-get_delta_base_cache_entry(struct packed_git *p, off_t base_offset)
+static int delta_base_cache_entry_cmp(const struct delta_base_cache_entry *a,
+				      const struct delta_base_cache_entry *b,
+				      const struct delta_base_cache_key *key)
 {
-	unsigned long hash = pack_entry_hash(p, base_offset);
-	return delta_base_cache + hash;
+	if (!key)
+		key = &b->key;
+	return !(a->key.p == key->p && a->key.base_offset == key->base_offset);
 }
 
-static int eq_delta_base_cache_entry(struct delta_base_cache_entry *ent,
-				     struct packed_git *p, off_t base_offset)
+static struct delta_base_cache_entry *
+get_delta_base_cache_entry(struct packed_git *p, off_t base_offset)
 {
-	return (ent->data && ent->p == p && ent->base_offset == base_offset);
+	struct hashmap_entry entry;
+	struct delta_base_cache_key key;
+
+	if (!delta_base_cache.tablesize) {
+		hashmap_init(&delta_base_cache,
+			     (hashmap_cmp_fn)delta_base_cache_entry_cmp, 0);
+		if (trace_want(&trace_delta_base_cache))
+			atexit(report_delta_base_cache_stats);
+	}
+	hashmap_entry_init(&entry, pack_entry_hash(p, base_offset));
+	key.p = p;
+	key.base_offset = base_offset;
+	return hashmap_get(&delta_base_cache, &entry, &key);
 }
 
 static int in_delta_base_cache(struct packed_git *p, off_t base_offset)
 {
-	struct delta_base_cache_entry *ent;
-	ent = get_delta_base_cache_entry(p, base_offset);
-	return eq_delta_base_cache_entry(ent, p, base_offset);
+	return !!get_delta_base_cache_entry(p, base_offset);
 }
 
-static void clear_delta_base_cache_entry(struct delta_base_cache_entry *ent)
+/*
+ * Remove the entry from the cache, but do not free its data: it now
+ * belongs to the caller.
+ */
+static void detach_delta_base_cache_entry(struct delta_base_cache_entry *ent)
 {
-	ent->data = NULL;
+	hashmap_remove(&delta_base_cache, ent, &ent->key);
 	ent->lru.next->prev = ent->lru.prev;
 	ent->lru.prev->next = ent->lru.next;
 	delta_base_cached -= ent->size;
+	free(ent);
 }
 
+static void *unpack_entry_1(struct packed_git *p, off_t obj_offset,
+			    enum object_type *final_type,
+			    unsigned long *final_size);
+
 static void *cache_or_unpack_entry(struct packed_git *p, off_t base_offset,
 	unsigned long *base_size, enum object_type *type, int keep_cache)
 {
@@ -2163,66 +2414,72 @@ static void *cache_or_unpack_entry(struct packed_git *p, off_t base_offset,
 
 	ent = get_delta_base_cache_entry(p, base_offset);
 
-	if (!eq_delta_base_cache_entry(ent, p, base_offset))
-		return unpack_entry(p, base_offset, type, base_size);
+	/* unpack_entry_1() counts the miss */
+	if (!ent)
+		return unpack_entry_1(p, base_offset, type, base_size);
+	delta_base_cache_stats.hits++;
 
+	*type = ent->type;
+	*base_size = ent->size;
 	ret = ent->data;
 
 	if (!keep_cache)
-		clear_delta_base_cache_entry(ent);
+		detach_delta_base_cache_entry(ent);
 	else
 		ret = xmemdupz(ent->data, ent->size);
-	*type = ent->type;
-	*base_size = ent->size;
 	return ret;
 }
 
 static inline void release_delta_base_cache(struct delta_base_cache_entry *ent)
 {
-	if (ent->data) {
-		free(ent->data);
-		ent->data = NULL;
-		ent->lru.next->prev = ent->lru.prev;
-		ent->lru.prev->next = ent->lru.next;
-		delta_base_cached -= ent->size;
-	}
+	free(ent->data);
+	detach_delta_base_cache_entry(ent);
 }
 
 void clear_delta_base_cache(void)
 {
-	unsigned long p;
-	for (p = 0; p < MAX_DELTA_CACHE; p++)
-		release_delta_base_cache(&delta_base_cache[p]);
+	struct delta_base_cache_lru_list *lru;
+
+	while ((lru = delta_base_cache_lru.next) != &delta_base_cache_lru)
+		release_delta_base_cache(lru_to_delta_base_cache_entry(lru));
 }
 
 static void add_delta_base_cache(struct packed_git *p, off_t base_offset,
 	void *base, unsigned long base_size, enum object_type type)
 {
-	unsigned long hash = pack_entry_hash(p, base_offset);
-	struct delta_base_cache_entry *ent = delta_base_cache + hash;
-	struct delta_base_cache_lru_list *lru;
+	struct delta_base_cache_entry *ent, *old;
+	struct delta_base_cache_lru_list *lru, *next;
 
-	release_delta_base_cache(ent);
+	old = get_delta_base_cache_entry(p, base_offset);
+	if (old)
+		release_delta_base_cache(old);
 	delta_base_cached += base_size;
 
 	for (lru = delta_base_cache_lru.next;
 	     delta_base_cached > delta_base_cache_limit
 	     && lru != &delta_base_cache_lru;
-	     lru = lru->next) {
-		struct delta_base_cache_entry *f = (void *)lru;
-		if (f->type == OBJ_BLOB)
+	     lru = next) {
+		struct delta_base_cache_entry *f = lru_to_delta_base_cache_entry(lru);
+		next = lru->next;
+		if (f->type == OBJ_BLOB) {
 			release_delta_base_cache(f);
+			delta_base_cache_stats.evictions++;
+		}
 	}
 	for (lru = delta_base_cache_lru.next;
 	     delta_base_cached > delta_base_cache_limit
 	     && lru != &delta_base_cache_lru;
-	     lru = lru->next) {
-		struct delta_base_cache_entry *f = (void *)lru;
+	     lru = next) {
+		struct delta_base_cache_entry *f = lru_to_delta_base_cache_entry(lru);
+		next = lru->next;
 		release_delta_base_cache(f);
+		delta_base_cache_stats.evictions++;
 	}
 
-	ent->p = p;
-	ent->base_offset = base_offset;
+	ent = xmalloc(sizeof(*ent));
+	hashmap_entry_init(ent, pack_entry_hash(p, base_offset));
+	ent->key.p = p;
+	ent->key.base_offset = base_offset;
 	ent->type = type;
 	ent->data = base;
 	ent->size = base_size;
@@ -2230,6 +2487,9 @@ static void add_delta_base_cache(struct packed_git *p, off_t base_offset,
 	ent->lru.prev = delta_base_cache_lru.prev;
 	delta_base_cache_lru.prev->next = &ent->lru;
 	delta_base_cache_lru.prev = &ent->lru;
+	hashmap_add(&delta_base_cache, ent);
+	if (delta_base_cache_stats.peak < delta_base_cached)
+		delta_base_cache_stats.peak = delta_base_cached;
 }
 
 static void *read_object(const unsigned char *sha1, enum object_type *type,
@@ -2251,8 +2511,9 @@ struct unpack_entry_stack_ent {
 	unsigned long size;
 };
 
-void *unpack_entry(struct packed_git *p, off_t obj_offset,
-		   enum object_type *final_type, unsigned long *final_size)
+static void *unpack_entry_1(struct packed_git *p, off_t obj_offset,
+			    enum object_type *final_type,
+			    unsigned long *final_size)
 {
 	struct pack_window *w_curs = NULL;
 	off_t curpos = obj_offset;
@@ -2273,14 +2534,16 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 		struct delta_base_cache_entry *ent;
 
 		ent = get_delta_base_cache_entry(p, curpos);
-		if (eq_delta_base_cache_entry(ent, p, curpos)) {
+		if (ent) {
+			delta_base_cache_stats.hits++;
 			type = ent->type;
 			data = ent->data;
 			size = ent->size;
-			clear_delta_base_cache_entry(ent);
+			detach_delta_base_cache_entry(ent);
 			base_from_cache = 1;
 			break;
 		}
+		delta_base_cache_stats.misses++;
 
 		if (do_check_packed_object_crc && p->index_version > 1) {
 			struct revindex_entry *revidx = find_pack_revindex(p, obj_offset);
@@ -2356,14 +2619,13 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 	while (delta_stack_nr) {
 		void *delta_data;
 		void *base = data;
+		void *external_base = NULL;
 		unsigned long delta_size, base_size = size;
+		off_t base_offset = obj_offset;
 		int i;
 
 		data = NULL;
 
-		if (base)
-			add_delta_base_cache(p, obj_offset, base, base_size, type);
-
 		if (!base) {
 			/*
 			 * We're probably in deep shit, but let's try to fetch
@@ -2382,6 +2644,7 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 				      p->pack_name);
 				mark_bad_packed_object(p, base_sha1);
 				base = read_object(base_sha1, &type, &base_size);
+				external_base = base;
 			}
 		}
 
@@ -2400,23 +2663,36 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 			      "at offset %"PRIuMAX" from %s",
 			      (uintmax_t)curpos, p->pack_name);
 			data = NULL;
-			continue;
-		}
+		} else {
+			/* base and delta_data are ours alone */
+			obj_read_unlock_for_work();
+			data = patch_delta(base, base_size,
+					   delta_data, delta_size,
+					   &size);
+			obj_read_lock_after_work();
 
-		data = patch_delta(base, base_size,
-				   delta_data, delta_size,
-				   &size);
+			/*
+			 * We could not apply the delta; warn the user, but
+			 * keep going.  Our failure will be noticed either in
+			 * the next iteration of the loop, or if this is the
+			 * final delta, in the caller when we return NULL.
+			 * Those code paths will take care of making a more
+			 * explicit warning and retrying with another copy of
+			 * the object.
+			 */
+			if (!data)
+				error("failed to apply delta");
+		}
 
 		/*
-		 * We could not apply the delta; warn the user, but keep going.
-		 * Our failure will be noticed either in the next iteration of
-		 * the loop, or if this is the final delta, in the caller when
-		 * we return NULL. Those code paths will take care of making
-		 * a more explicit warning and retrying with another copy of
-		 * the object.
+		 * Only cache the base once we are done with it: while we
+		 * let go of the object read lock above, another thread
+		 * could have evicted and freed it.
 		 */
-		if (!data)
-			error("failed to apply delta");
+		if (external_base)
+			free(external_base);
+		else
+			add_delta_base_cache(p, base_offset, base, base_size, type);
 
 		free(delta_data);
 	}
@@ -2432,6 +2708,17 @@ void *unpack_entry(struct packed_git *p, off_t obj_offset,
 	return data;
 }
 
+void *unpack_entry(struct packed_git *p, off_t obj_offset,
+		   enum object_type *final_type, unsigned long *final_size)
+{
+	void *data;
+
+	obj_read_lock();
+	data = unpack_entry_1(p, obj_offset, final_type, final_size);
+	obj_read_unlock();
+	return data;
+}
+
 const unsigned char *nth_packed_object_sha1(struct packed_git *p,
 					    uint32_t n)
 {
@@ -2554,18 +2841,54 @@ int is_pack_valid(struct packed_git *p)
 	return !open_packed_git(p);
 }
 
+static int is_bad_packed_object(struct packed_git *p,
+				const unsigned char *sha1)
+{
+	unsigned i;
+
+	for (i = 0; i < p->num_bad_objects; i++)
+		if (!hashcmp(sha1, p->bad_object_sha1 + 20 * i))
+			return 1;
+	return 0;
+}
+
+/*
+ * Like fill_pack_entry(), but looks sha1 up in the multi-pack index.
+ * Returns -1 if the index does not have it, so that none of the packs
+ * it lists need to be searched.
+ */
+static int fill_midx_entry(const unsigned char *sha1, struct pack_entry *e)
+{
+	struct multi_pack_index *m = multi_pack_index;
+	struct packed_git *p;
+	uint32_t pos, pack_id;
+	off_t offset;
+
+	if (!bsearch_midx(m, sha1, &pos))
+		return -1;
+	pack_id = nth_midxed_pack_id(m, pos);
+	if (pack_id >= m->num_packs)
+		return 0;
+	p = m->packs[pack_id];
+	if (is_bad_packed_object(p, sha1))
+		return 0;
+	offset = nth_midxed_offset(m, pos);
+	if (!offset || !is_pack_valid(p))
+		return 0;
+	e->offset = offset;
+	e->p = p;
+	hashcpy(e->sha1, sha1);
+	return 1;
+}
+
 static int fill_pack_entry(const unsigned char *sha1,
 			   struct pack_entry *e,
 			   struct packed_git *p)
 {
 	off_t offset;
 
-	if (p->num_bad_objects) {
-		unsigned i;
-		for (i = 0; i < p->num_bad_objects; i++)
-			if (!hashcmp(sha1, p->bad_object_sha1 + 20 * i))
-				return 0;
-	}
+	if (is_bad_packed_object(p, sha1))
+		return 0;
 
 	offset = find_pack_entry_one(sha1, p);
 	if (!offset)
@@ -2593,17 +2916,27 @@ static int fill_pack_entry(const unsigned char *sha1,
 static int find_pack_entry(const unsigned char *sha1, struct pack_entry *e)
 {
 	struct packed_git *p;
+	int skip_indexed = 0;
 
 	prepare_packed_git();
 	if (!packed_git)
 		return 0;
 
+	if (multi_pack_index) {
+		int ret = fill_midx_entry(sha1, e);
+		if (ret > 0)
+			return 1;
+		skip_indexed = ret < 0;
+	}
+
 	if (last_found_pack && fill_pack_entry(sha1, e, last_found_pack))
 		return 1;
 
 	for (p = packed_git; p; p = p->next) {
 		if (p == last_found_pack)
 			continue; /* we already checked this one */
+		if (skip_indexed && p->multi_pack_indexed)
+			continue;
 
 		if (fill_pack_entry(sha1, e, p)) {
 			last_found_pack = p;
@@ -2685,7 +3018,8 @@ static int sha1_loose_object_info(const unsigned char *sha1,
 	return 0;
 }
 
-int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi, unsigned flags)
+static int sha1_object_info_extended_1(const unsigned char *sha1,
+				       struct object_info *oi, unsigned flags)
 {
 	struct cached_object *co;
 	struct pack_entry e;
@@ -2734,7 +3068,7 @@ int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi,
 		mark_bad_packed_object(e.p, real);
 		if (oi->typep == &real_type)
 			oi->typep = NULL;
-		return sha1_object_info_extended(real, oi, 0);
+		return sha1_object_info_extended_1(real, oi, 0);
 	} else if (in_delta_base_cache(e.p, e.offset)) {
 		oi->whence = OI_DBCACHED;
 	} else {
@@ -2752,6 +3086,16 @@ int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi,
 	return 0;
 }
 
+int sha1_object_info_extended(const unsigned char *sha1, struct object_info *oi, unsigned flags)
+{
+	int ret;
+
+	obj_read_lock();
+	ret = sha1_object_info_extended_1(sha1, oi, flags);
+	obj_read_unlock();
+	return ret;
+}
+
 /* returns enum object_type or negative */
 int sha1_object_info(const unsigned char *sha1, unsigned long *sizep)
 {
@@ -2826,7 +3170,10 @@ static void *read_object(const unsigned char *sha1, enum object_type *type,
 		return buf;
 	map = map_sha1_file(sha1, &mapsize);
 	if (map) {
+		/* nobody else sees our mapping of the loose object */
+		obj_read_unlock_for_work();
 		buf = unpack_sha1_file(map, mapsize, type, size, sha1);
+		obj_read_lock_after_work();
 		munmap(map, mapsize);
 		return buf;
 	}
@@ -2839,10 +3186,10 @@ static void *read_object(const unsigned char *sha1, enum object_type *type,
  * deal with them should arrange to call read_object() and give error
  * messages themselves.
  */
-void *read_sha1_file_extended(const unsigned char *sha1,
-			      enum object_type *type,
-			      unsigned long *size,
-			      unsigned flag)
+static void *read_sha1_file_extended_1(const unsigned char *sha1,
+				       enum object_type *type,
+				       unsigned long *size,
+				       unsigned flag)
 {
 	void *data;
 	const struct packed_git *p;
@@ -2875,6 +3222,19 @@ void *read_sha1_file_extended(const unsigned char *sha1,
 	return NULL;
 }
 
+void *read_sha1_file_extended(const unsigned char *sha1,
+			      enum object_type *type,
+			      unsigned long *size,
+			      unsigned flag)
+{
+	void *data;
+
+	obj_read_lock();
+	data = read_sha1_file_extended_1(sha1, type, size, flag);
+	obj_read_unlock();
+	return data;
+}
+
 void *read_object_with_reference(const unsigned char *sha1,
 				 const char *required_type_name,
 				 unsigned long *size,
@@ -2999,9 +3359,9 @@ int hash_sha1_file(const void *buf, unsigned long len, const char *type,
 }
 
 /* Finalize a file on disk, and close it. */
-static void close_sha1_file(int fd)
+static void close_sha1_file(int fd, int sync)
 {
-	if (fsync_object_files)
+	if (sync)
 		fsync_or_die(fd, "sha1 file");
 	if (close(fd) != 0)
 		die_errno("error when closing sha1 file");
@@ -3050,6 +3410,9 @@ static int create_tmpfile(char *buffer, size_t bufsiz, const char *filename)
 	return fd;
 }
 
+static void forget_loose_object_subdir(int subdir_nr);
+static int has_loose_object_quick(const unsigned char *sha1);
+
 static int write_loose_object(const unsigned char *sha1, char *hdr, int hdrlen,
 			      const void *buf, unsigned long len, time_t mtime)
 {
@@ -3058,9 +3421,10 @@ static int write_loose_object(const unsigned char *sha1, char *hdr, int hdrlen,
 	git_zstream stream;
 	git_SHA_CTX c;
 	unsigned char parano_sha1[20];
-	static char tmp_file[PATH_MAX];
-	const char *filename = sha1_file_name(sha1);
+	char tmp_file[PATH_MAX];
+	char filename[PATH_MAX];
 
+	fill_sha1_file_name(filename, sha1);
 	fd = create_tmpfile(tmp_file, sizeof(tmp_file), filename);
 	if (fd < 0) {
 		if (errno == EACCES)
@@ -3104,7 +3468,8 @@ static int write_loose_object(const unsigned char *sha1, char *hdr, int hdrlen,
 	if (hashcmp(sha1, parano_sha1) != 0)
 		die("confused by unstable object source data for %s", sha1_to_hex(sha1));
 
-	close_sha1_file(fd);
+	/* a batch is synced all at once when it ends */
+	close_sha1_file(fd, fsync_object_files && !loose_objects_deferred());
 
 	if (mtime) {
 		struct utimbuf utb;
@@ -3115,6 +3480,8 @@ static int write_loose_object(const unsigned char *sha1, char *hdr, int hdrlen,
 				tmp_file, strerror(errno));
 	}
 
+	if (loose_objects_deferred())
+		return defer_loose_object(sha1, tmp_file);
 	return finalize_object_file(tmp_file, filename);
 }
 
@@ -3136,6 +3503,26 @@ static int freshen_packed_object(const unsigned char *sha1)
 	return 1;
 }
 
+int freshen_object(const unsigned char *sha1)
+{
+	return freshen_packed_object(sha1) || freshen_loose_object(sha1);
+}
+
+/*
+ * Unlike write_sha1_file(), this neither hashes buf nor looks for the
+ * object in the repository first, and touches no shared state, so that
+ * several threads may write objects at the same time.  The caller is to
+ * clear_loose_object_cache() once they are done.
+ */
+int write_loose_sha1_file(const void *buf, unsigned long len, const char *type,
+			  const unsigned char *sha1)
+{
+	char hdr[32];
+	int hdrlen = sprintf(hdr, "%s %lu", type, len) + 1;
+
+	return write_loose_object(sha1, hdr, hdrlen, buf, len, 0);
+}
+
 int write_sha1_file(const void *buf, unsigned long len, const char *type, unsigned char *sha1)
 {
 	char hdr[32];
@@ -3147,6 +3534,7 @@ int write_sha1_file(const void *buf, unsigned long len, const char *type, unsign
 	write_sha1_file_prepare(buf, len, type, sha1, hdr, &hdrlen);
 	if (freshen_packed_object(sha1) || freshen_loose_object(sha1))
 		return 0;
+	forget_loose_object_subdir(sha1[0]);
 	return write_loose_object(sha1, hdr, hdrlen, buf, len, 0);
 }
 
@@ -3164,6 +3552,7 @@ int hash_sha1_file_literally(const void *buf, unsigned long len, const char *typ
 		goto cleanup;
 	if (freshen_packed_object(sha1) || freshen_loose_object(sha1))
 		goto cleanup;
+	forget_loose_object_subdir(sha1[0]);
 	status = write_loose_object(sha1, header, hdrlen, buf, len, 0);
 
 cleanup:
@@ -3182,10 +3571,13 @@ int force_object_loose(const unsigned char *sha1, time_t mtime)
 
 	if (has_loose_object(sha1))
 		return 0;
+	obj_read_lock();
 	buf = read_packed_sha1(sha1, &type, &len);
+	obj_read_unlock();
 	if (!buf)
 		return error("cannot read sha1_file for %s", sha1_to_hex(sha1));
 	hdrlen = sprintf(hdr, "%s %lu", typename(type), len) + 1;
+	forget_loose_object_subdir(sha1[0]);
 	ret = write_loose_object(sha1, hdr, hdrlen, buf, len, mtime);
 	free(buf);
 
@@ -3206,20 +3598,30 @@ int has_sha1_pack(const unsigned char *sha1)
 	return find_pack_entry(sha1, &e);
 }
 
-int has_sha1_file_with_flags(const unsigned char *sha1, int flags)
+static int has_sha1_file_with_flags_1(const unsigned char *sha1, int flags)
 {
 	struct pack_entry e;
 
 	if (find_pack_entry(sha1, &e))
 		return 1;
+	if (flags & HAS_SHA1_QUICK)
+		return has_loose_object_quick(sha1);
 	if (has_loose_object(sha1))
 		return 1;
-	if (flags & HAS_SHA1_QUICK)
-		return 0;
 	reprepare_packed_git();
 	return find_pack_entry(sha1, &e);
 }
 
+int has_sha1_file_with_flags(const unsigned char *sha1, int flags)
+{
+	int ret;
+
+	obj_read_lock();
+	ret = has_sha1_file_with_flags_1(sha1, flags);
+	obj_read_unlock();
+	return ret;
+}
+
 static void check_tree(const void *buf, size_t size)
 {
 	struct tree_desc desc;
@@ -3590,6 +3992,92 @@ int for_each_loose_object(each_loose_object_fn cb, void *data, unsigned flags)
 	return foreach_alt_odb(loose_from_alt_odb, &alt);
 }
 
+/* The fan-out directories of an object directory read so far */
+struct loose_object_cache {
+	uint32_t subdir_seen[8];	/* one bit per directory */
+	struct sha1_array subdir[256];
+};
+
+static struct loose_object_cache *own_loose_objects;
+
+static int append_loose_object(const unsigned char *sha1, const char *path,
+			       void *data)
+{
+	sha1_array_append(data, sha1);
+	return 0;
+}
+
+struct sha1_array *loose_object_subdir(struct alternate_object_database *alt,
+				       int subdir_nr)
+{
+	struct loose_object_cache **cache;
+	struct strbuf path = STRBUF_INIT;
+	uint32_t bit = 1u << (subdir_nr % 32);
+
+	cache = alt ? &alt->loose_objects : &own_loose_objects;
+	if (!*cache)
+		*cache = xcalloc(1, sizeof(**cache));
+	if ((*cache)->subdir_seen[subdir_nr / 32] & bit)
+		return &(*cache)->subdir[subdir_nr];
+
+	if (alt)
+		/* copy base not including trailing '/' */
+		strbuf_add(&path, alt->base, alt->name - alt->base - 1);
+	else
+		strbuf_addstr(&path, get_object_directory());
+	strbuf_addf(&path, "/%02x", subdir_nr);
+	for_each_file_in_obj_subdir(subdir_nr, &path, append_loose_object,
+				    NULL, NULL, &(*cache)->subdir[subdir_nr]);
+	strbuf_release(&path);
+	(*cache)->subdir_seen[subdir_nr / 32] |= bit;
+	return &(*cache)->subdir[subdir_nr];
+}
+
+static void forget_loose_object_subdir(int subdir_nr)
+{
+	if (!own_loose_objects)
+		return;
+	own_loose_objects->subdir_seen[subdir_nr / 32] &= ~(1u << (subdir_nr % 32));
+	sha1_array_clear(&own_loose_objects->subdir[subdir_nr]);
+}
+
+static void free_loose_object_cache(struct loose_object_cache **cache)
+{
+	int i;
+
+	if (!*cache)
+		return;
+	for (i = 0; i < 256; i++)
+		sha1_array_clear(&(*cache)->subdir[i]);
+	free(*cache);
+	*cache = NULL;
+}
+
+void clear_loose_object_cache(void)
+{
+	struct alternate_object_database *alt;
+
+	free_loose_object_cache(&own_loose_objects);
+	for (alt = alt_odb_list; alt; alt = alt->next)
+		free_loose_object_cache(&alt->loose_objects);
+}
+
+static int has_loose_object_quick(const unsigned char *sha1)
+{
+	struct alternate_object_database *alt;
+
+	/* not in its directory until the batch ends */
+	if (deferred_loose_object_path(sha1))
+		return 1;
+	if (sha1_array_lookup(loose_object_subdir(NULL, sha1[0]), sha1) >= 0)
+		return 1;
+	prepare_alt_odb();
+	for (alt = alt_odb_list; alt; alt = alt->next)
+		if (sha1_array_lookup(loose_object_subdir(alt, sha1[0]), sha1) >= 0)
+			return 1;
+	return 0;
+}
+
 static int for_each_object_in_pack(struct packed_git *p, each_packed_object_fn cb, void *data)
 {
 	uint32_t i;
@@ -7,6 +7,7 @@
 #include "refs.h"
 #include "remote.h"
 #include "dir.h"
+#include "sha1-array.h"
 
 static int get_sha1_oneline(const char *, unsigned char *, struct commit_list *);
 
@@ -72,54 +73,6 @@ static void update_candidates(struct disambiguate_state *ds, const unsigned char
 	/* otherwise, current can be discarded and candidate is still good */
 }
 
-static void find_short_object_filename(int len, const char *hex_pfx, struct disambiguate_state *ds)
-{
-	struct alternate_object_database *alt;
-	char hex[40];
-	static struct alternate_object_database *fakeent;
-
-	if (!fakeent) {
-		/*
-		 * Create a "fake" alternate object database that
-		 * points to our own object database, to make it
-		 * easier to get a temporary working space in
-		 * alt->name/alt->base while iterating over the
-		 * object databases including our own.
-		 */
-		const char *objdir = get_object_directory();
-		int objdir_len = strlen(objdir);
-		int entlen = objdir_len + 43;
-		fakeent = xmalloc(sizeof(*fakeent) + entlen);
-		memcpy(fakeent->base, objdir, objdir_len);
-		fakeent->name = fakeent->base + objdir_len + 1;
-		fakeent->name[-1] = '/';
-	}
-	fakeent->next = alt_odb_list;
-
-	sprintf(hex, "%.2s", hex_pfx);
-	for (alt = fakeent; alt && !ds->ambiguous; alt = alt->next) {
-		struct dirent *de;
-		DIR *dir;
-		sprintf(alt->name, "%.2s/", hex_pfx);
-		dir = opendir(alt->base);
-		if (!dir)
-			continue;
-
-		while (!ds->ambiguous && (de = readdir(dir)) != NULL) {
-			unsigned char sha1[20];
-
-			if (strlen(de->d_name) != 38)
-				continue;
-			if (memcmp(de->d_name, hex_pfx + 2, len - 2))
-				continue;
-			memcpy(hex + 2, de->d_name, 38);
-			if (!get_sha1_hex(hex, sha1))
-				update_candidates(ds, sha1);
-		}
-		closedir(dir);
-	}
-}
-
 static int match_sha(unsigned len, const unsigned char *a, const unsigned char *b)
 {
 	do {
@@ -135,6 +88,36 @@ static int match_sha(unsigned len, const unsigned char *a, const unsigned char *
 	return 1;
 }
 
+static void unique_in_loose_subdir(int len,
+				   const unsigned char *bin_pfx,
+				   struct sha1_array *loose,
+				   struct disambiguate_state *ds)
+{
+	int i = sha1_array_lookup(loose, bin_pfx);
+
+	/* the lowest object that could match "bin_pfx" */
+	if (i < 0)
+		i = -1 - i;
+	for (; i < loose->nr && !ds->ambiguous; i++) {
+		if (!match_sha(len, bin_pfx, loose->sha1[i]))
+			break;
+		update_candidates(ds, loose->sha1[i]);
+	}
+}
+
+static void find_short_object_filename(int len,
+				       const unsigned char *bin_pfx,
+				       struct disambiguate_state *ds)
+{
+	struct alternate_object_database *alt;
+
+	unique_in_loose_subdir(len, bin_pfx,
+			       loose_object_subdir(NULL, bin_pfx[0]), ds);
+	for (alt = alt_odb_list; alt && !ds->ambiguous; alt = alt->next)
+		unique_in_loose_subdir(len, bin_pfx,
+				       loose_object_subdir(alt, bin_pfx[0]), ds);
+}
+
 static void unique_in_pack(int len,
 			  const unsigned char *bin_pfx,
 			   struct packed_git *p,
@@ -335,7 +318,7 @@ static int get_short_sha1(const char *name, int len, unsigned char *sha1,
 	else if (flags & GET_SHA1_BLOB)
 		ds.fn = disambiguate_blob_only;
 
-	find_short_object_filename(len, hex_pfx, &ds);
+	find_short_object_filename(len, bin_pfx, &ds);
 	find_short_packed_object(len, bin_pfx, &ds);
 	status = finish_object_disambiguation(&ds, sha1);
 
@@ -363,7 +346,7 @@ int for_each_abbrev(const char *prefix, each_abbrev_fn fn, void *cb_data)
 	ds.cb_data = cb_data;
 	ds.fn = fn;
 
-	find_short_object_filename(len, hex_pfx, &ds);
+	find_short_object_filename(len, bin_pfx, &ds);
 	find_short_packed_object(len, bin_pfx, &ds);
 	return ds.ambiguous;
 }
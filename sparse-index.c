@@ -0,0 +1,253 @@
+#include "cache.h"
+#include "cache-tree.h"
+#include "tree.h"
+#include "pathspec.h"
+#include "sparse-index.h"
+
+/*
+ * A sparse index stands for each directory outside of the sparse
+ * checkout by a single entry: its path with a trailing slash, mode
+ * 040000, the name of its tree and the skip-worktree bit.  The
+ * cache-tree node of such a directory counts that one entry.  The
+ * index stays full in memory unless the command is known to cope
+ * with these entries; writing it out folds up whatever directories
+ * the cache tree allows.
+ */
+
+int command_requires_full_index = 1;
+
+int is_sparse_index_enabled(struct index_state *istate)
+{
+	return core_apply_sparse_checkout &&
+		!istate->split_index &&
+		!istate->fsmonitor_last_update &&
+		git_config_get_sparse_index();
+}
+
+static struct {
+	struct cache_entry **cache;
+	unsigned int cache_nr, cache_alloc;
+	struct cache_tree *cache_tree;
+	unsigned sparse_index : 1;
+} saved;
+
+static int can_fold(struct cache_entry **cache, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (!ce_skip_worktree(cache[i]) ||
+		    (cache[i]->ce_flags &
+		     (CE_STAGEMASK | CE_INTENT_TO_ADD | CE_REMOVE)))
+			return 0;
+	return 1;
+}
+
+static struct cache_entry *make_sparse_dir_entry(struct index_state *istate,
+						 const char *path, int len,
+						 const unsigned char *sha1)
+{
+	struct cache_entry *ce = make_empty_cache_entry(istate, len);
+
+	ce->ce_mode = S_IFDIR;
+	ce->ce_flags = create_ce_flags(0) | CE_SKIP_WORKTREE;
+	ce->ce_namelen = len;
+	memcpy(ce->name, path, len);
+	hashcpy(ce->sha1, sha1);
+	return ce;
+}
+
+/*
+ * Add the "nr" entries of "cache", which are all under "path", to
+ * istate->cache, folding the directories whose valid cache-tree node
+ * covers nothing but skip-worktree entries into one entry each.  "out"
+ * is the node of "path" in the cache tree written with them.  Returns
+ * the number of entries added.
+ */
+static int fold_entries(struct index_state *istate,
+			struct cache_entry **cache, int nr,
+			struct strbuf *path, struct cache_tree *out)
+{
+	int i = 0, added = 0;
+
+	while (i < nr) {
+		struct cache_entry *ce = cache[i];
+		const char *name = ce->name + path->len;
+		const char *slash = strchr(name, '/');
+		struct cache_tree *it;
+		struct cache_tree_sub *sub;
+		char *subname;
+		int span, len = path->len;
+
+		if (!slash) {
+			ALLOC_GROW(istate->cache, istate->cache_nr + 1,
+				   istate->cache_alloc);
+			istate->cache[istate->cache_nr++] = ce;
+			added++;
+			i++;
+			continue;
+		}
+
+		strbuf_add(path, name, slash - name + 1);
+		for (span = 1; i + span < nr; span++)
+			if (strncmp(cache[i + span]->name, path->buf, path->len))
+				break;
+
+		it = cache_tree_find(saved.cache_tree, path->buf);
+		subname = xmemdupz(name, slash - name);
+		sub = cache_tree_sub(out, subname);
+		free(subname);
+		sub->cache_tree = cache_tree();
+		if (it && it->entry_count == span &&
+		    can_fold(cache + i, span) && has_sha1_file(it->sha1)) {
+			ALLOC_GROW(istate->cache, istate->cache_nr + 1,
+				   istate->cache_alloc);
+			istate->cache[istate->cache_nr++] =
+				make_sparse_dir_entry(istate, path->buf,
+						      path->len, it->sha1);
+			hashcpy(sub->cache_tree->sha1, it->sha1);
+			sub->cache_tree->entry_count = 1;
+			istate->sparse_index = 1;
+			added++;
+		} else {
+			int subcnt = fold_entries(istate, cache + i, span,
+						  path, sub->cache_tree);
+			if (it && it->entry_count >= 0) {
+				hashcpy(sub->cache_tree->sha1, it->sha1);
+				sub->cache_tree->entry_count = subcnt;
+			}
+			added += subcnt;
+		}
+		strbuf_setlen(path, len);
+		i += span;
+	}
+	return added;
+}
+
+/*
+ * Swap the entries and the cache tree of istate for their sparse form
+ * until finish_writing_sparse_index().  Returns 0 when the index is to
+ * be written as it is.
+ */
+int prepare_to_write_sparse_index(struct index_state *istate)
+{
+	struct strbuf path = STRBUF_INIT;
+	int nr;
+
+	if (!istate->cache_tree || !is_sparse_index_enabled(istate))
+		return 0;
+
+	saved.cache = istate->cache;
+	saved.cache_nr = istate->cache_nr;
+	saved.cache_alloc = istate->cache_alloc;
+	saved.cache_tree = istate->cache_tree;
+	saved.sparse_index = istate->sparse_index;
+
+	istate->cache = NULL;
+	istate->cache_nr = istate->cache_alloc = 0;
+	istate->cache_tree = cache_tree();
+	istate->sparse_index = 0;
+	nr = fold_entries(istate, saved.cache, saved.cache_nr, &path,
+			  istate->cache_tree);
+	if (saved.cache_tree->entry_count >= 0) {
+		hashcpy(istate->cache_tree->sha1, saved.cache_tree->sha1);
+		istate->cache_tree->entry_count = nr;
+	}
+	strbuf_release(&path);
+	return 1;
+}
+
+void finish_writing_sparse_index(struct index_state *istate)
+{
+	free(istate->cache);
+	cache_tree_free(&istate->cache_tree);
+	istate->cache = saved.cache;
+	istate->cache_nr = saved.cache_nr;
+	istate->cache_alloc = saved.cache_alloc;
+	istate->cache_tree = saved.cache_tree;
+	istate->sparse_index = saved.sparse_index;
+	memset(&saved, 0, sizeof(saved));
+}
+
+struct expand_data {
+	struct index_state *istate;
+	struct cache_entry **cache;
+	unsigned int nr, alloc;
+};
+
+static int add_path_to_index(const unsigned char *sha1, struct strbuf *base,
+			     const char *path, unsigned int mode, int stage,
+			     void *context)
+{
+	struct expand_data *data = context;
+	struct cache_entry *ce;
+	int len;
+
+	if (S_ISDIR(mode))
+		return READ_TREE_RECURSIVE;
+
+	len = base->len + strlen(path);
+	ce = make_empty_cache_entry(data->istate, len);
+	ce->ce_mode = create_ce_mode(mode);
+	ce->ce_flags = create_ce_flags(0) | CE_SKIP_WORKTREE;
+	ce->ce_namelen = len;
+	memcpy(ce->name, base->buf, base->len);
+	memcpy(ce->name + base->len, path, len - base->len);
+	hashcpy(ce->sha1, sha1);
+
+	ALLOC_GROW(data->cache, data->nr + 1, data->alloc);
+	data->cache[data->nr++] = ce;
+	add_name_hash(data->istate, ce);
+	return 0;
+}
+
+/*
+ * Replace the directory entries of a sparse index by the entries of
+ * their trees, for commands that need to see every path.
+ */
+void ensure_full_index(struct index_state *istate)
+{
+	struct expand_data data;
+	struct pathspec pathspec;
+	unsigned int i, dirs = 0;
+
+	if (!istate->sparse_index)
+		return;
+
+	memset(&data, 0, sizeof(data));
+	memset(&pathspec, 0, sizeof(pathspec));
+	data.istate = istate;
+	data.alloc = istate->cache_nr;
+	data.cache = xcalloc(data.alloc, sizeof(*data.cache));
+
+	for (i = 0; i < istate->cache_nr; i++) {
+		struct cache_entry *ce = istate->cache[i];
+		struct tree *tree;
+
+		if (!S_ISSPARSEDIR(ce->ce_mode)) {
+			ALLOC_GROW(data.cache, data.nr + 1, data.alloc);
+			data.cache[data.nr++] = ce;
+			continue;
+		}
+
+		tree = lookup_tree(ce->sha1);
+		if (!tree || read_tree_recursive(tree, ce->name, ce_namelen(ce),
+						 0, &pathspec, add_path_to_index,
+						 &data))
+			die(_("unable to expand sparse directory '%s'"),
+			    ce->name);
+		if (istate->cache_tree)
+			cache_tree_expand_dir(istate->cache_tree, ce->name,
+					      tree);
+		remove_name_hash(istate, ce);
+		discard_cache_entry(ce);
+		dirs++;
+	}
+
+	free(istate->cache);
+	istate->cache = data.cache;
+	istate->cache_nr = data.nr;
+	istate->cache_alloc = data.alloc;
+	istate->sparse_index = 0;
+	trace_printf("sparse-index: expanded %u directories\n", dirs);
+}
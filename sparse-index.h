@@ -0,0 +1,18 @@
+#ifndef SPARSE_INDEX_H
+#define SPARSE_INDEX_H
+
+struct index_state;
+
+/*
+ * Commands that cope with the directory entries of a sparse index set
+ * this to 0 before reading the index; everybody else gets the index
+ * expanded to one entry per file as it is read.
+ */
+extern int command_requires_full_index;
+
+int is_sparse_index_enabled(struct index_state *istate);
+void ensure_full_index(struct index_state *istate);
+int prepare_to_write_sparse_index(struct index_state *istate);
+void finish_writing_sparse_index(struct index_state *istate);
+
+#endif
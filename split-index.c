@@ -1,6 +1,7 @@
 #include "cache.h"
 #include "split-index.h"
 #include "ewah/ewok.h"
+#include "mem-pool.h"
 
 struct split_index *init_split_index(struct index_state *istate)
 {
@@ -11,6 +12,28 @@ struct split_index *init_split_index(struct index_state *istate)
 	return istate->split_index;
 }
 
+void add_split_index(struct index_state *istate)
+{
+	if (!istate->split_index) {
+		init_split_index(istate);
+		istate->cache_changed |= SPLIT_INDEX_ORDERED;
+	}
+}
+
+void remove_split_index(struct index_state *istate)
+{
+	if (istate->split_index) {
+		/*
+		 * can't discard_split_index(istate); because that
+		 * will destroy split_index->base->cache[], which may
+		 * be shared with istate->cache[]. So yeah we're
+		 * leaking a bit here.
+		 */
+		istate->split_index = NULL;
+		istate->cache_changed |= SOMETHING_CHANGED;
+	}
+}
+
 int read_link_extension(struct index_state *istate,
 			 const void *data_, unsigned long sz)
 {
@@ -75,8 +98,14 @@ void move_cache_to_base_index(struct index_state *istate)
 	/*
 	 * do not delete old si->base, its index entries may be shared
 	 * with istate->cache[]. Accept a bit of leaking here because
-	 * this code is only used by short-lived update-index.
+	 * this code is only used by short-lived update-index.  Its
+	 * pool of cache entries goes with those entries, though.
 	 */
+	if (si->base && si->base->ce_mem_pool) {
+		mem_pool_init(&istate->ce_mem_pool, 0);
+		mem_pool_combine(istate->ce_mem_pool, si->base->ce_mem_pool);
+	}
+
 	si->base = xcalloc(1, sizeof(*si->base));
 	si->base->version = istate->version;
 	/* zero timestamp disables racy test in ce_write_index() */
@@ -88,6 +117,10 @@ void move_cache_to_base_index(struct index_state *istate)
 	mark_base_index_entries(si->base);
 	for (i = 0; i < si->base->cache_nr; i++)
 		si->base->cache[i]->ce_flags &= ~CE_UPDATE_IN_BASE;
+
+	/* the entries now belong to the base, and so does their memory */
+	si->base->ce_mem_pool = istate->ce_mem_pool;
+	istate->ce_mem_pool = NULL;
 }
 
 static void mark_entry_for_delete(size_t pos, void *data)
@@ -124,7 +157,7 @@ static void replace_entry(size_t pos, void *data)
 	src->ce_flags |= CE_UPDATE_IN_BASE;
 	src->ce_namelen = dst->ce_namelen;
 	copy_cache_entry(dst, src);
-	free(src);
+	discard_cache_entry(src);
 	si->nr_replacements++;
 }
 
@@ -227,7 +260,7 @@ void prepare_to_write_split_index(struct index_state *istate)
 			base->ce_flags = base_flags;
 			if (ret)
 				ce->ce_flags |= CE_UPDATE_IN_BASE;
-			free(base);
+			discard_cache_entry(base);
 			si->base->cache[ce->index - 1] = ce;
 		}
 		for (i = 0; i < si->base->cache_nr; i++) {
@@ -302,7 +335,7 @@ void save_or_free_index_entry(struct index_state *istate, struct cache_entry *ce
 	    ce == istate->split_index->base->cache[ce->index - 1])
 		ce->ce_flags |= CE_REMOVE;
 	else
-		free(ce);
+		discard_cache_entry(ce);
 }
 
 void replace_index_entry_in_base(struct index_state *istate,
@@ -315,7 +348,7 @@ void replace_index_entry_in_base(struct index_state *istate,
 	    old->index <= istate->split_index->base->cache_nr) {
 		new->index = old->index;
 		if (old != istate->split_index->base->cache[new->index - 1])
-			free(istate->split_index->base->cache[new->index - 1]);
+			discard_cache_entry(istate->split_index->base->cache[new->index - 1]);
 		istate->split_index->base->cache[new->index - 1] = new;
 	}
 }
@@ -53,6 +53,20 @@ static open_istream_fn open_istream_tbl[] = {
 
 #define FILTER_BUFFER (1024*16)
 
+/*
+ * Undeltified packed objects larger than this are inflated straight
+ * out of the pack windows instead of being read in core first.
+ */
+#define STREAM_INCORE_MAX (1024*1024)
+
+/*
+ * stream_blob_to_fd() writes blobs larger than STREAM_INCORE_MAX in
+ * chunks of this size; zero-filled blocks of HOLE_BLOCK bytes are
+ * skipped over when the output can seek.
+ */
+#define STREAM_WRITE_BUFFER (1024*1024)
+#define HOLE_BLOCK (1024*16)
+
 struct filtered_istream {
 	struct git_istream *upstream;
 	struct stream_filter *filter;
@@ -121,7 +135,8 @@ static enum input_source istream_source(const unsigned char *sha1,
 	case OI_LOOSE:
 		return loose;
 	case OI_PACKED:
-		if (!oi->u.packed.is_delta && big_file_threshold < size)
+		if (!oi->u.packed.is_delta &&
+		    (big_file_threshold < size || STREAM_INCORE_MAX < size))
 			return pack_non_delta;
 		/* fallthru */
 	default:
@@ -497,6 +512,31 @@ static open_method_decl(incore)
  * Users of streaming interface
  ****************************************************************/
 
+static int is_hole(const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (buf[i])
+			return 0;
+	return 1;
+}
+
+/*
+ * Reserve the blocks of an output file of known size, so that a large
+ * file is not fragmented as it is written.  Failing to do so is not
+ * an error: not all file systems support it.
+ */
+static void preallocate(int fd, unsigned long size)
+{
+#ifdef HAVE_FALLOCATE
+	if (fallocate(fd, 0, 0, size) && errno != EOPNOTSUPP &&
+	    errno != ENOSYS)
+		warning("unable to preallocate %lu bytes: %s",
+			size, strerror(errno));
+#endif
+}
+
 int stream_blob_to_fd(int fd, unsigned const char *sha1, struct stream_filter *filter,
 		      int can_seek)
 {
@@ -505,42 +545,71 @@ int stream_blob_to_fd(int fd, unsigned const char *sha1, struct stream_filter *f
 	unsigned long sz;
 	ssize_t kept = 0;
 	int result = -1;
+	char small_buf[HOLE_BLOCK], *buf = small_buf;
+	size_t bufsize = sizeof(small_buf);
 
-	st = open_istream(sha1, &type, &sz, filter);
+	st = open_istream(sha1, &type, &sz, NULL);
 	if (!st) {
 		if (filter)
 			free_stream_filter(filter);
 		return result;
 	}
+	if (filter) {
+		struct git_istream *nst = attach_stream_filter(st, filter);
+		if (!nst) {
+			close_istream(st);
+			return result;
+		}
+		st = nst;
+	}
 	if (type != OBJ_BLOB)
 		goto close_and_exit;
+
+	if (STREAM_INCORE_MAX < sz) {
+		bufsize = STREAM_WRITE_BUFFER;
+		buf = xmalloc(bufsize);
+		/* only an unfiltered blob tells us the size of the output */
+		if (can_seek && (!filter || is_null_stream_filter(filter)))
+			preallocate(fd, sz);
+	}
+
 	for (;;) {
-		char buf[1024 * 16];
-		ssize_t wrote, holeto;
-		ssize_t readlen = read_istream(st, buf, sizeof(buf));
+		ssize_t wrote, pos, end;
+		ssize_t readlen = read_istream(st, buf, bufsize);
 
 		if (readlen < 0)
 			goto close_and_exit;
 		if (!readlen)
 			break;
-		if (can_seek && sizeof(buf) == readlen) {
-			for (holeto = 0; holeto < readlen; holeto++)
-				if (buf[holeto])
+
+		for (pos = 0; pos < readlen; pos = end) {
+			if (can_seek) {
+				while (pos + HOLE_BLOCK <= readlen &&
+				       is_hole(buf + pos, HOLE_BLOCK)) {
+					kept += HOLE_BLOCK;
+					pos += HOLE_BLOCK;
+				}
+				if (pos == readlen)
 					break;
-			if (readlen == holeto) {
-				kept += holeto;
-				continue;
 			}
-		}
 
-		if (kept && lseek(fd, kept, SEEK_CUR) == (off_t) -1)
-			goto close_and_exit;
-		else
-			kept = 0;
-		wrote = write_in_full(fd, buf, readlen);
-
-		if (wrote != readlen)
-			goto close_and_exit;
+			/* write up to the next hole in one go */
+			end = pos + HOLE_BLOCK;
+			while (can_seek && end + HOLE_BLOCK <= readlen &&
+			       !is_hole(buf + end, HOLE_BLOCK))
+				end += HOLE_BLOCK;
+			if (!can_seek || end > readlen)
+				end = readlen;
+
+			if (kept && lseek(fd, kept, SEEK_CUR) == (off_t) -1)
+				goto close_and_exit;
+			else
+				kept = 0;
+			wrote = write_in_full(fd, buf + pos, end - pos);
+
+			if (wrote != end - pos)
+				goto close_and_exit;
+		}
 	}
 	if (kept && (lseek(fd, kept - 1, SEEK_CUR) == (off_t) -1 ||
 		     xwrite(fd, "", 1) != 1))
@@ -549,5 +618,7 @@ int stream_blob_to_fd(int fd, unsigned const char *sha1, struct stream_filter *f
 
  close_and_exit:
 	close_istream(st);
+	if (buf != small_buf)
+		free(buf);
 	return result;
 }
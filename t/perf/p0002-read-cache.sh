@@ -11,4 +11,25 @@ test_perf "read_cache/discard_cache $count times" "
 	test-read-cache $count
 "
 
+for threads in 1 2 4 8
+do
+	test_expect_success "rewrite index for $threads threads" "
+		git config index.threads $threads &&
+		rm -f .git/index &&
+		git read-tree HEAD
+	"
+
+	test_perf "read_cache/discard_cache $count times ($threads threads)" "
+		test-read-cache $count
+	"
+done
+
+test_expect_success "skip the index checksum on read" "
+	git config index.verifyChecksum false
+"
+
+test_perf "read_cache/discard_cache $count times (no checksum)" "
+	test-read-cache $count
+"
+
 test_done
@@ -0,0 +1,28 @@
+#!/bin/sh
+
+test_description="Tests looking objects up among many loose objects"
+
+. ./perf-lib.sh
+
+test_perf_default_repo
+
+test_expect_success 'explode the objects' '
+	git repack -a -d -q &&
+	git rev-list --objects --all | cut -c1-40 >objects &&
+	git pack-objects -q --stdout <objects >all.pack &&
+	mv .git/objects/pack .git/objects/pack.old &&
+	mkdir .git/objects/pack &&
+	git unpack-objects -q <all.pack &&
+	rm -rf .git/objects/pack.old
+'
+
+test_perf 'log --oneline (abbreviations)' '
+	git log --oneline --raw >/dev/null
+'
+
+test_perf 'index-pack (collision checks)' '
+	git index-pack -o tmp.idx all.pack >/dev/null &&
+	rm -f tmp.idx
+'
+
+test_done
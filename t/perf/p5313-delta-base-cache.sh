@@ -0,0 +1,34 @@
+#!/bin/sh
+
+test_description="Tests reading objects from deep delta chains"
+
+. ./perf-lib.sh
+
+test_perf_default_repo
+
+test_expect_success 'repack with deep delta chains' '
+	git repack -a -d -f -q --depth=250 --window=250
+'
+
+test_perf 'log -p' '
+	git log -p >/dev/null
+'
+
+test_perf 'blame' '
+	git ls-files | head -n 10 |
+	while read path
+	do
+		git blame -- "$path" >/dev/null || return 1
+	done
+'
+
+test_perf 'cat-file --batch-all-objects --batch' '
+	git cat-file --batch-all-objects --batch >/dev/null
+'
+
+test_perf 'cat-file --batch-all-objects --batch (1 MiB cache)' '
+	git -c core.deltaBaseCacheLimit=1m \
+		cat-file --batch-all-objects --batch >/dev/null
+'
+
+test_done
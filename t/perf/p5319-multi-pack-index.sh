@@ -0,0 +1,55 @@
+#!/bin/sh
+
+test_description="Tests object lookup in many packs with a multi-pack index"
+
+. ./perf-lib.sh
+
+test_perf_default_repo
+
+test_expect_success 'split the objects into 500 packs' '
+	git repack -a -d -q &&
+	git rev-list --objects --all | cut -c1-40 >objects &&
+	# look them up in an order unrelated to the packs they are in
+	sort objects >lookup &&
+	sed "s/.\$/0/" lookup >missing &&
+	per=$(( ($(wc -l <objects) + 499) / 500 )) &&
+	split -l $per objects chunk. &&
+	mkdir packs &&
+	for chunk in chunk.*
+	do
+		git pack-objects -q packs/pack <$chunk >/dev/null || return 1
+	done &&
+	rm -f .git/objects/pack/* chunk.* &&
+	mv packs/* .git/objects/pack/ &&
+	test $(ls .git/objects/pack/*.pack | wc -l) -ge 400
+'
+
+test_perf 'cat-file --batch-check (500 packs)' '
+	git cat-file --batch-check <lookup >/dev/null
+'
+
+test_perf 'cat-file --batch-check of missing objects (500 packs)' '
+	git cat-file --batch-check <missing >/dev/null
+'
+
+test_perf 'rev-list --objects --all (500 packs)' '
+	git rev-list --objects --all >/dev/null
+'
+
+test_expect_success 'write the multi-pack index' '
+	git multi-pack-index write
+'
+
+test_perf 'cat-file --batch-check (multi-pack index)' '
+	git cat-file --batch-check <lookup >/dev/null
+'
+
+test_perf 'cat-file --batch-check of missing objects (multi-pack index)' '
+	git cat-file --batch-check <missing >/dev/null
+'
+
+test_perf 'rev-list --objects --all (multi-pack index)' '
+	git rev-list --objects --all >/dev/null
+'
+
+test_done
@@ -0,0 +1,104 @@
+#!/bin/sh
+
+test_description='long ignore files give the same answers as short ones'
+
+. ./test-lib.sh
+
+# Long exclude files are indexed when they are read, while patterns
+# given with --exclude are always scanned one by one; both have to
+# agree on which is the last pattern that matches.
+test_ignored_agrees () {
+	git ls-files "$@" -X .git/patterns >.git/expect &&
+	git ls-files "$@" $(sed -e "s/^/--exclude=/" .git/patterns) >.git/actual &&
+	test_cmp .git/expect .git/actual
+}
+
+test_expect_success 'setup' '
+	for i in 0 1 2 3 4 5 6 7 8 9
+	do
+		mkdir -p dir$i/sub build$i/gen src$i &&
+		>dir$i/file$i.txt &&
+		>dir$i/sub/file$i.o &&
+		>dir$i/sub/keep$i.o &&
+		>build$i/gen/out$i.c &&
+		>build$i/gen/Out$i.C &&
+		>build$i/readme &&
+		>src$i/main$i.c &&
+		>src$i/main$i.c.orig &&
+		>src$i/test$i.log || return 1
+	done &&
+	cat >.git/patterns <<-\EOF &&
+	*.o
+	!keep3.o
+	file1.txt
+	file2.txt
+	!dir2/file2.txt
+	*.orig
+	/build1/
+	/build2/gen/out*.c
+	!/build2/gen/out2.c
+	build3/gen/
+	/src4/main4.c
+	src5/*.log
+	*5.c
+	!main*.c
+	dir6
+	!dir6/sub/keep6.o
+	sub/
+	FILE7.TXT
+	*.C
+	!/build8/gen/Out8.C
+	**/readme
+	!build9/readme
+	EOF
+	test_line_count -gt 16 .git/patterns
+'
+
+test_expect_success 'ignored files agree with a short list' '
+	test_ignored_agrees -o -i &&
+	grep "^dir1/file1.txt$" .git/actual &&
+	! grep "^dir2/file2.txt$" .git/actual &&
+	grep "^dir4/sub/keep4.o$" .git/actual &&
+	grep "^build3/gen/out3.c$" .git/actual &&
+	! grep "^build2/gen/out2.c$" .git/actual &&
+	grep "^build5/gen/out5.c$" .git/actual &&
+	! grep "^src4/main4.c$" .git/actual &&
+	! grep "^src5/main5.c$" .git/actual &&
+	! grep "^dir7/file7.txt$" .git/actual &&
+	grep "^build8/readme$" .git/actual &&
+	! grep "^build9/readme$" .git/actual
+'
+
+test_expect_success 'untracked files agree with a short list' '
+	test_ignored_agrees -o &&
+	grep "^src5/main5.c$" .git/actual &&
+	! grep "^src5/test5.log$" .git/actual
+'
+
+test_expect_success 'directories agree with a short list' '
+	test_ignored_agrees -o -i --directory &&
+	grep "^build1/$" .git/actual &&
+	grep "^dir6/$" .git/actual &&
+	! grep "^dir6/sub/keep6.o$" .git/actual
+'
+
+test_expect_success 'case-insensitive matching agrees with a short list' '
+	test_config core.ignorecase true &&
+	test_ignored_agrees -o -i &&
+	grep "^dir7/file7.txt$" .git/actual &&
+	grep "^build0/gen/out0.c$" .git/actual
+'
+
+test_expect_success 'status honours a long ignore file' '
+	cp .git/patterns .ptp-gitignore &&
+	echo .ptp-gitignore >>.ptp-gitignore &&
+	git ls-files -o --exclude-standard >.git/expect &&
+	git ls-files -o --exclude-from=.git/patterns \
+		--exclude=.ptp-gitignore >.git/actual &&
+	test_cmp .git/expect .git/actual &&
+	git status --porcelain -uall --ignored >.git/status &&
+	grep "^!! dir1/file1.txt$" .git/status &&
+	grep "^?? dir2/file2.txt$" .git/status
+'
+
+test_done
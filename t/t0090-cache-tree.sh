@@ -252,4 +252,79 @@ test_expect_success 'switching trees does not invalidate shared index' '
 	test_cmp before after
 '
 
+make_many_trees () {
+	git init "$1" &&
+	(
+		cd "$1" &&
+		for i in 0 1 2 3 4 5 6 7 8 9
+		do
+			for j in 0 1 2 3 4 5 6 7 8 9
+			do
+				mkdir -p d$i/e$j &&
+				echo $i$j >d$i/e$j/f || return 1
+			done
+		done &&
+		echo top >top &&
+		git add .
+	)
+}
+
+test_expect_success 'many trees are rebuilt in parallel and packed' '
+	make_many_trees serial &&
+	GIT_TEST_CACHE_TREE_THREADS=1 git -C serial write-tree >expect &&
+	make_many_trees parallel &&
+	GIT_TRACE_PERFORMANCE="$(pwd)/trace" GIT_TEST_CACHE_TREE_THREADS=4 \
+		git -C parallel write-tree >actual &&
+	test_cmp expect actual &&
+	grep "cache_tree_update: 0 trees reused, 111 rebuilt" trace &&
+	git -C parallel count-objects -v >count &&
+	grep "^packs: 1" count &&
+	git -C parallel fsck
+'
+
+test_expect_success 'unchanged trees are reused' '
+	(
+		cd parallel &&
+		echo changed >d0/e0/f &&
+		git add d0/e0/f &&
+		rm -f ../trace &&
+		GIT_TRACE_PERFORMANCE="$(pwd)/../trace" git write-tree
+	) &&
+	grep "cache_tree_update: 108 trees reused, 3 rebuilt" trace
+'
+
+test_expect_success 'checkout and merge keep the trees they did not touch' '
+	(
+		cd parallel &&
+		git commit -q -m base &&
+		git checkout -q -b side &&
+		echo side >d1/e1/f &&
+		git commit -q -a -m side &&
+		rm -f ../trace &&
+		GIT_TRACE_PERFORMANCE="$(pwd)/../trace" \
+		GIT_TEST_CHECK_CACHE_TREE=1 git checkout -q master &&
+		grep "cache_tree_update: 108 trees reused, 3 rebuilt" ../trace &&
+		rm -f ../trace &&
+		GIT_TRACE_PERFORMANCE="$(pwd)/../trace" \
+		GIT_TEST_CHECK_CACHE_TREE=1 git merge -q side &&
+		grep "cache_tree_update: 108 trees reused, 3 rebuilt" ../trace &&
+		test-dump-cache-tree >dump &&
+		! grep invalid dump
+	)
+'
+
+test_expect_success 'checkout does not read the trees the index already has' '
+	(
+		cd parallel &&
+		git checkout -q side &&
+		rm -f ../trace &&
+		GIT_TRACE="$(pwd)/../trace" \
+		GIT_TEST_CHECK_CACHE_TREE=1 git checkout -q HEAD~1 &&
+		git diff --quiet side~1 &&
+		git diff --cached --quiet side~1 &&
+		git checkout -q side
+	) &&
+	grep "unpack-trees: 99 entries unpacked from the cache tree" trace
+'
+
 test_done
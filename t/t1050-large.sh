@@ -64,6 +64,26 @@ test_expect_success 'checkout a large file' '
 	test_cmp large1 another
 '
 
+test_expect_success 'checkout streams packed blobs below bigFileThreshold' '
+	(
+		sane_unset GIT_ALLOC_LIMIT &&
+		{
+			test-genrandom mid 700000 &&
+			printf "%1000000s" "" | tr " " "\000" &&
+			test-genrandom mid2 700000
+		} >streamed &&
+		blob=$(git -c core.bigfilethreshold=512m hash-object -w streamed) &&
+		echo $blob |
+		git -c core.bigfilethreshold=512m pack-objects .git/objects/pack/pack &&
+		rm .git/objects/$(echo $blob | sed "s|^..|&/|")
+	) &&
+	blob=$(git hash-object streamed) &&
+	git update-index --add --cacheinfo 100644 $blob streamed-copy &&
+	GIT_ALLOC_LIMIT=1500k git -c core.bigfilethreshold=512m checkout streamed-copy &&
+	test_cmp streamed streamed-copy &&
+	git rm -q --cached streamed-copy
+'
+
 test_expect_success 'packsize limit' '
 	test_create_repo mid &&
 	(
@@ -0,0 +1,64 @@
+#!/bin/sh
+
+test_description='syncing the new loose objects of a command at once
+
+With core.fsyncObjectFiles, "git add" and the tree writing of "git
+commit" leave new loose objects under temporary names until they have
+all been synced, and still find them meanwhile.'
+
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	git config core.fsyncObjectFiles true &&
+	mkdir -p a/b c &&
+	for i in $(test_seq 1 50)
+	do
+		echo "a $i" >a/file$i &&
+		echo "b $i" >a/b/file$i &&
+		echo "c $i" >c/file$i || return 1
+	done &&
+	echo same >a/same1 &&
+	echo same >a/same2 &&
+	test-chmtime =-60 a/* a/b/* c/*
+'
+
+test_expect_success 'add syncs the new objects together' '
+	GIT_TRACE="$(pwd)/trace" GIT_TEST_ADD_THREADS=4 git add a c &&
+	grep "parallel add: 152 of 152 files hashed in 4 threads" trace &&
+	grep "loose object batch: 151 objects, synced with" trace &&
+	find .git/objects -name "tmp_obj_*" >tmp &&
+	test_must_be_empty tmp &&
+	for f in a/file1 a/b/file50 c/file7 a/same2
+	do
+		git cat-file -e $(git hash-object $f) || return 1
+	done
+'
+
+test_expect_success 'trees written by commit see each other' '
+	rm trace &&
+	GIT_TRACE="$(pwd)/trace" git commit -q -m one &&
+	grep "loose object batch: 4 objects, synced with" trace &&
+	git fsck --strict >out 2>&1 &&
+	test_must_be_empty out &&
+	git ls-tree -r HEAD >tree &&
+	test_line_count = 152 tree
+'
+
+test_expect_success 'objects in the repository are not written again' '
+	echo new >a/new &&
+	echo "a 1" >a/old &&
+	rm trace &&
+	GIT_TRACE="$(pwd)/trace" git add a &&
+	grep "loose object batch: 1 objects, synced with" trace &&
+	git cat-file -e $(git hash-object a/new)
+'
+
+test_expect_success 'no batch without core.fsyncObjectFiles' '
+	echo other >a/other &&
+	rm trace &&
+	GIT_TRACE="$(pwd)/trace" git -c core.fsyncObjectFiles=false add a &&
+	! grep "loose object batch" trace &&
+	git cat-file -e $(git hash-object a/other)
+'
+
+test_done
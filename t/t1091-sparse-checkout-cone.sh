@@ -0,0 +1,109 @@
+#!/bin/sh
+
+test_description='sparse checkout with cone patterns'
+
+. ./test-lib.sh
+
+list_checked_out () {
+	git ls-files -t | sed -n "s/^H //p"
+}
+
+test_expect_success 'setup' '
+	mkdir -p a/b/c a/d e &&
+	for f in top a/file a/b/file a/b/c/file a/d/file e/file
+	do
+		echo $f >$f || return 1
+	done &&
+	git add . &&
+	git commit -q -m initial &&
+	git config core.sparseCheckout true &&
+	git config core.sparseCheckoutCone true
+'
+
+test_expect_success 'top-level files only' '
+	cat >.git/info/sparse-checkout <<-\EOF &&
+	/*
+	!/*/
+	EOF
+	git read-tree -m -u HEAD &&
+	echo top >expect &&
+	list_checked_out >actual &&
+	test_cmp expect actual &&
+	test_path_is_missing a
+'
+
+test_expect_success 'a recursive directory brings the files of its parents' '
+	cat >.git/info/sparse-checkout <<-\EOF &&
+	/*
+	!/*/
+	/a/b/
+	EOF
+	git read-tree -m -u HEAD &&
+	cat >expect <<-\EOF &&
+	a/b/c/file
+	a/b/file
+	a/file
+	top
+	EOF
+	list_checked_out >actual &&
+	test_cmp expect actual &&
+	test_path_is_missing a/d &&
+	test_path_is_missing e
+'
+
+test_expect_success 'a parent directory without its subdirectories' '
+	cat >.git/info/sparse-checkout <<-\EOF &&
+	/*
+	!/*/
+	/a/
+	!/a/*/
+	/e/
+	EOF
+	git read-tree -m -u HEAD &&
+	cat >expect <<-\EOF &&
+	a/file
+	e/file
+	top
+	EOF
+	list_checked_out >actual &&
+	test_cmp expect actual &&
+	test_path_is_missing a/b
+'
+
+test_expect_success 'cones give the same checkout as plain patterns' '
+	cat >.git/info/sparse-checkout <<-\EOF &&
+	/*
+	!/*/
+	/a/
+	!/a/*/
+	/a/d/
+	EOF
+	git read-tree -m -u HEAD &&
+	list_checked_out >cone &&
+	git -c core.sparseCheckoutCone=false read-tree -m -u HEAD &&
+	list_checked_out >plain &&
+	test_cmp cone plain
+'
+
+test_expect_success '/* alone checks out everything' '
+	echo "/*" >.git/info/sparse-checkout &&
+	git read-tree -m -u HEAD &&
+	git ls-files >expect &&
+	list_checked_out >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'other patterns turn cone mode off' '
+	cat >.git/info/sparse-checkout <<-\EOF &&
+	/*
+	!/*/
+	*file
+	EOF
+	git read-tree -m -u HEAD 2>err &&
+	test_i18ngrep "disabling cone pattern matching" err &&
+	git ls-files >expect &&
+	list_checked_out >actual &&
+	test_cmp expect actual
+'
+
+test_done
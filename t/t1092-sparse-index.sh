@@ -0,0 +1,116 @@
+#!/bin/sh
+
+test_description='sparse index: directories outside the sparse checkout as one entry'
+
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	mkdir -p deep/deeper out/sub in &&
+	echo a >deep/a &&
+	echo b >deep/deeper/b &&
+	echo c >out/c &&
+	echo d >out/sub/d &&
+	echo e >in/e &&
+	echo f >f &&
+	git add . &&
+	git commit -q -m initial &&
+	git config core.sparseCheckout true &&
+	git config index.sparse true &&
+	cat >.git/info/sparse-checkout <<-\EOF &&
+	/f
+	/in/
+	/deep/a
+	EOF
+	git read-tree -m -u HEAD
+'
+
+test_expect_success 'directories outside the sparse checkout are folded' '
+	cat >expect <<-EOF &&
+	deep/a
+	deep/deeper/
+	f
+	in/e
+	out/
+	EOF
+	git ls-files --sparse >actual &&
+	test_cmp expect actual &&
+	git ls-files -s --sparse >actual &&
+	grep "^040000 $(git rev-parse HEAD:out) 0	out/\$" actual &&
+	git ls-files --sparse out/ >actual &&
+	git ls-tree -r --name-only HEAD out/ >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'other commands see every file' '
+	git ls-files >actual &&
+	git ls-tree -r --name-only HEAD >expect &&
+	test_cmp expect actual &&
+	git diff-index --cached HEAD >actual &&
+	test_must_be_empty actual &&
+	git status --porcelain -uno >actual &&
+	test_must_be_empty actual
+'
+
+test_expect_success 'write-tree uses the tree of the directory entries' '
+	git rev-parse HEAD^{tree} >expect &&
+	git write-tree >actual &&
+	test_cmp expect actual &&
+	git write-tree --prefix=out/sub/ >actual &&
+	git rev-parse HEAD:out/sub >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'updating a file in a folded directory expands the index' '
+	git update-index --no-skip-worktree out/c &&
+	mkdir out &&
+	echo changed >out/c &&
+	git update-index out/c &&
+	cat >expect <<-\EOF &&
+	deep/a
+	deep/deeper/
+	f
+	in/e
+	out/c
+	out/sub/
+	EOF
+	git ls-files --sparse >actual &&
+	test_cmp expect actual &&
+	echo "M  out/c" >expect &&
+	git status --porcelain -uno >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a commit keeps the index sparse' '
+	git commit -q -m changed &&
+	cat >expect <<-\EOF &&
+	deep/a
+	deep/deeper/
+	f
+	in/e
+	out/c
+	out/sub/
+	EOF
+	git ls-files --sparse >actual &&
+	test_cmp expect actual &&
+	git diff-index --cached HEAD >actual &&
+	test_must_be_empty actual
+'
+
+test_expect_success 'checking out another commit' '
+	git checkout -q HEAD~1 &&
+	test_path_is_missing out/c &&
+	git diff-index --cached HEAD~0 >actual &&
+	test_must_be_empty actual &&
+	git ls-files --sparse >actual &&
+	grep "^out/$" actual &&
+	git checkout -q master
+'
+
+test_expect_success 'index.sparse=false writes every file again' '
+	git -c index.sparse=false update-index --force-remove f &&
+	git ls-files --sparse >actual &&
+	! grep /\$ actual &&
+	git reset -q HEAD
+'
+
+test_done
@@ -473,4 +473,22 @@ test_expect_success 'fsck --connectivity-only' '
 	)
 '
 
+test_expect_success 'fsck verifies the index checksum even when reads skip it' '
+	rm -rf bad-index &&
+	git init bad-index &&
+	(
+		cd bad-index &&
+		test_commit one &&
+		size=$(wc -c <.git/index) &&
+		printf "%020d" 0 |
+		dd of=.git/index bs=1 seek=$(($size - 20)) conv=notrunc &&
+		test_must_fail git ls-files &&
+		git -c index.verifyChecksum=false ls-files >actual &&
+		echo one.t >expect &&
+		test_cmp expect actual &&
+		git config index.verifyChecksum false &&
+		test_must_fail git fsck
+	)
+'
+
 test_done
@@ -273,6 +273,17 @@ test_expect_success 'rev-parse --disambiguate' '
 	test "$(sed -e "s/^\(.........\).*/\1/" actual | sort -u)" = 000000000
 '
 
+test_expect_success 'rev-parse --disambiguate sees loose objects of alternates' '
+	git clone -q -s . shared &&
+	(
+		cd shared &&
+		git rev-parse --disambiguate=000000000 >../actual.shared
+	) &&
+	sort actual >expect &&
+	sort actual.shared >actual.sorted &&
+	test_cmp expect actual.sorted
+'
+
 test_expect_success 'ambiguous 40-hex ref' '
 	TREE=$(git mktree </dev/null) &&
 	REF=`git rev-parse HEAD` &&
@@ -73,4 +73,55 @@ test_expect_success 'GIT_INDEX_VERSION takes precedence over config' '
 	)
 '
 
+test_index_threads () {
+	version=$1
+	test_expect_success "index v$version with threads round-trips" "
+		rm -f .git/index &&
+		git -c index.version=$version -c index.threads=3 add dir &&
+		grep IEOT .git/index >/dev/null &&
+		grep EOIE .git/index >/dev/null &&
+		git -c index.threads=1 ls-files -s >expect &&
+		git -c index.threads=3 ls-files -s >actual &&
+		test_cmp expect actual &&
+		git -c index.threads=2 ls-files -s >actual &&
+		test_cmp expect actual &&
+		test_line_count = 30 actual
+	"
+}
+
+test_expect_success 'setup for threaded index reading' '
+	sane_unset GIT_INDEX_VERSION &&
+	sane_unset GIT_TEST_INDEX_THREADS &&
+	git config --unset-all index.version &&
+	mkdir -p dir/sub &&
+	for i in 0 1 2 3 4 5 6 7 8 9
+	do
+		echo $i >dir/file$i &&
+		echo $i >dir/sub/file$i &&
+		echo $i >dir/sub/long-file-name-$i || return 1
+	done
+'
+
+test_index_threads 2
+test_index_threads 4
+
+test_expect_success 'single-threaded write has no offset table' '
+	rm -f .git/index &&
+	git -c index.threads=1 add dir &&
+	! grep IEOT .git/index >/dev/null &&
+	git -c index.threads=3 ls-files -s >actual &&
+	test_line_count = 30 actual
+'
+
+test_expect_success 'v4 name that strips more than the previous name' '
+	rm -f .git/index &&
+	git -c index.version=4 -c index.threads=1 add a &&
+	# the prefix length of the first entry, right after its flags
+	printf "\\005" |
+	dd of=.git/index bs=1 seek=74 conv=notrunc 2>/dev/null &&
+	test_must_fail git -c index.verifyChecksum=false \
+		-c index.threads=1 ls-files 2>err &&
+	grep "malformed name field" err
+'
+
 test_done
@@ -7,6 +7,13 @@ test_description='split index mode tests'
 # We need total control of index splitting here
 sane_unset GIT_TEST_SPLIT_INDEX
 
+# The index checksums below do not account for an untracked cache
+git config core.untrackedCache false
+
+# Nor do the expected contents allow for a new shared index to be
+# written behind our back
+git config splitIndex.maxPercentChange 100
+
 test_expect_success 'enable split index' '
 	git update-index --split-index &&
 	test-dump-split-index .git/index >actual &&
@@ -200,4 +207,133 @@ EOF
 	test_cmp expect actual
 '
 
+test_expect_success 'set core.splitIndex config variable to true' '
+	git config core.splitIndex true &&
+	: >three &&
+	git update-index --add three &&
+	git ls-files --stage >ls-files.actual &&
+	cat >ls-files.expect <<EOF &&
+100644 e69de29bb2d1d6434b8b29ae775ad8c2e48c5391 0	one
+100644 e69de29bb2d1d6434b8b29ae775ad8c2e48c5391 0	three
+100644 e69de29bb2d1d6434b8b29ae775ad8c2e48c5391 0	two
+EOF
+	test_cmp ls-files.expect ls-files.actual &&
+	BASE=$(test-dump-split-index .git/index | grep "^base") &&
+	test-dump-split-index .git/index | sed "/^own/d" >actual &&
+	cat >expect <<EOF &&
+$BASE
+replacements:
+deletions:
+EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'set core.splitIndex config variable to false' '
+	git config core.splitIndex false &&
+	git update-index --force-remove three &&
+	git ls-files --stage >ls-files.actual &&
+	cat >ls-files.expect <<EOF &&
+100644 e69de29bb2d1d6434b8b29ae775ad8c2e48c5391 0	one
+100644 e69de29bb2d1d6434b8b29ae775ad8c2e48c5391 0	two
+EOF
+	test_cmp ls-files.expect ls-files.actual &&
+	test-dump-split-index .git/index | sed "/^own/d" >actual &&
+	cat >expect <<EOF &&
+not a split index
+EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'splitIndex.minEntries splits large indexes' '
+	git config --unset core.splitIndex &&
+	git config splitIndex.minEntries 3 &&
+	: >three &&
+	git update-index --add three &&
+	echo "not a split index" >expect &&
+	test-dump-split-index .git/index | sed "/^own/d" >actual &&
+	test_cmp expect actual &&
+	: >four &&
+	git update-index --add four &&
+	test-dump-split-index .git/index | sed "/^own/d" >actual &&
+	BASE=$(grep "^base" actual) &&
+	cat >expect <<EOF &&
+$BASE
+replacements:
+deletions:
+EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'splitIndex.maxPercentChange writes a new shared index' '
+	git config --unset splitIndex.maxPercentChange &&
+	BASE=$(test-dump-split-index .git/index | grep "^base") &&
+	: >five &&
+	git update-index --add five &&
+	test-dump-split-index .git/index | sed "/^own/d" >actual &&
+	cat >expect <<EOF &&
+$BASE
+100644 e69de29bb2d1d6434b8b29ae775ad8c2e48c5391 0	five
+replacements:
+deletions:
+EOF
+	test_cmp expect actual &&
+	: >six &&
+	git update-index --add six &&
+	test-dump-split-index .git/index | sed "/^own/d" >actual &&
+	NEWBASE=$(grep "^base" actual) &&
+	test "$BASE" != "$NEWBASE" &&
+	cat >expect <<EOF &&
+$NEWBASE
+replacements:
+deletions:
+EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'splitIndex.maxPercentChange of 0 always writes a shared index' '
+	git config splitIndex.maxPercentChange 0 &&
+	BASE=$(test-dump-split-index .git/index | grep "^base") &&
+	git update-index --force-remove six &&
+	test-dump-split-index .git/index | sed "/^own/d" >actual &&
+	NEWBASE=$(grep "^base" actual) &&
+	test "$BASE" != "$NEWBASE" &&
+	cat >expect <<EOF &&
+$NEWBASE
+replacements:
+deletions:
+EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'splitIndex.sharedIndexExpire removes unused shared indexes' '
+	git config splitIndex.sharedIndexExpire never &&
+	git update-index --force-remove five &&
+	ls .git/sharedindex.* >actual &&
+	test $(wc -l <actual) -gt 2 &&
+	git config splitIndex.sharedIndexExpire now &&
+	git update-index --force-remove four &&
+	ls .git/sharedindex.* >actual &&
+	test_line_count = 1 actual &&
+	BASE=$(test-dump-split-index .git/index | sed -n "s/^base //p") &&
+	echo .git/sharedindex.$BASE >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'the shared index in use is kept fresh' '
+	git config --unset splitIndex.sharedIndexExpire &&
+	git config splitIndex.maxPercentChange 100 &&
+	INUSE=$(cat actual) &&
+	OLD=.git/sharedindex.0000000000000000000000000000000000000000 &&
+	cp $INUSE $OLD &&
+	test-chmtime =-1300000 $INUSE $OLD &&
+	: >seven &&
+	git update-index --add seven &&
+	test-chmtime -v +0 $INUSE >mtime &&
+	test $(cut -f1 mtime) -gt $(($(date +%s) - 1000)) &&
+	git update-index --split-index &&
+	ls .git/sharedindex.* >actual &&
+	test_line_count = 2 actual &&
+	! grep $OLD actual
+'
+
 test_done
@@ -0,0 +1,139 @@
+#!/bin/sh
+
+test_description='appending small index updates to a journal'
+
+. ./test-lib.sh
+
+# Status would record untracked files in the index, which takes a
+# full write; keep it out of the way.
+test_expect_success 'setup' '
+	git config core.untrackedCache false &&
+	for i in 0 1 2 3 4 5 6 7 8 9
+	do
+		mkdir dir$i &&
+		for j in 0 1 2 3 4 5 6 7 8 9
+		do
+			echo $i$j >dir$i/file$j || return 1
+		done
+	done &&
+	git add . &&
+	git commit -q -m initial &&
+	git config index.journal true
+'
+
+test_expect_success 'adding a file appends to the journal' '
+	cp .git/index index.before &&
+	echo changed >dir1/file1 &&
+	git add dir1/file1 &&
+	test_cmp_bin index.before .git/index &&
+	test -s .git/index.journal &&
+	echo "M  dir1/file1" >expect &&
+	git status --porcelain -uno >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'removals and additions are replayed' '
+	git rm -q --cached dir2/file2 &&
+	echo new >dir3/new &&
+	git add dir3/new &&
+	test_cmp_bin index.before .git/index &&
+	cat >expect <<-\EOF &&
+	M	dir1/file1
+	D	dir2/file2
+	A	dir3/new
+	EOF
+	git diff --cached --name-status >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'the journal gives the same trees as a full index' '
+	git write-tree >expect &&
+	git -c index.journal=false update-index --refresh &&
+	git -c index.journal=false update-index --force-remove dir3/new &&
+	git -c index.journal=false update-index --add dir3/new &&
+	! test_cmp_bin index.before .git/index &&
+	git write-tree >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a stale journal is ignored' '
+	test -s .git/index.journal &&
+	git ls-files -s >expect &&
+	git ls-files -s >actual &&
+	test_cmp expect actual &&
+	echo more >dir4/file4 &&
+	cp .git/index index.before &&
+	git add dir4/file4 &&
+	test_cmp_bin index.before .git/index &&
+	echo "100644 $(git hash-object dir4/file4) 0	dir4/file4" >expect &&
+	git ls-files -s dir4/file4 >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'a torn record is ignored and overwritten' '
+	git ls-files -s >expect &&
+	printf "\\000\\000\\001\\000garbage" >>.git/index.journal &&
+	git ls-files -s >actual &&
+	test_cmp expect actual &&
+	echo torn >dir5/file5 &&
+	git add dir5/file5 &&
+	test_cmp_bin index.before .git/index &&
+	git ls-files -s dir5/file5 >actual &&
+	grep "$(git hash-object dir5/file5)" actual
+'
+
+test_expect_success 'a racily clean entry is smudged in the journal' '
+	echo racy >dir6/file6 &&
+	git add dir6/file6 &&
+	test_cmp_bin index.before .git/index &&
+	echo RACY >dir6/file6 &&
+	test-chmtime =+0 dir6/file6 &&
+	echo "M  dir6/file6" >expect &&
+	git status --porcelain -uno | grep dir6 >actual &&
+	echo more >dir6/file7 &&
+	git add dir6/file7 &&
+	git diff --name-only >actual &&
+	echo dir6/file6 >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'the index is rewritten once the journal grows' '
+	for i in 0 1 2 3 4 5 6 7 8 9
+	do
+		echo grow$i >dir7/file$i &&
+		git add dir7/file$i || return 1
+	done &&
+	! test_cmp_bin index.before .git/index &&
+	git diff --name-only >actual &&
+	echo dir6/file6 >expect &&
+	test_cmp expect actual &&
+	git diff --cached --name-only >actual &&
+	test_line_count = 17 actual
+'
+
+test_expect_success 'commit writes the whole index' '
+	git add dir6/file6 &&
+	cp .git/index index.before &&
+	git commit -q -m second &&
+	! test_cmp_bin index.before .git/index &&
+	git diff --cached --exit-code &&
+	git diff --exit-code
+'
+
+test_expect_success 'disabling the journal folds it into the index' '
+	echo last >dir8/file8 &&
+	cp .git/index index.before &&
+	git add dir8/file8 &&
+	test_cmp_bin index.before .git/index &&
+	echo "M  dir8/file8" >expect &&
+	git -c index.journal=false status --porcelain -uno >actual &&
+	test_cmp expect actual &&
+	echo "M  dir9/file9" >>expect &&
+	echo last >dir9/file9 &&
+	git -c index.journal=false add dir9/file9 &&
+	! test_cmp_bin index.before .git/index &&
+	git -c index.journal=false status --porcelain -uno >actual &&
+	test_cmp expect actual
+'
+
+test_done
@@ -0,0 +1,133 @@
+#!/bin/sh
+
+test_description='parallel checkout
+
+Files written by several threads must come out the same as those
+written one after the other, with their stat data in the index.'
+
+. ./test-lib.sh
+
+# compare the work tree of $1 with that of $2, and check that the index
+# of $1 records the stat data of every file
+check_checkout () {
+	(cd "$2" && find . -name .git -prune -o -print | sort) >expect.files &&
+	(cd "$1" && find . -name .git -prune -o -print | sort) >actual.files &&
+	test_cmp expect.files actual.files &&
+	for f in $(grep -v "^\.$" actual.files)
+	do
+		if test -f "$2/$f"
+		then
+			test_cmp "$2/$f" "$1/$f" || return 1
+		fi
+	done &&
+	git -C "$1" diff-files >out &&
+	test_must_be_empty out
+}
+
+test_expect_success 'setup' '
+	mkdir -p a/b c &&
+	for i in $(test_seq 1 150)
+	do
+		echo "a $i" >a/file$i &&
+		echo "b $i" >a/b/file$i &&
+		printf "line one\nline $i\n" >c/text$i.txt || return 1
+	done &&
+	echo "\$Id\$" >ident &&
+	echo "big file" >big &&
+	echo "filtered" >filtered &&
+	echo "exec" >exec &&
+	chmod +x exec &&
+	cat >.gitattributes <<-\EOF &&
+	*.txt eol=crlf
+	ident ident
+	filtered filter=rot
+	EOF
+	git add . &&
+	test_tick &&
+	git commit -m one &&
+	git tag one &&
+	for i in $(test_seq 1 50)
+	do
+		echo "changed $i" >a/file$((3 * $i)) || return 1
+	done &&
+	git rm -q -r a/b &&
+	echo "a/b is a file" >a/b &&
+	git add . &&
+	test_tick &&
+	git commit -m two &&
+	git tag two
+'
+
+test_expect_success 'clone writes files in parallel' '
+	GIT_TEST_CHECKOUT_THREADS=1 git clone -q \
+		-c "filter.rot.smudge=tr a-z n-za-m" \
+		-c "filter.rot.clean=tr a-z n-za-m" . serial &&
+	GIT_TRACE="$(pwd)/trace" GIT_TEST_CHECKOUT_THREADS=4 git clone -q \
+		-c "filter.rot.smudge=tr a-z n-za-m" \
+		-c "filter.rot.clean=tr a-z n-za-m" . parallel &&
+	grep "parallel checkout: 305 files in 4 threads" trace &&
+	check_checkout parallel serial &&
+	grep "^line 7$(printf "\r")\$" parallel/c/text7.txt &&
+	grep "^\\\$Id: [0-9a-f]* \\\$\$" parallel/ident &&
+	test "$(cat parallel/filtered)" = "$(cat serial/filtered)"
+'
+
+test_expect_success POSIXPERM 'executable bit is kept' '
+	test -x parallel/exec &&
+	! test -x parallel/a/file1
+'
+
+test_expect_success 'branch switch with directory/file changes' '
+	(
+		cd serial &&
+		GIT_TEST_CHECKOUT_THREADS=1 git checkout -q one
+	) &&
+	(
+		cd parallel &&
+		GIT_TEST_CHECKOUT_THREADS=4 git checkout -q one &&
+		test -d a/b
+	) &&
+	check_checkout parallel serial &&
+	(
+		cd serial &&
+		GIT_TEST_CHECKOUT_THREADS=1 git checkout -q master
+	) &&
+	(
+		cd parallel &&
+		GIT_TEST_CHECKOUT_THREADS=4 git checkout -q master &&
+		test -f a/b
+	) &&
+	check_checkout parallel serial
+'
+
+test_expect_success 'large blobs are streamed after the others' '
+	(
+		cd parallel &&
+		rm big a/file2 &&
+		GIT_TEST_CHECKOUT_THREADS=2 \
+			git -c core.bigFileThreshold=4 reset -q --hard &&
+		test "$(cat big)" = "big file"
+	) &&
+	check_checkout parallel serial
+'
+
+test_expect_success 'blobs in deep delta chains are read in parallel' '
+	mkdir d &&
+	test_seq 1 300 >d/base &&
+	for i in $(test_seq 1 150)
+	do
+		sed "s/^$i\$/changed $i/" d/base >d/file$i || return 1
+	done &&
+	git add d &&
+	test_tick &&
+	git commit -q -m three &&
+	git repack -a -d -q --depth=50 --window=50 &&
+	GIT_TEST_CHECKOUT_THREADS=1 git clone -q . serial-deltas &&
+	GIT_TRACE_OBJ_READ_LOCK="$(pwd)/obj-read-trace" GIT_TEST_CHECKOUT_THREADS=4 \
+		git clone -q . parallel-deltas &&
+	check_checkout parallel-deltas serial-deltas &&
+	# nothing was inflated or patched with the lock still held
+	grep "object read lock: [1-9][0-9]* unlocked, 0 locked" obj-read-trace
+'
+
+test_done
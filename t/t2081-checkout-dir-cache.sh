@@ -0,0 +1,53 @@
+#!/bin/sh
+
+test_description='checkout remembers the leading directories it made'
+
+. ./test-lib.sh
+
+test_expect_success 'setup' '
+	mkdir -p a/b/c &&
+	for i in 1 2 3 4 5
+	do
+		echo $i >a/b/c/$i || return 1
+	done &&
+	echo a >a/1 &&
+	echo b >a/b/1 &&
+	echo top >top &&
+	git add . &&
+	test_tick &&
+	git commit -m initial
+'
+
+test_expect_success 'clone checks each leading directory once' '
+	GIT_TRACE="$(pwd)/trace" git clone -q . clone &&
+	grep "checkout: 3 directories created, 3 checked, 11 checks skipped" trace &&
+	git -C clone diff-files >out &&
+	test_must_be_empty out &&
+	test_cmp a/b/c/5 clone/a/b/c/5
+'
+
+test_expect_success 'a directory removed in the way of a file is forgotten' '
+	git checkout -b file &&
+	git rm -q -r a/b &&
+	echo "now a file" >a/b &&
+	mkdir -p a/c &&
+	echo c >a/c/1 &&
+	git add a &&
+	test_tick &&
+	git commit -m "a/b is a file" &&
+	git checkout -q master &&
+	mkdir -p a/c/d &&
+	echo untracked >a/c/d/untracked &&
+	echo untracked >a/b/untracked &&
+	git checkout -f file &&
+	test "$(cat a/b)" = "now a file" &&
+	test "$(cat a/c/1)" = c &&
+	git diff-files >out &&
+	test_must_be_empty out &&
+	git checkout -f master &&
+	test_cmp clone/a/b/c/5 a/b/c/5 &&
+	git diff-files >out &&
+	test_must_be_empty out
+'
+
+test_done
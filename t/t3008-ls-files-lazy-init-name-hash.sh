@@ -0,0 +1,62 @@
+#!/bin/sh
+
+test_description='Test the lazy init name hash with various folder structures'
+
+. ./test-lib.sh
+
+paths='a a/b a/b/c a/b/c/d A/B/C/D a/b/c/file0 A/B/C/FILE0 A/b/C/f1
+	a/b/d a/x a/x/y a/x/y/z A/X/Y/Z/FILE9 e e/f e/f/g E/F/G/H sub
+	sub/dir sub/dir/file SUB/DIR missing MISSING/dir'
+
+test_expect_success 'setup' '
+	git config core.ignorecase true &&
+	for d in a/b/c a/b/d a/x/y/z e/f/g/h sub/dir
+	do
+		mkdir -p $d &&
+		for i in 0 1 2 3 4 5 6 7 8 9
+		do
+			echo $d/$i >$d/file$i || return 1
+		done
+	done &&
+	echo top >top &&
+	git add . &&
+	git commit -q -m initial
+'
+
+lookup () {
+	test-lazy-init-name-hash "$@" $paths
+}
+
+test_expect_success 'serial lookups' '
+	GIT_TEST_NAME_HASH_THREADS=1 lookup >expect &&
+	grep "^dir A/X/Y/Z/FILE9 -" expect &&
+	grep "^file A/X/Y/Z/FILE9 a/x/y/z/file9" expect &&
+	grep "^dir SUB/DIR sub/dir" expect
+'
+
+for threads in 2 3 4 7
+do
+	test_expect_success "threaded lookups ($threads threads)" "
+		GIT_TEST_NAME_HASH_THREADS=$threads lookup >actual &&
+		test_cmp expect actual
+	"
+done
+
+test_expect_success 'threaded directory counts drop with their entries' '
+	GIT_TEST_NAME_HASH_THREADS=1 lookup --remove a/b/c/ --remove e/ >expect &&
+	grep "^dir a/b/c -" expect &&
+	grep "^dir a/b a/b" expect &&
+	grep "^dir e -" expect &&
+	GIT_TEST_NAME_HASH_THREADS=4 lookup --remove a/b/c/ --remove e/ >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 're-reading the index reuses the hashes' '
+	GIT_TEST_NAME_HASH_THREADS=1 lookup >expect &&
+	GIT_TEST_NAME_HASH_THREADS=4 lookup --reread >actual &&
+	test_cmp expect actual &&
+	GIT_TEST_NAME_HASH_THREADS=4 lookup --remove e/ --reread >actual &&
+	test_cmp expect actual
+'
+
+test_done
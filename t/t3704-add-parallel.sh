@@ -0,0 +1,97 @@
+#!/bin/sh
+
+test_description='git add hashing new files in parallel
+
+Files hashed by several threads must give the same index and objects
+as those hashed one after the other.'
+
+. ./test-lib.sh
+
+# create the same files in the work tree of $1, older than "git add"
+create_files () {
+	git init -q "$1" &&
+	(
+		cd "$1" &&
+		mkdir -p a/b c &&
+		for i in $(test_seq 1 100)
+		do
+			echo "a $i" >a/file$i &&
+			echo "b $i" >a/b/file$i &&
+			printf "line one\r\nline $i\r\n" >c/text$i.txt || return 1
+		done &&
+		echo same >a/same1 &&
+		echo same >a/same2 &&
+		echo "\$Id\$" >ident &&
+		echo "filtered" >filtered &&
+		cat >.gitattributes <<-\EOF &&
+		*.txt text
+		ident ident
+		filtered filter=rot
+		EOF
+		git config filter.rot.clean "tr a-z n-za-m" &&
+		git config core.bigFileThreshold 4k &&
+		printf "%05000d\n" 0 >big &&
+		find . -name .git -prune -o -type f -print |
+		xargs test-chmtime =-60
+	)
+}
+
+test_expect_success 'setup' '
+	create_files serial &&
+	create_files parallel &&
+	(
+		cd serial &&
+		GIT_TEST_ADD_THREADS=1 git add . &&
+		git ls-files -s >../expect.index
+	)
+'
+
+test_expect_success 'new files are hashed in parallel' '
+	(
+		cd parallel &&
+		GIT_TRACE="$(pwd)/../trace" GIT_TEST_ADD_THREADS=4 git add .
+	) &&
+	grep "parallel add: 304 of 306 files hashed in 4 threads" trace &&
+	git -C parallel ls-files -s >actual &&
+	test_cmp expect.index actual &&
+	git -C parallel fsck &&
+	git -C parallel diff-files >out &&
+	test_must_be_empty out
+'
+
+test_expect_success 'converted files are stored converted' '
+	printf "line one\nline 7\n" >expect &&
+	git -C parallel cat-file blob :c/text7.txt >actual &&
+	test_cmp expect actual &&
+	echo "svygrerq" >expect &&
+	git -C parallel cat-file blob :filtered >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'recently modified files are left to add' '
+	(
+		cd parallel &&
+		for i in $(test_seq 1 100)
+		do
+			echo "new $i" >new$i || return 1
+		done &&
+		GIT_TRACE="$(pwd)/../trace" GIT_TEST_ADD_THREADS=4 git add . &&
+		git diff-files >out &&
+		test_must_be_empty out
+	) &&
+	grep "parallel add: 0 of 100 files hashed in 4 threads" trace
+'
+
+test_expect_success 'files already in the object database' '
+	create_files again &&
+	rm -rf again/.git/objects &&
+	cp -R parallel/.git/objects again/.git/objects &&
+	(
+		cd again &&
+		GIT_TEST_ADD_THREADS=4 git add . &&
+		git ls-files -s >../actual
+	) &&
+	test_cmp expect.index actual
+'
+
+test_done
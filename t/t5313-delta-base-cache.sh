@@ -0,0 +1,48 @@
+#!/bin/sh
+
+test_description='delta base cache'
+
+. ./test-lib.sh
+
+test_expect_success 'setup a deep delta chain' '
+	test_seq 1 1000 >file &&
+	git add file &&
+	test_tick &&
+	git commit -q -m 0 &&
+	for i in $(test_seq 1 50)
+	do
+		sed "s/^$i\$/change $i/" file >file.new &&
+		mv file.new file &&
+		git add file &&
+		test_tick &&
+		git commit -q -m $i || return 1
+	done &&
+	git repack -a -d -q --depth=50 --window=50 &&
+	git log -p >expect
+'
+
+test_expect_success 'bases are found in the cache' '
+	GIT_TRACE_DELTA_BASE_CACHE="$(pwd)/trace" git log -p >actual &&
+	test_cmp expect actual &&
+	grep "delta base cache: [1-9][0-9]* hits" trace
+'
+
+test_expect_success 'bases are dropped to stay within the limit' '
+	git cat-file --batch-all-objects --batch >expect.objects &&
+	rm -f trace &&
+	GIT_TRACE_DELTA_BASE_CACHE="$(pwd)/trace" \
+		git -c core.deltaBaseCacheLimit=6k \
+		cat-file --batch-all-objects --batch >actual &&
+	test_cmp expect.objects actual &&
+	grep "delta base cache: .* [1-9][0-9]* evictions" trace
+'
+
+test_expect_success 'no cache at all' '
+	git -c core.deltaBaseCacheLimit=0 log -p >actual &&
+	test_cmp expect actual &&
+	git -c core.deltaBaseCacheLimit=0 \
+		cat-file --batch-all-objects --batch >actual &&
+	test_cmp expect.objects actual
+'
+
+test_done
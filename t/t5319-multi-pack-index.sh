@@ -0,0 +1,87 @@
+#!/bin/sh
+
+test_description='multi-pack index'
+
+. ./test-lib.sh
+
+# make a commit of a new file and put its objects in a pack of their own
+commit_and_pack () {
+	echo "$1" >"$1" &&
+	git add "$1" &&
+	test_tick &&
+	git commit -q -m "$1" &&
+	git rev-list --objects HEAD^..HEAD |
+	git pack-objects -q .git/objects/pack/pack >/dev/null &&
+	git prune-packed
+}
+
+test_expect_success 'setup' '
+	echo base >base &&
+	git add base &&
+	test_tick &&
+	git commit -q -m base &&
+	git repack -q -d &&
+	for i in 1 2 3 4 5
+	do
+		commit_and_pack file$i || return 1
+	done &&
+	test_path_is_missing .git/objects/pack/multi-pack-index &&
+	git cat-file --batch-all-objects --batch-check >expect.objects
+'
+
+test_expect_success 'write and verify a multi-pack index' '
+	git multi-pack-index write &&
+	test_path_is_file .git/objects/pack/multi-pack-index &&
+	git multi-pack-index verify &&
+	git count-objects -v >out &&
+	grep "^garbage: 0" out
+'
+
+test_expect_success 'objects are found through the multi-pack index' '
+	GIT_TRACE="$(pwd)/trace" git log -p >/dev/null &&
+	grep "multi-pack index: 18 objects in 6 packs" trace &&
+	git cat-file --batch-all-objects --batch-check >actual &&
+	test_cmp expect.objects actual &&
+	git fsck &&
+	test_must_fail git cat-file -e $(echo missing | git hash-object --stdin)
+'
+
+test_expect_success 'packs added later are searched too' '
+	commit_and_pack file6 &&
+	git cat-file -e HEAD:file6 &&
+	git log -p >/dev/null &&
+	git multi-pack-index verify
+'
+
+test_expect_success 'an object in several packs' '
+	git rev-list --objects --all |
+	git pack-objects -q .git/objects/pack/pack >/dev/null &&
+	git multi-pack-index write &&
+	git multi-pack-index verify &&
+	git fsck
+'
+
+test_expect_success 'verify notices a corrupt index' '
+	cp .git/objects/pack/multi-pack-index midx.good &&
+	chmod +w .git/objects/pack/multi-pack-index &&
+	printf "\377" |
+	dd of=.git/objects/pack/multi-pack-index bs=1 seek=1100 conv=notrunc &&
+	test_must_fail git multi-pack-index verify &&
+	cp midx.good .git/objects/pack/multi-pack-index
+'
+
+test_expect_success 'an index listing a missing pack is not used' '
+	pack=$(ls .git/objects/pack/pack-*.pack | head -n 1) &&
+	mv "$pack" . &&
+	GIT_TRACE="$(pwd)/trace" git rev-list --objects --all >/dev/null &&
+	grep "multi-pack index: .* is missing, not used" trace &&
+	mv "$(basename "$pack")" .git/objects/pack/
+'
+
+test_expect_success 'repack -d removes the index' '
+	git repack -q -a -d &&
+	test_path_is_missing .git/objects/pack/multi-pack-index &&
+	git fsck
+'
+
+test_done
@@ -35,7 +35,7 @@ test_expect_success 'untracked cache is empty' '
 	cat >../expect <<EOF &&
 info/exclude 0000000000000000000000000000000000000000
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 EOF
 	test_cmp ../expect ../actual
@@ -53,7 +53,7 @@ EOF
 cat >../dump.expect <<EOF &&
 info/exclude e69de29bb2d1d6434b8b29ae775ad8c2e48c5391
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 / 0000000000000000000000000000000000000000 recurse valid
 dthree/
@@ -137,7 +137,7 @@ test_expect_success 'verify untracked cache dump' '
 	cat >../expect <<EOF &&
 info/exclude e69de29bb2d1d6434b8b29ae775ad8c2e48c5391
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 / 0000000000000000000000000000000000000000 recurse valid
 dthree/
@@ -153,9 +153,9 @@ EOF
 	test_cmp ../expect ../actual
 '
 
-test_expect_success 'new .gitignore invalidates recursively' '
+test_expect_success 'new .ptp-gitignore invalidates recursively' '
 	avoid_racy &&
-	echo four >.gitignore &&
+	echo four >.ptp-gitignore &&
 	: >../trace &&
 	GIT_TRACE_UNTRACKED_STATS="$TRASH_DIRECTORY/trace" \
 	git status --porcelain >../actual &&
@@ -163,7 +163,7 @@ test_expect_success 'new .gitignore invalidates recursively' '
 A  done/one
 A  one
 A  two
-?? .gitignore
+?? .ptp-gitignore
 ?? dthree/
 ?? dtwo/
 ?? three
@@ -184,10 +184,10 @@ test_expect_success 'verify untracked cache dump' '
 	cat >../expect <<EOF &&
 info/exclude e69de29bb2d1d6434b8b29ae775ad8c2e48c5391
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 / e6fcc8f2ee31bae321d66afd183fcb7237afae6e recurse valid
-.gitignore
+.ptp-gitignore
 dthree/
 dtwo/
 three
@@ -210,7 +210,7 @@ test_expect_success 'new info/exclude invalidates everything' '
 A  done/one
 A  one
 A  two
-?? .gitignore
+?? .ptp-gitignore
 ?? dtwo/
 EOF
 	test_cmp ../status.expect ../actual &&
@@ -228,10 +228,10 @@ test_expect_success 'verify untracked cache dump' '
 	cat >../expect <<EOF &&
 info/exclude 13263c0978fb9fad16b2d580fb800b6d811c3ff0
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 / e6fcc8f2ee31bae321d66afd183fcb7237afae6e recurse valid
-.gitignore
+.ptp-gitignore
 dtwo/
 /done/ 0000000000000000000000000000000000000000 recurse valid
 /dthree/ 0000000000000000000000000000000000000000 recurse check_only valid
@@ -247,7 +247,7 @@ test_expect_success 'move two from tracked to untracked' '
 	cat >../expect <<EOF &&
 info/exclude 13263c0978fb9fad16b2d580fb800b6d811c3ff0
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 / e6fcc8f2ee31bae321d66afd183fcb7237afae6e recurse
 /done/ 0000000000000000000000000000000000000000 recurse valid
@@ -265,7 +265,7 @@ test_expect_success 'status after the move' '
 	cat >../status.expect <<EOF &&
 A  done/one
 A  one
-?? .gitignore
+?? .ptp-gitignore
 ?? dtwo/
 ?? two
 EOF
@@ -284,10 +284,10 @@ test_expect_success 'verify untracked cache dump' '
 	cat >../expect <<EOF &&
 info/exclude 13263c0978fb9fad16b2d580fb800b6d811c3ff0
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 / e6fcc8f2ee31bae321d66afd183fcb7237afae6e recurse valid
-.gitignore
+.ptp-gitignore
 dtwo/
 two
 /done/ 0000000000000000000000000000000000000000 recurse valid
@@ -304,7 +304,7 @@ test_expect_success 'move two from untracked to tracked' '
 	cat >../expect <<EOF &&
 info/exclude 13263c0978fb9fad16b2d580fb800b6d811c3ff0
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 / e6fcc8f2ee31bae321d66afd183fcb7237afae6e recurse
 /done/ 0000000000000000000000000000000000000000 recurse valid
@@ -323,7 +323,7 @@ test_expect_success 'status after the move' '
 A  done/one
 A  one
 A  two
-?? .gitignore
+?? .ptp-gitignore
 ?? dtwo/
 EOF
 	test_cmp ../status.expect ../actual &&
@@ -341,10 +341,10 @@ test_expect_success 'verify untracked cache dump' '
 	cat >../expect <<EOF &&
 info/exclude 13263c0978fb9fad16b2d580fb800b6d811c3ff0
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 / e6fcc8f2ee31bae321d66afd183fcb7237afae6e recurse valid
-.gitignore
+.ptp-gitignore
 dtwo/
 /done/ 0000000000000000000000000000000000000000 recurse valid
 /dthree/ 0000000000000000000000000000000000000000 recurse check_only valid
@@ -355,10 +355,10 @@ EOF
 '
 
 test_expect_success 'set up for sparse checkout testing' '
-	echo two >done/.gitignore &&
-	echo three >>done/.gitignore &&
+	echo two >done/.ptp-gitignore &&
+	echo three >>done/.ptp-gitignore &&
 	echo two >done/two &&
-	git add -f done/two done/.gitignore &&
+	git add -f done/two done/.ptp-gitignore &&
 	git commit -m "first commit"
 '
 
@@ -367,7 +367,7 @@ test_expect_success 'status after commit' '
 	GIT_TRACE_UNTRACKED_STATS="$TRASH_DIRECTORY/trace" \
 	git status --porcelain >../actual &&
 	cat >../status.expect <<EOF &&
-?? .gitignore
+?? .ptp-gitignore
 ?? dtwo/
 EOF
 	test_cmp ../status.expect ../actual &&
@@ -385,10 +385,10 @@ test_expect_success 'untracked cache correct after commit' '
 	cat >../expect <<EOF &&
 info/exclude 13263c0978fb9fad16b2d580fb800b6d811c3ff0
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 / e6fcc8f2ee31bae321d66afd183fcb7237afae6e recurse valid
-.gitignore
+.ptp-gitignore
 dtwo/
 /done/ 0000000000000000000000000000000000000000 recurse valid
 /dthree/ 0000000000000000000000000000000000000000 recurse check_only valid
@@ -404,7 +404,7 @@ test_expect_success 'set up sparse checkout' '
 	git checkout master &&
 	git update-index --force-untracked-cache &&
 	git status --porcelain >/dev/null && # prime the cache
-	test_path_is_missing done/.gitignore &&
+	test_path_is_missing done/.ptp-gitignore &&
 	test_path_is_file done/one
 '
 
@@ -412,17 +412,19 @@ test_expect_success 'create/modify files, some of which are gitignored' '
 	echo two bis >done/two &&
 	echo three >done/three && # three is gitignored
 	echo four >done/four && # four is gitignored at a higher level
-	echo five >done/five # five is not gitignored
+	echo five >done/five && # five is not gitignored
+	# put the changes, and the checkout before them, apart from the
+	# status that primed the cache, however fast the tests run
+	test-chmtime =-60 done/two done/three done/four done/five done .
 '
 
 test_expect_success 'test sparse status with untracked cache' '
 	: >../trace &&
-	avoid_racy &&
 	GIT_TRACE_UNTRACKED_STATS="$TRASH_DIRECTORY/trace" \
 	git status --porcelain >../status.actual &&
 	cat >../status.expect <<EOF &&
  M done/two
-?? .gitignore
+?? .ptp-gitignore
 ?? done/five
 ?? dtwo/
 EOF
@@ -441,10 +443,10 @@ test_expect_success 'untracked cache correct after status' '
 	cat >../expect <<EOF &&
 info/exclude 13263c0978fb9fad16b2d580fb800b6d811c3ff0
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 / e6fcc8f2ee31bae321d66afd183fcb7237afae6e recurse valid
-.gitignore
+.ptp-gitignore
 dtwo/
 /done/ 1946f0437f90c5005533cbe1736a6451ca301714 recurse valid
 five
@@ -462,7 +464,7 @@ test_expect_success 'test sparse status again with untracked cache' '
 	git status --porcelain >../status.actual &&
 	cat >../status.expect <<EOF &&
  M done/two
-?? .gitignore
+?? .ptp-gitignore
 ?? done/five
 ?? dtwo/
 EOF
@@ -489,7 +491,7 @@ test_expect_success 'test sparse status with untracked cache and subdir' '
 	git status --porcelain >../status.actual &&
 	cat >../status.expect <<EOF &&
  M done/two
-?? .gitignore
+?? .ptp-gitignore
 ?? done/five
 ?? done/sub/
 ?? dtwo/
@@ -509,10 +511,10 @@ test_expect_success 'verify untracked cache dump (sparse/subdirs)' '
 	cat >../expect <<EOF &&
 info/exclude 13263c0978fb9fad16b2d580fb800b6d811c3ff0
 core.excludesfile 0000000000000000000000000000000000000000
-exclude_per_dir .gitignore
+exclude_per_dir .ptp-gitignore
 flags 00000006
 / e6fcc8f2ee31bae321d66afd183fcb7237afae6e recurse valid
-.gitignore
+.ptp-gitignore
 dtwo/
 /done/ 1946f0437f90c5005533cbe1736a6451ca301714 recurse valid
 five
@@ -549,7 +551,7 @@ test_expect_success 'move entry in subdir from untracked to cached' '
 	cat >../status.expect <<EOF &&
  M done/two
 A  dtwo/two
-?? .gitignore
+?? .ptp-gitignore
 ?? done/five
 ?? done/sub/
 EOF
@@ -561,7 +563,7 @@ test_expect_success 'move entry in subdir from cached to untracked' '
 	git status --porcelain >../status.actual &&
 	cat >../status.expect <<EOF &&
  M done/two
-?? .gitignore
+?? .ptp-gitignore
 ?? done/five
 ?? done/sub/
 ?? dtwo/
@@ -569,4 +571,84 @@ EOF
 	test_cmp ../status.expect ../status.actual
 '
 
+test_expect_success 'core.untrackedCache adds the cache by default' '
+	git init ../default &&
+	(
+		cd ../default &&
+		mkdir -p dir/sub untracked-dir &&
+		: >tracked &&
+		: >dir/sub/tracked &&
+		: >untracked-dir/file &&
+		test-dump-untracked-cache >../actual &&
+		echo "no untracked cache" >../expect &&
+		test_cmp ../expect ../actual &&
+		git add tracked dir/sub/tracked &&
+		test-dump-untracked-cache >../actual &&
+		grep "^exclude_per_dir .ptp-gitignore$" ../actual
+	)
+'
+
+test_expect_success 'status skips readdir of unchanged directories' '
+	(
+		cd ../default &&
+		avoid_racy &&
+		git status --porcelain >../status.actual &&
+		avoid_racy &&
+		: >../trace &&
+		GIT_TRACE_UNTRACKED_STATS="$TRASH_DIRECTORY/trace" \
+		git status --porcelain >../status.actual &&
+		cat >../status.expect <<EOF &&
+A  dir/sub/tracked
+A  tracked
+?? untracked-dir/
+EOF
+		test_cmp ../status.expect ../status.actual &&
+		cat >../trace.expect <<EOF &&
+node creation: 0
+gitignore invalidation: 0
+directory invalidation: 0
+opendir: 0
+EOF
+		test_cmp ../trace.expect ../trace
+	)
+'
+
+test_expect_success 'core.untrackedCache=keep leaves the index alone' '
+	(
+		cd ../default &&
+		git update-index --no-untracked-cache 2>../err &&
+		test_must_be_empty ../err &&
+		git -c core.untrackedCache=keep status --porcelain >/dev/null &&
+		test-dump-untracked-cache >../actual &&
+		echo "no untracked cache" >../expect &&
+		test_cmp ../expect ../actual
+	)
+'
+
+test_expect_success 'update-index warns when core.untrackedCache is true' '
+	(
+		cd ../default &&
+		git -c core.untrackedCache=true \
+			update-index --no-untracked-cache 2>../err &&
+		test_i18ngrep "core.untrackedCache is true" ../err &&
+		git -c core.untrackedCache=keep status --porcelain >/dev/null &&
+		test-dump-untracked-cache >../actual &&
+		echo "no untracked cache" >../expect &&
+		test_cmp ../expect ../actual
+	)
+'
+
+test_expect_success 'core.untrackedCache=false removes the cache' '
+	(
+		cd ../default &&
+		git status --porcelain >/dev/null &&
+		test-dump-untracked-cache >../actual &&
+		grep "^exclude_per_dir .ptp-gitignore$" ../actual &&
+		git -c core.untrackedCache=false status --porcelain >/dev/null &&
+		test-dump-untracked-cache >../actual &&
+		echo "no untracked cache" >../expect &&
+		test_cmp ../expect ../actual
+	)
+'
+
 test_done
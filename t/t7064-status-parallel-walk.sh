@@ -0,0 +1,78 @@
+#!/bin/sh
+
+test_description='untracked files found by a parallel directory walk'
+
+. ./test-lib.sh
+
+# Run "$@" once with a single-threaded walk and once with several
+# walker threads, and insist that both see the same thing.
+test_walk_agrees () {
+	GIT_TEST_UNTRACKED_THREADS=1 "$@" >expect &&
+	GIT_TEST_UNTRACKED_THREADS=4 "$@" >actual &&
+	test_cmp expect actual
+}
+
+test_expect_success 'setup' '
+	for d in a b c d e f g
+	do
+		mkdir -p $d/sub/deeper &&
+		echo tracked >$d/tracked &&
+		echo untracked >$d/untracked &&
+		echo deep >$d/sub/deeper/file &&
+		echo junk >$d/sub/junk.o || return 1
+	done &&
+	mkdir -p ignored-dir/nested untracked-dir/nested empty &&
+	echo x >ignored-dir/nested/file &&
+	echo y >untracked-dir/nested/file &&
+	echo "*.o" >.ptp-gitignore &&
+	echo "!b/sub/junk.o" >>.ptp-gitignore &&
+	echo "ignored-dir/" >>.ptp-gitignore &&
+	echo "deeper/" >c/.ptp-gitignore &&
+	echo top >untracked-top &&
+	printf "expect\nactual\n" >.git/info/exclude &&
+	git add .ptp-gitignore c/.ptp-gitignore */tracked &&
+	git commit -q -m initial
+'
+
+test_expect_success 'status agrees with a single-threaded walk' '
+	test_walk_agrees git status --porcelain &&
+	grep "^?? a/sub/$" actual &&
+	grep "^?? untracked-dir/$" actual &&
+	! grep ignored-dir actual
+'
+
+test_expect_success 'status -uall agrees with a single-threaded walk' '
+	test_walk_agrees git status --porcelain -uall &&
+	grep "^?? b/sub/junk.o$" actual &&
+	! grep "^?? a/sub/junk.o$" actual &&
+	! grep "^?? c/sub/deeper/file$" actual
+'
+
+test_expect_success 'ignored files agree with a single-threaded walk' '
+	test_walk_agrees git status --porcelain --ignored -uall &&
+	grep "^!! a/sub/junk.o$" actual &&
+	grep "^!! ignored-dir/nested/file$" actual
+'
+
+test_expect_success 'ls-files agrees with a single-threaded walk' '
+	test_walk_agrees git ls-files -o --exclude-standard --directory &&
+	test_walk_agrees git ls-files -o -i --exclude-standard
+'
+
+test_expect_success 'walk from a subdirectory and with a pathspec' '
+	(
+		cd d &&
+		test_walk_agrees git status --porcelain -uall
+	) &&
+	test_walk_agrees git status --porcelain -uall a b "f/sub"
+'
+
+test_expect_success 'walk with the untracked cache' '
+	git update-index --untracked-cache &&
+	test_walk_agrees git status --porcelain -uall &&
+	echo more >e/sub/more &&
+	test_walk_agrees git status --porcelain -uall &&
+	grep "^?? e/sub/more$" actual
+'
+
+test_done
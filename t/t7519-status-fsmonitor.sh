@@ -0,0 +1,121 @@
+#!/bin/sh
+
+test_description='git status with file system watcher'
+
+. ./test-lib.sh
+
+test -z "$NO_UNIX_SOCKETS" || {
+	skip_all='skipping fsmonitor tests, unix sockets not available'
+	test_done
+}
+
+# The fake watcher reports whatever we append to "changes" and
+# nothing else, so a change we do not report must go unnoticed.
+start_fsmonitor () {
+	test-fsmonitor serve "$TRASH_DIRECTORY/fsmonitor.sock" \
+		"$TRASH_DIRECTORY/changes" &&
+	git config core.fsmonitor "$TRASH_DIRECTORY/fsmonitor.sock"
+}
+
+stop_fsmonitor () {
+	test-fsmonitor quit "$TRASH_DIRECTORY/fsmonitor.sock"
+}
+
+# don't leave a stale daemon running
+trap 'code=$?; stop_fsmonitor 2>/dev/null; (exit $code); die' EXIT
+
+test_expect_success 'setup' '
+	mkdir dir1 dir2 &&
+	echo 1 >tracked &&
+	echo 1 >modified &&
+	echo 1 >dir1/tracked &&
+	echo 1 >dir1/modified &&
+	echo 1 >dir2/tracked &&
+	cat >.git/info/exclude <<-\EOF &&
+	.git
+	changes
+	fsmonitor.sock
+	actual*
+	expect
+	EOF
+	git add tracked modified dir1 dir2 &&
+	git commit -m initial &&
+	: >changes &&
+	start_fsmonitor
+'
+
+test_expect_success 'index gets the fsmonitor extension' '
+	git status &&
+	test-dump-fsmonitor >actual &&
+	grep "^fsmonitor last update fake\.[0-9]*:" actual &&
+	echo "+++++" >expect &&
+	tail -n 1 actual >actual.bits &&
+	test_cmp expect actual.bits
+'
+
+test_expect_success 'unreported changes are trusted to be absent' '
+	test_tick &&
+	echo 22 >modified &&
+	git diff-files --name-only >actual &&
+	test_must_be_empty actual
+'
+
+test_expect_success 'reported changes are seen' '
+	echo modified >>changes &&
+	git diff-files --name-only >actual &&
+	echo modified >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'reported directory renames invalidate the entries below' '
+	echo 22 >dir1/modified &&
+	echo dir1/ >>changes &&
+	git diff-files --name-only >actual &&
+	printf "%s\n" dir1/modified modified >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'update-index --chmod invalidates the entry' '
+	git update-index --chmod=+x tracked &&
+	git diff-files --name-only >actual &&
+	printf "%s\n" dir1/modified modified tracked >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'unknown token means everything changed' '
+	git reset --hard &&
+	git status &&
+	echo 333 >dir2/tracked &&
+	stop_fsmonitor &&
+	start_fsmonitor &&
+	git diff-files --name-only >actual &&
+	echo dir2/tracked >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'untracked cache reports files only the watcher saw' '
+	git update-index --untracked-cache &&
+	git checkout dir2/tracked &&
+	git status --porcelain >actual &&
+	test_must_be_empty actual &&
+	: >dir2/new &&
+	echo dir2/new >>changes &&
+	git status --porcelain >actual &&
+	echo "?? dir2/new" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'unsetting core.fsmonitor drops the extension' '
+	git config --unset core.fsmonitor &&
+	git update-index --really-refresh &&
+	test-dump-fsmonitor >actual &&
+	echo "no fsmonitor" >expect &&
+	test_cmp expect actual
+'
+
+# we can't rely on our "trap" above working after test_done,
+# as test_done will delete the trash directory containing
+# our socket, leaving us with no way to access the daemon.
+stop_fsmonitor
+
+test_done
@@ -0,0 +1,69 @@
+#!/bin/sh
+
+test_description='threaded refresh of the index'
+
+. ./test-lib.sh
+
+# Make every entry racily clean: the files and the index all carry
+# the same timestamp, so only their contents can tell them apart.
+make_racy () {
+	find . -path ./.git -prune -o -type f -print |
+	xargs test-chmtime =1234567890 &&
+	test-chmtime =1234567890 .git/index
+}
+
+test_expect_success 'setup' '
+	for d in a b c d e f
+	do
+		mkdir $d &&
+		for f in 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19
+		do
+			echo "$d/$f" >$d/$f || return 1
+		done
+	done &&
+	git add . &&
+	git commit -q -m initial &&
+	git config core.preloadindex true
+'
+
+test_expect_success 'threaded refresh sees through racily clean entries' '
+	make_racy &&
+	GIT_TEST_PRELOAD_THREADS=4 git update-index --refresh &&
+	git diff-files --exit-code
+'
+
+test_expect_success 'threaded refresh catches same-size change in racy entry' '
+	test_when_finished "git checkout -- c/7" &&
+	echo "C/7" >c/7 &&
+	make_racy &&
+	test_must_fail env GIT_TEST_PRELOAD_THREADS=4 \
+		git update-index --refresh >actual &&
+	echo "c/7: needs update" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'threaded and serial status agree' '
+	test_when_finished "git reset -q --hard" &&
+	echo "A/1" >a/1 &&
+	echo changed >f/19 &&
+	rm d/3 &&
+	git add f/19 &&
+	make_racy &&
+	git -c core.preloadindex=false status --porcelain >expect &&
+	make_racy &&
+	GIT_TEST_PRELOAD_THREADS=3 git status --porcelain >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'racy entries that need conversion are still clean' '
+	test_when_finished "rm -f .gitattributes && git reset -q --hard" &&
+	echo "b/* text eol=crlf" >.gitattributes &&
+	printf "b/4\r\n" >b/4 &&
+	git add .gitattributes b/4 &&
+	printf "b/4\r\n" >b/4 &&
+	make_racy &&
+	GIT_TEST_PRELOAD_THREADS=4 git update-index --refresh &&
+	git diff-files --exit-code
+'
+
+test_done
@@ -0,0 +1,35 @@
+#include "cache.h"
+#include "ewah/ewok.h"
+
+static void mark_dirty(size_t pos, void *data)
+{
+	struct strbuf *bits = data;
+
+	if (pos < bits->len)
+		bits->buf[pos] = '-';
+}
+
+int main(int ac, char **av)
+{
+	struct index_state *istate = &the_index;
+	struct strbuf bits = STRBUF_INIT;
+	int i;
+
+	/* look at the extension as written, without asking the daemon */
+	setup_git_directory();
+	if (do_read_index(istate, get_index_file(), 0) < 0)
+		die("unable to read index file");
+	if (!istate->fsmonitor_last_update) {
+		printf("no fsmonitor\n");
+		return 0;
+	}
+	printf("fsmonitor last update %s\n", istate->fsmonitor_last_update);
+
+	for (i = 0; i < istate->cache_nr; i++)
+		strbuf_addch(&bits, '+');
+	if (istate->fsmonitor_dirty)
+		ewah_each_bit(istate->fsmonitor_dirty, mark_dirty, &bits);
+	printf("%s\n", bits.buf);
+
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * A fake filesystem monitor daemon for the test suite.
+ *
+ * Instead of watching the working tree, it reports the paths that the
+ * test script appends (one per line) to a "changes" file, with the same
+ * token semantics as git-fsmonitor--daemon.
+ */
+#include "cache.h"
+#include "string-list.h"
+#include "unix-socket.h"
+
+static const char usage_str[] =
+	"test-fsmonitor (serve <socket> <changes-file> | quit <socket>)";
+
+static struct string_list changes = STRING_LIST_INIT_DUP;
+static const char *changes_file;
+static long changes_offset;
+static uintmax_t seq = 1;
+/* "fake.<pid>", so that a restarted fake does not accept old tokens */
+static struct strbuf instance = STRBUF_INIT;
+
+/* pick up whatever the test appended since we last looked */
+static void read_changes(void)
+{
+	struct strbuf line = STRBUF_INIT;
+	FILE *fp = fopen(changes_file, "r");
+
+	if (!fp)
+		return;
+	if (fseek(fp, changes_offset, SEEK_SET) < 0)
+		die_errno("cannot seek in '%s'", changes_file);
+	while (strbuf_getline(&line, fp, '\n') != EOF) {
+		struct string_list_item *item;
+		item = string_list_insert(&changes, line.buf);
+		item->util = (void *)(uintptr_t)seq;
+	}
+	changes_offset = ftell(fp);
+	fclose(fp);
+	strbuf_release(&line);
+}
+
+static void answer_query(const char *token, FILE *out)
+{
+	uintmax_t since = 0;
+	const char *p;
+	int i;
+
+	read_changes();
+	fprintf(out, "%s:%"PRIuMAX, instance.buf, seq);
+	fputc('\0', out);
+	if (!skip_prefix(token, instance.buf, &p) || *p++ != ':') {
+		fputs("/", out);
+		fputc('\0', out);
+	} else {
+		since = strtoumax(p, NULL, 10);
+		for (i = 0; i < changes.nr; i++) {
+			if ((uintptr_t)changes.items[i].util <= since)
+				continue;
+			fputs(changes.items[i].string, out);
+			fputc('\0', out);
+		}
+	}
+	seq++;
+}
+
+static int serve(const char *socket_path)
+{
+	int fd = unix_stream_listen(socket_path);
+
+	if (fd < 0)
+		die_errno("unable to bind to '%s'", socket_path);
+	if (daemonize())
+		die_errno("unable to daemonize");
+	strbuf_addf(&instance, "fake.%"PRIuMAX, (uintmax_t)getpid());
+
+	for (;;) {
+		struct strbuf request = STRBUF_INIT;
+		int client = accept(fd, NULL, NULL);
+		FILE *in, *out;
+		const char *p;
+
+		if (client < 0)
+			die_errno("accept failed");
+		in = xfdopen(client, "r");
+		out = xfdopen(xdup(client), "w");
+		strbuf_getline(&request, in, '\n');
+		if (skip_prefix(request.buf, "query 1 ", &p))
+			answer_query(p, out);
+		else if (!strcmp(request.buf, "query 1"))
+			answer_query("", out);
+		else if (!strcmp(request.buf, "quit")) {
+			unlink(socket_path);
+			return 0;
+		}
+		fclose(in);
+		fclose(out);
+		strbuf_release(&request);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 4 && !strcmp(argv[1], "serve")) {
+		changes_file = xstrdup(absolute_path(argv[3]));
+		return serve(xstrdup(absolute_path(argv[2])));
+	}
+	if (argc == 3 && !strcmp(argv[1], "quit")) {
+		int fd = unix_stream_connect(argv[2]);
+		if (fd < 0)
+			die_errno("unable to connect to '%s'", argv[2]);
+		write_or_die(fd, "quit\n", 5);
+		close(fd);
+		return 0;
+	}
+	usage(usage_str);
+}
@@ -0,0 +1,51 @@
+#include "cache.h"
+
+/*
+ * Usage: test-lazy-init-name-hash [--reread] [--remove <prefix>]... <path>...
+ *
+ * Look the paths up as files and as directories in the name hash of
+ * the index.  --reread discards the index and reads it again after the
+ * hash was built once; --remove drops the entries whose names start
+ * with <prefix> from the hash before the lookups.
+ */
+int main(int ac, char **av)
+{
+	struct cache_entry *ce;
+	int i, reread = 0;
+
+	setup_git_directory();
+	git_config(git_default_config, NULL);
+	if (read_cache() < 0)
+		die("unable to read index file");
+	lazy_init_name_hash(&the_index);
+
+	for (i = 1; i < ac; i++) {
+		if (!strcmp(av[i], "--reread"))
+			reread = 1;
+		else if (!strcmp(av[i], "--remove") && i + 1 < ac) {
+			const char *prefix = av[++i];
+			int nr;
+
+			for (nr = 0; nr < active_nr; nr++)
+				if (starts_with(active_cache[nr]->name, prefix))
+					remove_name_hash(&the_index,
+							 active_cache[nr]);
+		} else
+			break;
+	}
+
+	if (reread) {
+		discard_cache_to_reread();
+		if (read_cache() < 0)
+			die("unable to read index file");
+	}
+
+	for (; i < ac; i++) {
+		ce = index_file_exists(&the_index, av[i], strlen(av[i]), 1);
+		printf("file %s %s\n", av[i], ce ? ce->name : "-");
+		ce = index_dir_exists(&the_index, av[i], strlen(av[i]));
+		printf("dir %s %.*s\n", av[i], ce ? (int)strlen(av[i]) : 1,
+		       ce ? ce->name : "-");
+	}
+	return 0;
+}
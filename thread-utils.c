@@ -75,3 +75,19 @@ int init_recursive_mutex(pthread_mutex_t *m)
 	}
 	return ret;
 }
+
+int thread_count(const char *test_env, int workers, int nr, int cost, int max)
+{
+	int threads = git_env_ulong(test_env, 0);
+
+	if (!threads) {
+		threads = workers > 0 ? workers : online_cpus();
+		if (threads > nr / cost)
+			threads = nr / cost;
+	}
+	if (threads > nr)
+		threads = nr;
+	if (threads > max)
+		threads = max;
+	return threads;
+}
@@ -7,6 +7,16 @@
 extern int online_cpus(void);
 extern int init_recursive_mutex(pthread_mutex_t*);
 
+/*
+ * The number of threads to share "nr" items among: "workers", or one
+ * per CPU if that is not positive, but no more than one per "cost"
+ * items and no more than "max".  A positive number in the environment
+ * variable "test_env" (GIT_TEST_*_THREADS) stands for the first two,
+ * so that the tests can ask for threads on tiny inputs.
+ */
+extern int thread_count(const char *test_env, int workers,
+			int nr, int cost, int max);
+
 #else
 
 #define online_cpus() 1
@@ -112,20 +112,11 @@ static int do_add_entry(struct unpack_trees_options *o, struct cache_entry *ce,
 			       ADD_CACHE_OK_TO_ADD | ADD_CACHE_OK_TO_REPLACE);
 }
 
-static struct cache_entry *dup_entry(const struct cache_entry *ce)
-{
-	unsigned int size = ce_size(ce);
-	struct cache_entry *new = xmalloc(size);
-
-	memcpy(new, ce, size);
-	return new;
-}
-
 static void add_entry(struct unpack_trees_options *o,
 		      const struct cache_entry *ce,
 		      unsigned int set, unsigned int clear)
 {
-	do_add_entry(o, dup_entry(ce), set, clear);
+	do_add_entry(o, dup_cache_entry(ce, &o->result), set, clear);
 }
 
 /*
@@ -185,6 +176,8 @@ static void unlink_entry(const struct cache_entry *ce)
 }
 
 static struct checkout state;
+static unsigned int unpacked_by_cache_tree;
+
 static int check_updates(struct unpack_trees_options *o)
 {
 	unsigned cnt = 0, total = 0;
@@ -220,6 +213,10 @@ static int check_updates(struct unpack_trees_options *o)
 	remove_marked_cache_entries(&o->result);
 	remove_scheduled_dirs();
 
+	if (o->update && !o->dry_run) {
+		start_checkout_dir_cache();
+		start_parallel_checkout();
+	}
 	for (i = 0; i < index->cache_nr; i++) {
 		struct cache_entry *ce = index->cache[i];
 
@@ -234,6 +231,8 @@ static int check_updates(struct unpack_trees_options *o)
 			}
 		}
 	}
+	errs |= finish_parallel_checkout();
+	finish_checkout_dir_cache();
 	stop_progress(&progress);
 	if (o->update)
 		git_attr_set_direction(GIT_ATTR_CHECKIN, NULL);
@@ -450,6 +449,115 @@ static int switch_cache_bottom(struct traverse_info *info)
 	return ret;
 }
 
+/*
+ * When every tree has directory "names" with the same tree object,
+ * and the cache tree of the index says it has that tree there too,
+ * return the number of index entries below it, which are then all
+ * that the trees have below it as well.  Return 0 when the trees have
+ * to be read.
+ */
+static int all_trees_same_as_cache_tree(int n, unsigned long dirmask,
+					struct name_entry *names,
+					struct traverse_info *info)
+{
+	struct unpack_trees_options *o = info->data;
+	int i;
+
+	if (!o->merge || o->diff_index_cached || o->prefix ||
+	    info->pathspec || dirmask != (1ul << n) - 1)
+		return 0;
+	for (i = 1; i < n; i++)
+		if (hashcmp(names[i].sha1, names[0].sha1))
+			return 0;
+	return cache_tree_matches_traversal(o->src_index->cache_tree,
+					    names, info);
+}
+
+/*
+ * The position of the first of the "nr" index entries below the
+ * directory "names", or -1 if they are not where the cache tree says.
+ */
+static int index_pos_by_traverse_info(struct name_entry *names,
+				      struct traverse_info *info, int nr)
+{
+	struct unpack_trees_options *o = info->data;
+	struct index_state *istate = o->src_index;
+	int len = traverse_path_len(info, names) + 1;
+	char *name = xmalloc(len + 1);
+	int pos;
+
+	make_traverse_path(name, info, names);
+	name[len - 1] = '/';
+	name[len] = '\0';
+	pos = index_name_pos(istate, name, len);
+	if (pos < 0)
+		pos = -pos - 1;
+	else
+		pos = -1;
+	if (pos < 0 || istate->cache_nr < pos + nr ||
+	    strncmp(istate->cache[pos]->name, name, len) ||
+	    strncmp(istate->cache[pos + nr - 1]->name, name, len) ||
+	    (pos + nr < istate->cache_nr &&
+	     !strncmp(istate->cache[pos + nr]->name, name, len)))
+		pos = -1;
+	free(name);
+	return pos;
+}
+
+/*
+ * Unpack the "nr" index entries at "pos", which are the same as what
+ * each of the "n" trees has there, without reading the trees.  A
+ * twoway merge keeps all of them as they are; other merges see each
+ * entry paired with copies of itself, as if from the trees.  Unmerged
+ * entries and D/F conflicts would have invalidated the cache tree, so
+ * there are none.
+ */
+static int traverse_by_cache_tree(int pos, int nr, int n,
+				  struct traverse_info *info)
+{
+	struct cache_entry *src[MAX_UNPACK_TREES + 1] = { NULL, };
+	struct unpack_trees_options *o = info->data;
+	struct cache_entry *tree_ce = NULL;
+	int tree_ce_size = 0;
+	int i, d;
+
+	for (i = 0; i < nr; i++) {
+		struct cache_entry *ce = o->src_index->cache[pos + i];
+		int size, rc;
+
+		if (o->fn == twoway_merge) {
+			add_entry(o, ce, 0, 0);
+			mark_ce_used(ce, o);
+			continue;
+		}
+
+		size = cache_entry_size(ce_namelen(ce));
+		if (tree_ce_size < size) {
+			tree_ce_size = size * 2;
+			tree_ce = xrealloc(tree_ce, tree_ce_size);
+		}
+		memset(tree_ce, 0, size);
+		tree_ce->ce_mode = ce->ce_mode;
+		tree_ce->ce_flags = create_ce_flags(0);
+		tree_ce->ce_namelen = ce_namelen(ce);
+		hashcpy(tree_ce->sha1, ce->sha1);
+		memcpy(tree_ce->name, ce->name, ce_namelen(ce) + 1);
+
+		src[0] = ce;
+		for (d = 1; d <= n; d++)
+			src[d] = tree_ce;
+		rc = call_unpack_fn((const struct cache_entry * const *)src, o);
+		if (rc < 0) {
+			free(tree_ce);
+			return rc;
+		}
+		mark_ce_used(ce, o);
+	}
+	free(tree_ce);
+	unpacked_by_cache_tree += nr;
+	return 0;
+}
+
 static int traverse_trees_recursive(int n, unsigned long dirmask,
 				    unsigned long df_conflicts,
 				    struct name_entry *names,
@@ -460,6 +568,15 @@ static int traverse_trees_recursive(int n, unsigned long dirmask,
 	void *buf[MAX_UNPACK_TREES];
 	struct traverse_info newinfo;
 	struct name_entry *p;
+	int nr_entries;
+
+	nr_entries = all_trees_same_as_cache_tree(n, dirmask, names, info);
+	if (nr_entries > 0 && !(info->df_conflicts | df_conflicts)) {
+		int pos = index_pos_by_traverse_info(names, info, nr_entries);
+
+		if (0 <= pos)
+			return traverse_by_cache_tree(pos, nr_entries, n, info);
+	}
 
 	p = names;
 	while (!p->mode)
@@ -549,10 +666,21 @@ static int ce_in_traverse_path(const struct cache_entry *ce,
 	return (info->pathlen < ce_namelen(ce));
 }
 
-static struct cache_entry *create_ce_entry(const struct traverse_info *info, const struct name_entry *n, int stage)
+/*
+ * Entries that only live while the merge function looks at them are
+ * "transient" and allocated on the heap; the others go straight into
+ * the result index and come from its memory pool.
+ */
+static struct cache_entry *create_ce_entry(const struct traverse_info *info,
+					   const struct name_entry *n,
+					   int stage,
+					   struct index_state *istate,
+					   int is_transient)
 {
 	int len = traverse_path_len(info, n);
-	struct cache_entry *ce = xcalloc(1, cache_entry_size(len));
+	struct cache_entry *ce = is_transient ?
+		xcalloc(1, cache_entry_size(len)) :
+		make_empty_cache_entry(istate, len);
 
 	ce->ce_mode = create_ce_mode(n->mode);
 	ce->ce_flags = create_ce_flags(stage);
@@ -598,7 +726,8 @@ static int unpack_nondirectories(int n, unsigned long mask,
 			stage = 3;
 		else
 			stage = 2;
-		src[i + o->merge] = create_ce_entry(info, names + i, stage);
+		src[i + o->merge] = create_ce_entry(info, names + i, stage,
+						    &o->result, o->merge);
 	}
 
 	if (o->merge) {
@@ -840,9 +969,21 @@ static int clear_ce_flags_dir(struct cache_entry **cache, int nr,
 {
 	struct cache_entry **cache_end;
 	int dtype = DT_DIR;
-	int ret = is_excluded_from_list(prefix->buf, prefix->len,
-					basename, &dtype, el);
-	int rc;
+	int ret, rc;
+	enum cone_match cone = CONE_MATCHED;
+
+	if (el->use_cone_patterns) {
+		/*
+		 * Cones decide a directory without looking inside; one
+		 * that is only CONE_MATCHED is in, as is_excluded_from_list()
+		 * would say, and its entries are looked at one by one.
+		 */
+		cone = match_cone_patterns(prefix->buf, prefix->len,
+					   DT_DIR, el);
+		ret = 1;
+	} else
+		ret = is_excluded_from_list(prefix->buf, prefix->len,
+					    basename, &dtype, el);
 
 	strbuf_addch(prefix, '/');
 
@@ -856,6 +997,17 @@ static int clear_ce_flags_dir(struct cache_entry **cache, int nr,
 			break;
 	}
 
+	if (cone != CONE_MATCHED) {
+		struct cache_entry **ce;
+
+		if (cone == CONE_MATCHED_RECURSIVE)
+			for (ce = cache; ce != cache_end; ce++)
+				if (!select_mask || ((*ce)->ce_flags & select_mask))
+					(*ce)->ce_flags &= ~clear_mask;
+		strbuf_setlen(prefix, prefix->len - 1);
+		return cache_end - cache;
+	}
+
 	/*
 	 * TODO: check el, if there are no patterns that may conflict
 	 * with ret (iow, we know in advance the incl/excl
@@ -1030,6 +1182,7 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 		o->skip_sparse_checkout = 1;
 	if (!o->skip_sparse_checkout) {
 		char *sparse = git_pathdup("info/sparse-checkout");
+		el.use_cone_patterns = core_sparse_checkout_cone;
 		if (add_excludes_from_file_to_list(sparse, "", 0, &el, 0) < 0)
 			o->skip_sparse_checkout = 1;
 		else
@@ -1046,6 +1199,14 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 	if (o->result.split_index)
 		o->result.split_index->refcount++;
 	hashcpy(o->result.sha1, o->src_index->sha1);
+	/*
+	 * Entries carried over from the source keep their
+	 * CE_FSMONITOR_VALID bit, so they are still described by the
+	 * source's fsmonitor token.
+	 */
+	o->result.fsmonitor_last_update =
+		xstrdup_or_null(o->src_index->fsmonitor_last_update);
+	o->result.fsmonitor_has_run_once = o->src_index->fsmonitor_has_run_once;
 	o->merge_size = len;
 	mark_all_ce_unused(o->src_index);
 
@@ -1086,8 +1247,11 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 			}
 		}
 
+		unpacked_by_cache_tree = 0;
 		if (traverse_trees(len, t, &info) < 0)
 			goto return_failed;
+		trace_printf("unpack-trees: %u entries unpacked from the "
+			     "cache tree\n", unpacked_by_cache_tree);
 	}
 
 	/* Any left-over entries in the index? */
@@ -1159,10 +1323,22 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 		}
 	}
 
+	/*
+	 * The merge functions invalidated every path they changed in the
+	 * cache tree of the source index, so what is still valid there
+	 * is valid for the result too; keep it instead of rebuilding it.
+	 */
+	if (o->merge && o->src_index == o->dst_index) {
+		o->result.cache_tree = o->src_index->cache_tree;
+		o->src_index->cache_tree = NULL;
+	}
+
 	o->src_index = NULL;
 	ret = check_updates(o) ? (-2) : 0;
 	if (o->dst_index) {
 		if (!ret) {
+			if (git_env_bool("GIT_TEST_CHECK_CACHE_TREE", 0))
+				cache_tree_verify(&o->result);
 			if (!o->result.cache_tree)
 				o->result.cache_tree = cache_tree();
 			if (!cache_tree_fully_valid(o->result.cache_tree))
@@ -1341,6 +1517,7 @@ static int verify_clean_subdirectory(const struct cache_entry *ce,
 			if (verify_uptodate(ce2, o))
 				return -1;
 			add_entry(o, ce2, CE_REMOVE, 0);
+			invalidate_ce_path(ce2, o);
 			mark_ce_used(ce2, o);
 		}
 		cnt++;
@@ -1500,7 +1677,7 @@ static int merged_entry(const struct cache_entry *ce,
 			struct unpack_trees_options *o)
 {
 	int update = CE_UPDATE;
-	struct cache_entry *merge = dup_entry(ce);
+	struct cache_entry *merge = dup_cache_entry(ce, &o->result);
 
 	if (!old) {
 		/*
@@ -1520,7 +1697,7 @@ static int merged_entry(const struct cache_entry *ce,
 
 		if (verify_absent(merge,
 				  ERROR_WOULD_LOSE_UNTRACKED_OVERWRITTEN, o)) {
-			free(merge);
+			discard_cache_entry(merge);
 			return -1;
 		}
 		invalidate_ce_path(merge, o);
@@ -1537,7 +1714,7 @@ static int merged_entry(const struct cache_entry *ce,
 			update = 0;
 		} else {
 			if (verify_uptodate(old, o)) {
-				free(merge);
+				discard_cache_entry(merge);
 				return -1;
 			}
 			/* Migrate old flags over */
@@ -1577,6 +1754,9 @@ static int keep_entry(const struct cache_entry *ce,
 		      struct unpack_trees_options *o)
 {
 	add_entry(o, ce, 0, 0);
+	/* the unmerged stages of a threeway merge come from the trees */
+	if (ce_stage(ce))
+		invalidate_ce_path(ce, o);
 	return 1;
 }
 